@@ -0,0 +1,161 @@
+ --[[
+ @file frame_ring.lua
+ @author Marcus Edel
+
+ Definition of the shared memory frame ring, see frame_ring.hpp for the
+ layout.
+ --]]
+
+local R = {};
+
+local MAGIC = 0x4653454E
+local VERSION = 1
+local HEADER_SIZE = 64
+local FORMAT_ARGB = 1
+
+-- Size of the gd image header that precedes the pixels.
+local GD_HEADER_SIZE = 11
+
+-- Ring file.
+ringFile = nil
+
+-- Ring file path.
+ringPath = nil
+
+-- Number of ring slots.
+ringSlots = 0
+
+-- Maximum number of pixel bytes per slot.
+ringCapacity = 0
+
+-- Number of the last published frame.
+ringFrame = 0
+
+-- Sequence of every slot.
+ringSequences = {}
+
+-- Encode the given number as 32 bit little-endian integer.
+-- @param value The number to encode.
+-- @return The encoded number.
+local function EncodeUInt(value)
+  return string.char(value % 256,
+                     math.floor(value / 256) % 256,
+                     math.floor(value / 65536) % 256,
+                     math.floor(value / 16777216) % 256)
+end
+
+-- Write the given data at the given offset.
+-- @param offset The offset in the ring file.
+-- @param data The data to write.
+local function Write(offset, data)
+  ringFile:seek("set", offset)
+  ringFile:write(data)
+end
+
+-- Get the size of a slot including the slot header.
+local function SlotSize()
+  return HEADER_SIZE + math.ceil(ringCapacity / HEADER_SIZE) * HEADER_SIZE
+end
+
+-- Remove the ring.
+local function Close()
+  if ringFile ~= nil then
+    ringFile:close()
+    os.remove(ringPath)
+  end
+
+  ringFile = nil
+end
+
+-- Create the ring with the given name.
+-- @param name The shared memory name, e.g. /nes-4561.
+-- @param slots The number of slots.
+-- @param capacity The maximum number of pixel bytes per frame.
+-- @param token The token chosen by the client.
+-- @return True if the ring was created.
+local function Open(name, slots, capacity, token)
+  Close()
+
+  ringPath = "/dev/shm"..name
+  ringFile = io.open(ringPath, "w+b")
+  if ringFile == nil then
+    print("Could not create the frame ring: "..ringPath)
+    return false
+  end
+
+  -- Every write has to reach the shared memory in order.
+  ringFile:setvbuf("no")
+
+  ringSlots = slots
+  ringCapacity = capacity
+  ringFrame = 0
+  ringSequences = {}
+  for i = 0, slots - 1 do
+    ringSequences[i] = 0
+  end
+
+  -- Allocate the ring, the magic is written last.
+  local size = HEADER_SIZE + slots * SlotSize()
+  Write(0, string.rep("\0", size))
+  Write(4, EncodeUInt(VERSION)..EncodeUInt(slots)..EncodeUInt(capacity)..
+           EncodeUInt(0)..EncodeUInt(token))
+  Write(0, EncodeUInt(MAGIC))
+
+  return true
+end
+
+-- Publish the given frame.
+-- @param width The width of the frame in pixels.
+-- @param height The height of the frame in pixels.
+-- @param pixels The ARGB pixels.
+-- @return The frame number or nil if the frame wasn't published.
+local function Publish(width, height, pixels)
+  if ringFile == nil or string.len(pixels) > ringCapacity then
+    return nil
+  end
+
+  local frame = ringFrame + 1
+  local slot = frame % ringSlots
+  local offset = HEADER_SIZE + slot * SlotSize()
+
+  -- The sequence is odd while the slot is written.
+  ringSequences[slot] = ringSequences[slot] + 1
+  Write(offset, EncodeUInt(ringSequences[slot]))
+
+  Write(offset + 4, EncodeUInt(frame)..EncodeUInt(width)..
+                    EncodeUInt(height)..EncodeUInt(FORMAT_ARGB)..
+                    EncodeUInt(string.len(pixels)))
+  Write(offset + HEADER_SIZE, pixels)
+
+  ringSequences[slot] = ringSequences[slot] + 1
+  Write(offset, EncodeUInt(ringSequences[slot]))
+
+  ringFrame = frame
+  Write(16, EncodeUInt(frame))
+  return frame
+end
+
+-- Publish the current screen.
+-- @return The frame number or nil if the frame wasn't published.
+local function PublishScreen()
+  -- The gd image starts with the signature, the width and the height
+  -- followed by the ARGB pixels.
+  local gdStr = gui.gdscreenshot()
+  local width = gdStr:byte(3) * 256 + gdStr:byte(4)
+  local height = gdStr:byte(5) * 256 + gdStr:byte(6)
+
+  return Publish(width, height, gdStr:sub(GD_HEADER_SIZE + 1))
+end
+
+-- Check if the ring is open.
+local function IsOpen()
+  return ringFile ~= nil
+end
+
+R.Open = Open;
+R.Close = Close;
+R.Publish = Publish;
+R.PublishScreen = PublishScreen;
+R.IsOpen = IsOpen;
+
+return R
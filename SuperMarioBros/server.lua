@@ -19,17 +19,32 @@ err = 0
 client = 0
 
 -- Function to create a socket using the given host and port.
--- @param host List on this host.
--- @param port Listen on this port.
+-- @param host List on this host, unix:<path> listens on a unix domain socket.
+-- @param port Listen on this port, ignored for unix domain sockets.
 -- @backlog The number of client connections that can be queued waiting for service.
 function Server(host, port, backlog)
-  tcp_server, err = socket.tcp();
-  if tcp_server==nil then
-    return nil, err;
+  local res, err
+  if string.sub(host, 1, 5) == "unix:" then
+    local path = string.sub(host, 6)
+    local unix = require("socket.unix")
+
+    tcp_server, err = unix.stream and unix.stream() or unix();
+    if tcp_server==nil then
+      return nil, err;
+    end
+
+    -- Remove the socket file of a previous run.
+    os.remove(path)
+    res, err = tcp_server:bind(path);
+  else
+    tcp_server, err = socket.tcp();
+    if tcp_server==nil then
+      return nil, err;
+    end
+
+    tcp_server:setoption("reuseaddr", true);
+    res, err = tcp_server:bind(host, port);
   end
-
-  tcp_server:setoption("reuseaddr", true);
-  local res, err = tcp_server:bind(host, port);
   if res==nil then
     return nil, err;
   end
@@ -67,9 +82,48 @@ local function Receive()
   return nil
 end
 
+-- Function to send a length-prefixed frame over the socket.
+-- @param data The payload to be send over the socket.
+local function SendFrame(data)
+  if client ~= nil then
+    local length = string.len(data)
+    local header = string.char(math.floor(length / 16777216) % 256,
+                               math.floor(length / 65536) % 256,
+                               math.floor(length / 256) % 256,
+                               length % 256)
+
+    client:send(header..data)
+    io.flush()
+  end
+end
+
+-- Function to receive a length-prefixed frame over the socket.
+-- @return The payload received over the socket.
+local function ReceiveFrame()
+  if client ~= nil then
+    local header = client:receive(4)
+    if header == nil then
+      return nil
+    end
+
+    local length = ((header:byte(1) * 256 + header:byte(2)) * 256 +
+        header:byte(3)) * 256 + header:byte(4)
+
+    if length == 0 then
+      return ""
+    end
+
+    return client:receive(length)
+  end
+
+  return nil
+end
+
 S.Server = Server;
 S.Accept = Accept;
 S.Send = Send;
 S.Receive = Receive;
+S.SendFrame = SendFrame;
+S.ReceiveFrame = ReceiveFrame;
 
 return S
\ No newline at end of file
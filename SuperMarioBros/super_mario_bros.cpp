@@ -7,12 +7,15 @@
 
 #include <mlpack/core.hpp>
 
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include <numeric>
 #include <string>
+#include <vector>
 
-#include "parser.hpp"
-#include "client.hpp"
-#include "messages.hpp"
+#include "parallel_evaluator.hpp"
+#include "super_mario_bros.hpp"
 
 #include <mlpack/methods/ne/parameters.hpp>
 #include <mlpack/methods/ne/tasks.hpp>
@@ -26,300 +29,239 @@
 using namespace mlpack;
 using namespace mlpack::ne;
 
-class TaskSuperMarioBros
+/**
+ * Mutate the link weights of the given genome like NEAT: every weight is
+ * perturbed by a normal distributed value scaled by the mutation size, or
+ * replaced by a normal distributed value.
+ *
+ * @param genome The genome to be mutated.
+ * @param params The parameters of the mutation.
+ */
+void MutateWeights(Genome& genome, const Parameters& params)
 {
- public:
-  /**
-   * Create the super mario bros object.
-   */
-  TaskSuperMarioBros() { /* Nothing to do here */ }
-
-  /**
-   * Create the super mario bros object using the specified host and port.
-   */
-  TaskSuperMarioBros(const std::string& host,
-                     const std::string& port) :
-      host(host),
-      port(port),
-      success(false)
+  for (size_t i = 0; i < genome.aLinkGenes.size(); ++i)
   {
-     /* Nothing to do here */
-  }
-
-  /*
-   * Send the next action to the connected server.
-   *
-   * client The client instance.
-   */
-  bool Action(const size_t action, client::Client& client)
-  {
-    try
+    LinkGene& link = genome.aLinkGenes[i];
+    if (math::Random() < params.aPerturbWeightProb)
     {
-      if (action == 0)
-      {
-        client.Send(messages::JSONMessage(messages::PressRight()));
-      }
-      else if (action == 1)
-      {
-        client.Send(messages::JSONMessage(messages::PressLeft()));
-      }
-      else if (action == 2)
-      {
-        client.Send(messages::JSONMessage(messages::PressUp()));
-      }
-      else if (action == 3)
-      {
-        client.Send(messages::JSONMessage(messages::PressDown()));
-      }
-      else if (action == 4)
-      {
-        client.Send(messages::JSONMessage(messages::PressA()));
-      }
-    }
-    catch (const std::exception& ex)
-    {
-      Log::Warn << ex.what() << std::endl;
-      return false;
+      link.Weight(link.Weight() + math::RandNormal() *
+          params.aMutateWeightSize);
     }
-    catch (...)
+    else
     {
-      Log::Warn << "Send timeout." << std::endl;
-      return false;
+      link.Weight(math::RandNormal());
     }
+  }
+}
 
-    return true;
+/**
+ * Evolve the link weights of a population that is owned by this loop, so every
+ * generation is evaluated at once using the ParallelEvaluator: every endpoint
+ * registered at the balancer plays a genome at the same time. NEAT::Evolve
+ * keeps its population private and hands the genomes to EvalFitness one at a
+ * time, so NEAT only keeps a single emulator busy; this loop is the opt-in
+ * alternative that trades the topology mutations and the speciation of NEAT
+ * for the parallel evaluation.
+ *
+ * The genomes keep the topology of the seed genome. The best genomes of a
+ * generation (the share not culled, see aCullSpeciesPercentage) survive
+ * unchanged; the rest of the population is replaced by the uniform crossover
+ * of two survivors (aCrossoverRate) or by a copy of a survivor, and the
+ * weights of an offspring are mutated with aMutateWeightProb, a copy is
+ * always mutated.
+ *
+ * @param task The task used to evaluate the genomes.
+ * @param seedGenome The genome the population is created from.
+ * @param params The population size, the number of generations and the
+ *        mutation parameters.
+ * @return True if a genome solved the task.
+ */
+bool Evolve(TaskSuperMarioBros& task, Genome& seedGenome, Parameters& params)
+{
+  evaluator::ParallelEvaluator<TaskSuperMarioBros, Genome> evaluator(task);
+  Log::Info << "Evaluating the population using " << evaluator.NumWorkers()
+      << " workers." << std::endl;
+
+  const size_t populationSize = std::max(ssize_t(params.aPopulationSize),
+      ssize_t(1));
+  const size_t survivors = std::max(size_t(std::lround(populationSize *
+      (1 - params.aCullSpeciesPercentage))), size_t(1));
+
+  // The initial population are mutated copies of the seed genome.
+  ssize_t id = seedGenome.Id();
+  std::vector<Genome> population;
+  for (size_t i = 0; i < populationSize; ++i)
+  {
+    Genome genome(++id, seedGenome.aNeuronGenes, seedGenome.aLinkGenes,
+        seedGenome.NumInput(), seedGenome.NumOutput(), -1);
+    MutateWeights(genome, params);
+    population.push_back(genome);
   }
 
-  /*
-   * Get the current game infromations from the connected server.
-   *
-   * @param client The client instance.
-   */
-  bool GameInfo(client::Client& client)
+  std::vector<Genome*> genomes(populationSize);
+  std::vector<double> fitness;
+  std::vector<size_t> order(populationSize);
+  for (ssize_t generation = 0; generation < params.aMaxGeneration;
+      ++generation)
   {
-    try
+    for (size_t i = 0; i < populationSize; ++i)
     {
-      client.Send(messages::JSONMessage(messages::GameInfo()));
-
-      std::string json;
-      client.Receive(json);
+      genomes[i] = &population[i];
+    }
 
-      parser.Parse(json);
-      parser.Tiles(tiles);
+    evaluator.Evaluate(genomes, fitness);
 
-      parser.MarioPostion(marioPostionX, marioPostionY);
-      parser.MarioLives(marioLives);
-      parser.PlayerState(playerState);
+    // The fitness is minimized; ties keep the order of the population.
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+        [&fitness](const size_t a, const size_t b)
+        { return fitness[a] < fitness[b]; });
 
-    }
-    catch (const std::exception& ex)
-    {
-      Log::Warn << ex.what() << std::endl;
-      return false;
-    }
-    catch (...)
+    for (size_t i = 0; i < populationSize; ++i)
     {
-      Log::Warn << "Receive timeout." << std::endl;
-      return false;
+      population[i].Fitness(fitness[i]);
     }
 
-    return true;
-  }
+    std::cout << "Generation: " << generation << "\tBest fitness: "
+        << fitness[order[0]] << std::endl;
 
-  /*
-   * Fill the input vector with the screen infromations.
-   *
-   * @param input The vector used to store the game screen informations.
-   */
-  void DiscreteActuator(std::vector<double>& input)
-  {
-    for (size_t i = 0; i < tiles.n_elem; ++i)
+    if (task.Success()) return true;
+
+    std::vector<Genome> next;
+    for (size_t i = 0; i < survivors; ++i)
     {
-      input.push_back(tiles(i));
+      next.push_back(population[order[i]]);
     }
 
-    input.push_back(1.0);
-  }
-
-  /*
-   * Connect to the server instance and reset the game state.
-   *
-   * @param client The client instance.
-   */
-  bool Reset(client::Client& client)
-  {
-    try
+    while (next.size() < populationSize)
     {
-      client::Client clientMaster;
-      clientMaster.Connect(host, port);
+      Genome& parent = next[math::RandInt(survivors)];
+      Genome child(++id, parent.aNeuronGenes, parent.aLinkGenes,
+          parent.NumInput(), parent.NumOutput(), -1);
 
-      clientMaster.Send(messages::GetEndpoint());
-      std::string json;
-      clientMaster.Receive(json);
-
-      parser.Parse(json);
-      parser.Endpoint(hostEndpoint, portEndpoint);
+      bool crossed = false;
+      if (survivors > 1 && math::Random() < params.aCrossoverRate)
+      {
+        const Genome& other = next[math::RandInt(survivors)];
+        for (size_t i = 0; i < child.aLinkGenes.size(); ++i)
+        {
+          if (math::Random() < 0.5)
+          {
+            child.aLinkGenes[i].Weight(other.aLinkGenes[i].Weight());
+          }
+        }
+        crossed = true;
+      }
 
-      // Check if local balancer.
-      if (hostEndpoint == "*") hostEndpoint = host;
+      if (!crossed || math::Random() < params.aMutateWeightProb)
+      {
+        MutateWeights(child, params);
+      }
 
-      client.Connect(hostEndpoint, portEndpoint);
-      client.Send(messages::JSONMessage(messages::ConfigSpeed("maximum")));
-      client.Send(messages::JSONMessage(messages::ConfigDivisor(2)));
-      client.Send(messages::JSONMessage(messages::PressRight()));
-      client.Send(messages::JSONMessage(messages::GameReset()));
-    }
-    catch (const std::exception& ex)
-    {
-      Log::Warn << ex.what() << std::endl;
-      return false;
-    }
-    catch (...)
-    {
-      Log::Warn << "Send timeout." << std::endl;
-      return false;
+      next.push_back(child);
     }
 
-    return true;
+    population.swap(next);
   }
 
-  // Whether task success or not.
-  bool Success()
+  return task.Success();
+}
+
+int main(int argc, char* argv[])
+{
+  mlpack::math::RandomSeed(1);
+
+  const std::string usage = "Usage: <host> <port> [json|binary] [ga] "
+      "[prefix] [racing[=<top-k>[:<quantile>]]] [record=<trajectory log>] "
+      "[cache=<fitness cache>]";
+  if (argc < 3)
   {
-    return success;
+    Log::Fatal << usage << std::endl;
+    return 1;
   }
 
-  /*
-   * Check if mario dies.
-   */
-  bool IsDead()
+  std::string host(argv[1]);
+  std::string port(argv[2]);
+
+  // Use the JSON protocol for debugging purposes.
+  messages::Protocol protocol = messages::BINARY;
+  bool prefix = false;
+  bool ga = false;
+  size_t topK = 0;
+  double quantile = 1;
+  std::string cache;
+  std::string record;
+  for (int i = 3; i < argc; ++i)
   {
-    if (playerState == 11 || arma::accu(tiles) == 3)
+    const std::string argument(argv[i]);
+    if (argument == "json")
     {
-      return true;
+      protocol = messages::JSON;
     }
-
-    return false;
-  }
-
-  /*
-   * Evaluate the specified genome.
-   *
-   * @param genome Genome used for the evaluation process.
-   */
-  double EvalFitness(Genome& genome)
-  {
-    // Connect and reset game state.
-    client::Client client;
-
-    if(!Reset(client)) return 1;
-
-    arma::mat tiles;
-    size_t numSteps = 100000000;
-    int maxMarioPositionX = 0;
-    int sessionLives = 0;
-    size_t stepCounter = 0;
-
-    for (size_t step = 0; step < numSteps; ++step, ++stepCounter)
+    else if (argument == "binary")
     {
-      // Get the current game informations.
-      if (!GameInfo(client)) continue;
-
-      // Set the initial position and number of lives.
-      if (step == 0)
+      protocol = messages::BINARY;
+    }
+    else if (argument == "ga")
+    {
+      ga = true;
+    }
+    else if (argument == "prefix")
+    {
+      prefix = true;
+    }
+    else if (argument == "racing")
+    {
+      topK = 15;
+    }
+    else if (argument.compare(0, 7, "racing=") == 0)
+    {
+      // Both numbers have to be complete, e.g. racing=15x is rejected.
+      const char* value = argument.c_str() + 7;
+      char* end = NULL;
+      topK = std::strtoul(value, &end, 10);
+      bool valid = end != value;
+      if (valid && *end == ':')
       {
-        maxMarioPositionX = marioPostionX;
-        sessionLives = marioLives;
+        value = end + 1;
+        quantile = std::strtod(value, &end);
+        valid = end != value;
       }
 
-      // Set network input.
-      std::vector<double> input;
-      DiscreteActuator(input);
-
-      // Get network output.
-      genome.Activate(input);
-      std::vector<double> output;
-      genome.Output(output);
-
-      auto biggest_position = std::max_element(std::begin(output),
-          std::end(output));
-      size_t action = std::distance(std::begin(output), biggest_position);
-
-      // Perform the action using the network output.
-      if (!Action(action, client)) continue;
-
-      // Check if mario dies.
-      if (IsDead()) break;
-
-      // Update marios position and reset the step counter.
-      if (marioPostionX > maxMarioPositionX)
+      if (!valid || *end != '\0')
       {
-        maxMarioPositionX = marioPostionX;
-        stepCounter = 0;
+        Log::Fatal << "Invalid racing argument '" << argument << "'. "
+            << usage << std::endl;
+        return 1;
       }
-
-      // Abort if the marios x postion does not change in 80 steps.
-      if (stepCounter >= 70) break;
     }
-
-    // First level.
-    if (maxMarioPositionX >= 3266)
+    else if (argument.compare(0, 7, "record=") == 0)
     {
-        success = true;
+      record = argument.substr(7);
     }
-
-    if (maxMarioPositionX > 0)
+    else if (argument.compare(0, 6, "cache=") == 0)
     {
-      return 1 / double(maxMarioPositionX);
+      cache = argument.substr(6);
+    }
+    else
+    {
+      Log::Fatal << "Unknown argument '" << argument << "'. " << usage
+          << std::endl;
+      return 1;
     }
-
-    return 1;
   }
 
- private:
-  //! Locally stored host name.
-  std::string host;
-
-  //! Locally stored port.
-  std::string port;
-
-  //! Locally stored endpoint host name.
-  std::string hostEndpoint;
-
-  //! Locally stored endpoint port.
-  std::string portEndpoint;
-
-  //! Locally stored parser instance.
-  parser::Parser parser;
-
-  //! Locally stored matrix that holds the tile information.
-  arma::mat tiles;
-
-  //! Locally stored x coordinate of mario.
-  int marioPostionX;
-
-  //! Locally stored y coordinate of mario.
-  int marioPostionY;
-
-  //! Locally stored number of lives.
-  int marioLives;
+  TaskSuperMarioBros task(host, port, protocol);
 
-  //! Locally stored player state.
-  int playerState;
+  // Don't play unchanged genomes again, optionally keep the fitness values
+  // across runs.
+  task.Cache(cache);
 
-  //! Locally stored success indicator; set to true if task solved.
-  bool success;
-};
+  // Take the steps shared with earlier episodes from the prefix trees.
+  task.Prefix(prefix);
 
-
-int main(int argc, char* argv[])
-{
-  mlpack::math::RandomSeed(1);
-
-  std::string host(argv[1]);
-  std::string port(argv[2]);
-
-  TaskSuperMarioBros task(host, port);
+  // Log the trajectories of the evaluated episodes.
+  task.Record(record);
 
   // Set parameters of NEAT algorithm.
   Parameters params;
@@ -400,11 +342,25 @@ int main(int argc, char* argv[])
   Genome seedGenome = Genome(0, neuronGenes, linkGenes, numInput, numOutput,
       fitness);
 
-  // Construct NEAT instance.
-  NEAT<TaskSuperMarioBros> neat(task, seedGenome, params);
+  // Dump the instrumentation snapshot once per generation.
+  task.PopulationSize(params.aPopulationSize);
+
+  // Cut the episodes that can't reach the best episodes of the last
+  // generation.
+  task.Racing(topK, quantile);
 
-  // Evolve network.
-  neat.Evolve();
+  // Evolve the network using NEAT, which evaluates one genome at a time; the
+  // weight-only loop evaluates every generation over all endpoints in
+  // parallel.
+  if (ga)
+  {
+    Evolve(task, seedGenome, params);
+  }
+  else
+  {
+    NEAT<TaskSuperMarioBros> evolution(task, seedGenome, params);
+    evolution.Evolve();
+  }
 
   return 0;
 }
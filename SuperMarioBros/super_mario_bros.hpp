@@ -0,0 +1,1025 @@
+/**
+ * @file super_mario_bros.hpp
+ * @author Marcus Edel
+ *
+ * The Super Mario Bros. task: evaluate a genome by playing an episode on an
+ * emulator session.
+ */
+#ifndef NES_SUPER_MARIO_BROS_HPP
+#define NES_SUPER_MARIO_BROS_HPP
+
+#include <mlpack/core.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "parser.hpp"
+#include "client.hpp"
+#include "messages.hpp"
+#include "session.hpp"
+#include "observation.hpp"
+#include "instrumentation.hpp"
+#include "fitness_cache.hpp"
+#include "prefix_tree.hpp"
+#include "racing.hpp"
+#include "phenotype.hpp"
+#include "trajectory_recorder.hpp"
+
+#include <mlpack/methods/ne/link_gene.hpp>
+#include <mlpack/methods/ne/neuron_gene.hpp>
+#include <mlpack/methods/ne/genome.hpp>
+
+/**
+ * Per-evaluation game state, filled using the game info reply. The compact
+ * observation keeps the tiles as bytes, the prefix trees store one per node.
+ */
+typedef observation::Observation GameState;
+
+class TaskSuperMarioBros
+{
+ public:
+  //! The prefix tree of a session.
+  typedef prefix::PrefixTree<GameState> PrefixTree;
+
+  /**
+   * Create the super mario bros object.
+   */
+  TaskSuperMarioBros() :
+      success(new std::atomic<bool>(false)),
+      populationSize(0)
+  {
+    /* Nothing to do here */
+  }
+
+  /**
+   * Create the super mario bros object using the specified host and port.
+   */
+  TaskSuperMarioBros(const std::string& host,
+                     const std::string& port,
+                     const messages::Protocol protocol = messages::BINARY) :
+      sessions(new session::SessionPool(host, port, protocol)),
+      success(new std::atomic<bool>(false)),
+      populationSize(0)
+  {
+     /* Nothing to do here */
+  }
+
+  /*
+   * Send the next action to the connected server and get the resulting game
+   * infromations in a single round-trip.
+   *
+   * @param action The action (Right, Left, Up, Down, A).
+   * @param session The session instance.
+   * @param state The game state to be filled.
+   * @param slot Save the state before the step into this savestate slot, 0
+   *        doesn't save the state.
+   */
+  bool Step(const size_t action,
+            session::Session& session,
+            GameState& state,
+            const int slot = 0)
+  {
+    if (action >= numActions) return false;
+
+    NES_TIME(STEP);
+    try
+    {
+      boost::string_ref reply;
+      session.Step(Key(action), BinaryKey(action), reply, slot);
+
+      Update(session.Parser(), reply, state);
+    }
+    catch (const std::exception& ex)
+    {
+      NES_COUNT(FAILED_STEP);
+      mlpack::Log::Warn << ex.what() << std::endl;
+      return false;
+    }
+    catch (...)
+    {
+      NES_COUNT(FAILED_STEP);
+      mlpack::Log::Warn << "Step timeout." << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  /*
+   * Get the current game infromations from the connected server.
+   *
+   * @param session The session instance.
+   * @param state The game state to be filled.
+   */
+  bool GameInfo(session::Session& session, GameState& state)
+  {
+    NES_TIME(GAME_INFO);
+    try
+    {
+      session.Send(session.Message(messages::GameInfo(),
+          messages::binary::GameInfo()));
+
+      boost::string_ref json;
+      session.Receive(json);
+
+      Update(session.Parser(), json, state);
+    }
+    catch (const std::exception& ex)
+    {
+      NES_COUNT(FAILED_GAME_INFO);
+      mlpack::Log::Warn << ex.what() << std::endl;
+      return false;
+    }
+    catch (...)
+    {
+      NES_COUNT(FAILED_GAME_INFO);
+      mlpack::Log::Warn << "Receive timeout." << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  /*
+   * Fill the input vector with the screen infromations.
+   *
+   * @param state The current game state.
+   * @param input The vector used to store the game screen informations.
+   */
+  void DiscreteActuator(const GameState& state, std::vector<double>& input)
+  {
+    // Reuse the buffer of the last step.
+    input.resize(state.tiles.size() + 1);
+    observation::Expand(state, input.data());
+    input[state.tiles.size()] = 1.0;
+  }
+
+  /*
+   * Reset the game state. The open connection and the applied config of the
+   * session are reused, the session is (re)connected if necessary.
+   *
+   * @param session The session instance.
+   * @param discard The savestate slots to remove before the reset.
+   */
+  bool Reset(session::Session& session,
+             const std::vector<int>& discard = std::vector<int>())
+  {
+    NES_TIME(RESET);
+
+    // A reused connection may have been dropped by the emulator, so retry
+    // once using a fresh connection.
+    for (size_t attempt = 0; attempt < 2; ++attempt)
+    {
+      try
+      {
+        if (!session.IsOpen())
+        {
+          NES_COUNT(RECONNECTS);
+          session.Open();
+        }
+
+        // A step advances a single frame divisor, the former info/action
+        // cycle advanced two.
+        session.ConfigSpeed("maximum");
+        session.ConfigDivisor(frameDivisor);
+        session.ConfigDelta(keyframeInterval);
+        session.Discard(discard);
+        session.Reset();
+        return true;
+      }
+      catch (const std::exception& ex)
+      {
+        mlpack::Log::Warn << ex.what() << std::endl;
+      }
+      catch (...)
+      {
+        mlpack::Log::Warn << "Send timeout." << std::endl;
+      }
+
+      session.Close();
+    }
+
+    NES_COUNT(FAILED_RESET);
+    return false;
+  }
+
+  // Whether task success or not.
+  bool Success()
+  {
+    return *success;
+  }
+
+  //! Set the population size, used to dump the instrumentation snapshot once
+  // per generation.
+  void PopulationSize(const size_t size) { populationSize = size; }
+
+  //! Get the pool of emulator sessions.
+  session::SessionPool& Sessions() { return *sessions; }
+
+  /**
+   * Return the given session to the pool. The pool drops sessions that lost
+   * their connection, the prefix tree of a dropped session is removed.
+   *
+   * @param session The session taken from the pool.
+   */
+  void Release(std::unique_ptr<session::Session> session)
+  {
+    if (prefixes && session && !session->IsOpen())
+    {
+      std::lock_guard<std::mutex> lock(prefixes->mutex);
+      prefixes->trees.erase(session->Id());
+    }
+
+    sessions->Release(std::move(session));
+  }
+
+  /**
+   * Take the steps an episode shares with an earlier episode of the same
+   * session from the prefix tree of the session instead of playing them, see
+   * prefix::PrefixTree; the emulator state of some prefixes is kept in
+   * savestate slots of the emulator, so an episode that leaves the recorded
+   * prefixes doesn't have to be played from the reset.
+   *
+   * @param enable Enable or disable the prefix evaluation.
+   */
+  void Prefix(const bool enable)
+  {
+    if (enable)
+    {
+      prefixes.reset(new PrefixTrees());
+    }
+    else
+    {
+      prefixes.reset();
+    }
+  }
+
+  /**
+   * Cut the episodes that can't reach the best episodes of the last
+   * generation, see racing::Racing; the cut only depends on the finished
+   * generations, so it doesn't depend on the order of parallel evaluations.
+   * The fitness of a cut episode is computed from the progress at the cut
+   * like the fitness of a stalled episode, so it is never better than the
+   * fitness of the complete episode; cut episodes aren't cached. Call after
+   * PopulationSize.
+   *
+   * @param topK The number of best episodes of a generation an episode has to
+   *        be able to reach, 0 disables the cut.
+   * @param quantile The quantile of the progress gains of the earlier
+   *        episodes used as the optimistic gain of an episode.
+   */
+  void Racing(const size_t topK, const double quantile = 1)
+  {
+    if (topK == 0)
+    {
+      race.reset();
+      return;
+    }
+
+    race.reset(new racing::Racing(populationSize, topK, quantile));
+  }
+
+  /**
+   * Append the observation, action and reward of every step of the evaluated
+   * episodes to the given trajectory log, see trajectory::Recorder. The
+   * episodes are written by a background thread; if the writer falls behind,
+   * episodes are dropped instead of stalling the evaluation.
+   *
+   * @param path The trajectory log, empty disables the recording.
+   */
+  void Record(const std::string& path)
+  {
+    if (path.empty())
+    {
+      recorder.reset();
+      return;
+    }
+
+    recorder.reset(new trajectory::Recorder(path));
+  }
+
+  /**
+   * Memoize the fitness of the evaluated genomes, so genomes that didn't
+   * change (e.g. elites) aren't played again.
+   *
+   * @param path The file used to keep the cache across runs, empty keeps the
+   *        cache in memory only.
+   */
+  void Cache(const std::string& path = "")
+  {
+    // Entries of runs with a different divisor or stall limit don't match.
+    cache.reset(new fitness::FitnessCache(uint64_t(frameDivisor) << 32 |
+        stallSteps, path));
+  }
+
+  /*
+   * Check if mario dies.
+   *
+   * @param state The current game state.
+   */
+  bool IsDead(const GameState& state)
+  {
+    if (state.playerState == 11 || observation::OnlyMario(state))
+    {
+      return true;
+    }
+
+    return false;
+  }
+
+  /*
+   * Evaluate the specified genome.
+   *
+   * @param genome Genome used for the evaluation process.
+   */
+  double EvalFitness(mlpack::ne::Genome& genome)
+  {
+    uint64_t hash = 0;
+    double fitness;
+    if (Cached(genome, hash, fitness)) return fitness;
+
+    // Take a session from the pool and keep it for the next evaluation.
+    std::unique_ptr<session::Session> session = sessions->Acquire();
+    fitness = Play(genome, *session, hash);
+    Release(std::move(session));
+
+    return fitness;
+  }
+
+  /*
+   * Evaluate the specified genome using the given session. All state of the
+   * evaluation is local, so different sessions can be used concurrently.
+   *
+   * @param genome Genome used for the evaluation process.
+   * @param session The session instance.
+   */
+  double EvalFitness(mlpack::ne::Genome& genome, session::Session& session)
+  {
+    uint64_t hash = 0;
+    double fitness;
+    if (Cached(genome, hash, fitness)) return fitness;
+
+    return Play(genome, session, hash);
+  }
+
+  /**
+   * The state of an episode played by Begin, Advance and End. All state of
+   * the evaluation is kept here, so different sessions can be used
+   * concurrently.
+   */
+  struct EpisodeState
+  {
+    /**
+     * Create the state of an episode of the given genome; the network of the
+     * genome is flattened once per episode.
+     *
+     * @param genome Genome used for the evaluation process.
+     */
+    explicit EpisodeState(mlpack::ne::Genome& genome) :
+        genome(genome),
+        network(genome),
+        compiled(true),
+        tree(NULL),
+        node(PrefixTree::NONE),
+        live(true),
+        maxMarioPositionX(0),
+        stepCounter(0),
+        step(0),
+        complete(true),
+        failed(false)
+    {
+      /* Nothing to do here */
+    }
+
+    //! The evaluated genome.
+    mlpack::ne::Genome& genome;
+
+    //! The compiled network of the genome.
+    phenotype::Phenotype network;
+
+    //! Whether the compiled network matches the genome; the graph of the
+    // genome is used otherwise.
+    bool compiled;
+
+    //! The network input of the current step.
+    std::vector<double> input;
+
+    //! The output of the genome graph if the compiled network isn't used.
+    std::vector<double> output;
+
+    //! The prefix tree of the session, NULL if the prefix evaluation is
+    // disabled.
+    PrefixTree* tree;
+
+    //! The node of the current game state in the prefix tree, NONE if the
+    // state isn't recorded.
+    size_t node;
+
+    //! Whether the emulator is in the current game state; otherwise the
+    // steps are taken from the recorded prefixes.
+    bool live;
+
+    //! The current game state.
+    GameState state;
+
+    //! The max x position of the episode.
+    int maxMarioPositionX;
+
+    //! The number of steps without progress.
+    size_t stepCounter;
+
+    //! The number of played steps.
+    size_t step;
+
+    //! The observations, actions and rewards of the episode.
+    trajectory::Episode trajectory;
+
+    //! The max x position every racing interval.
+    std::vector<int> curve;
+
+    //! Set to false if a request of the episode failed or the episode was
+    // cut.
+    bool complete;
+
+    //! Set to true if the episode failed before it could be played.
+    bool failed;
+  };
+
+  /**
+   * Start an episode: the game state is taken from the prefix tree of the
+   * session or the game is reset.
+   *
+   * @param session The session instance.
+   * @param episode The state of the episode.
+   * @return False if the game couldn't be reset, see End.
+   */
+  bool Begin(session::Session& session, EpisodeState& episode)
+  {
+    // The emulator is only used once the episode leaves the recorded
+    // prefixes.
+    PrefixTree* tree = Tree(session);
+    episode.tree = tree;
+    if (tree && !tree->Empty() && !tree->Full())
+    {
+      episode.node = 0;
+      episode.live = false;
+      episode.state = tree->State(episode.node);
+    }
+    else
+    {
+      // Record the prefixes of the current population once the tree is full.
+      const std::vector<int> discard = tree ? tree->Clear() :
+          std::vector<int>();
+
+      // Reset game state and get the initial game informations.
+      if (!Reset(session, discard) || !GameInfo(session, episode.state))
+      {
+        episode.complete = false;
+        episode.failed = true;
+        return false;
+      }
+
+      if (tree)
+      {
+        tree->Root(episode.state);
+        episode.node = 0;
+      }
+    }
+
+    episode.maxMarioPositionX = episode.state.marioPostionX;
+
+    // The curve of the longest earlier episode fits without growing.
+    if (race) episode.curve.reserve(race->Checkpoints());
+
+    // Record the observations, actions and rewards of the episode.
+    if (recorder) recorder->Begin(episode.trajectory);
+
+    return true;
+  }
+
+  /**
+   * Play a single step of an episode: the network chooses the action for the
+   * current game state, the step is taken from the prefix tree or played on
+   * the emulator and the progress is checked. Once the buffers of the
+   * session and the episode reached their size, a step doesn't allocate
+   * unless it records a new prefix.
+   *
+   * @param session The session instance.
+   * @param episode The state of the episode.
+   * @return False once the episode is finished, see End.
+   */
+  bool Advance(session::Session& session, EpisodeState& episode)
+  {
+    if (episode.step >= maxSteps) return false;
+
+    // Set network input.
+    DiscreteActuator(episode.state, episode.input);
+
+    // Get network output.
+    size_t action;
+    {
+      NES_TIME(ACTIVATE);
+      if (episode.compiled)
+      {
+        episode.network.Activate(episode.input);
+
+        // Check the compiled network against the genome on the first
+        // observation.
+        if (episode.step == 0 &&
+            !episode.network.Verify(episode.genome, episode.input))
+        {
+          mlpack::Log::Warn << "Compiled network doesn't match the genome."
+              << std::endl;
+          episode.compiled = false;
+        }
+      }
+
+      if (!episode.compiled)
+      {
+        episode.genome.Activate(episode.input);
+        episode.genome.Output(episode.output);
+      }
+
+      const double* first = episode.compiled ? episode.network.Output() :
+          episode.output.data();
+      const double* last = first + (episode.compiled ?
+          episode.network.NumOutput() : episode.output.size());
+      action = std::distance(first, std::max_element(first, last));
+    }
+
+    episode.trajectory.Step(episode.state, action);
+
+    PrefixTree* tree = episode.tree;
+    if (!episode.live)
+    {
+      // Take the step from the prefix tree if the action was played before,
+      // otherwise bring the emulator into the state of the node.
+      const size_t child = tree->Child(episode.node, action);
+      if (child != PrefixTree::NONE)
+      {
+        NES_COUNT(PREFIX_STEPS);
+        episode.node = child;
+        episode.state = tree->State(episode.node);
+      }
+      else if (Branch(action, session, *tree, episode.node, episode.state))
+      {
+        episode.live = true;
+        episode.node = tree->Add(episode.node, action, episode.state);
+      }
+      else
+      {
+        episode.complete = false;
+        episode.failed = true;
+        return false;
+      }
+    }
+    else if (Step(action, session, episode.state,
+        episode.node != PrefixTree::NONE ? tree->Save(episode.node) : 0))
+    {
+      // Perform the action using the network output and get the resulting
+      // game informations.
+      if (episode.node != PrefixTree::NONE)
+      {
+        episode.node = tree->Add(episode.node, action, episode.state);
+      }
+    }
+    else
+    {
+      // The state of the emulator is unknown, stop recording.
+      episode.complete = false;
+      episode.node = PrefixTree::NONE;
+      ++episode.step;
+      ++episode.stepCounter;
+      return true;
+    }
+
+    // Check if mario dies.
+    if (IsDead(episode.state)) return false;
+
+    // Update marios position and reset the step counter; the gain of the max
+    // position is the reward of the step.
+    if (episode.state.marioPostionX > episode.maxMarioPositionX)
+    {
+      episode.trajectory.Reward(float(episode.state.marioPostionX -
+          episode.maxMarioPositionX));
+      episode.maxMarioPositionX = episode.state.marioPostionX;
+      episode.stepCounter = 0;
+    }
+
+    // Abort if the marios x postion does not change in 70 steps.
+    if (episode.stepCounter >= stallSteps) return false;
+
+    // Abort if the progress can't reach the best episodes of the last
+    // generation.
+    if (race && (episode.step + 1) % race->Interval() == 0)
+    {
+      episode.curve.push_back(episode.maxMarioPositionX);
+      if (race->Hopeless(episode.curve.size() - 1,
+          episode.maxMarioPositionX))
+      {
+        NES_COUNT(RACING_CUTS);
+        episode.complete = false;
+        return false;
+      }
+    }
+
+    ++episode.step;
+    ++episode.stepCounter;
+    return true;
+  }
+
+  /**
+   * Finish an episode: the fitness is computed from the max x position,
+   * the trajectory is handed to the recorder and the fitness is cached and
+   * recorded for the racing cut if the episode is complete.
+   *
+   * @param episode The state of the episode.
+   * @param hash The hash of the genome (see Cached), stored in the trajectory
+   *        log and used to cache the fitness.
+   * @return The fitness of the episode, 1 if the episode failed.
+   */
+  double End(EpisodeState& episode, const uint64_t hash)
+  {
+    double fitness = 1;
+    if (!episode.failed)
+    {
+      // First level.
+      if (episode.maxMarioPositionX >= levelEnd)
+      {
+        *success = true;
+      }
+
+      if (episode.maxMarioPositionX > 0)
+      {
+        fitness = 1 / double(episode.maxMarioPositionX);
+      }
+
+      if (recorder)
+      {
+        recorder->End(episode.trajectory, episode.genome.Id(), hash, fitness,
+            episode.complete);
+      }
+    }
+
+    if (cache && episode.complete) cache->Insert(hash, fitness);
+
+    if (race && episode.complete)
+    {
+      race->Record(hash, Progress(fitness), episode.curve);
+    }
+    else if (race)
+    {
+      race->Drop();
+    }
+
+    return fitness;
+  }
+
+ private:
+  /*
+   * Get the cached fitness of the specified genome.
+   *
+   * @param genome Genome used for the evaluation process.
+   * @param hash The hash of the genome, used to store the fitness.
+   * @param fitness The cached fitness.
+   */
+  bool Cached(const mlpack::ne::Genome& genome,
+              uint64_t& hash,
+              double& fitness)
+  {
+    if (!cache) return false;
+
+    hash = cache->Hash(genome);
+    if (!cache->Lookup(hash, fitness)) return false;
+
+    // A cached genome that finished the level still solves the task.
+    if (fitness <= 1 / double(levelEnd)) *success = true;
+
+    // The elites are usually cached, they define the top-k early.
+    if (race) race->Record(hash, Progress(fitness));
+
+    NES_COUNT(CACHE_HITS);
+    NES_EVALUATED(populationSize, std::cout);
+    return true;
+  }
+
+  /*
+   * Evaluate the specified genome, cache the fitness and record it for the
+   * racing cut.
+   *
+   * @param genome Genome used for the evaluation process.
+   * @param session The session instance.
+   * @param hash The hash of the genome (see Cached).
+   */
+  double Play(mlpack::ne::Genome& genome,
+              session::Session& session,
+              const uint64_t hash)
+  {
+    double fitness;
+    {
+      NES_TIME(EVALUATION);
+
+      EpisodeState episode(genome);
+      if (Begin(session, episode))
+      {
+        while (Advance(session, episode))
+        {
+          /* Nothing to do here */
+        }
+      }
+
+      fitness = End(episode, hash);
+    }
+    NES_EVALUATED(populationSize, std::cout);
+
+    return fitness;
+  }
+
+  /*
+   * Bring the emulator into the state of the given node of the prefix tree and
+   * play the given action: the nearest saved ancestor of the node is loaded
+   * (or the game is reset) and the actions from there are played as action
+   * sequence.
+   *
+   * @param action The action played from the node.
+   * @param session The session instance.
+   * @param tree The prefix tree of the session.
+   * @param node The node of the current game state.
+   * @param state The game state to be filled.
+   */
+  bool Branch(const size_t action,
+              session::Session& session,
+              PrefixTree& tree,
+              const size_t node,
+              GameState& state)
+  {
+    std::vector<uint8_t> actions;
+    size_t anchor = tree.Anchor(node, actions);
+    actions.push_back(uint8_t(action));
+
+    try
+    {
+      boost::string_ref reply;
+      bool resumed = false;
+      std::vector<int> discard;
+      if (!session.IsOpen())
+      {
+        // The savestates were dropped with the connection, so reconnect and
+        // play the prefix from the reset.
+        tree.Forget();
+        anchor = tree.Anchor(node, actions);
+        actions.push_back(uint8_t(action));
+      }
+      else if (tree.Slot(anchor) != 0)
+      {
+        resumed = session.Resume(Replay(session, actions, 0,
+            tree.Slot(anchor)), reply);
+        if (resumed)
+        {
+          NES_COUNT(STATE_LOADS);
+          if (!Replayed(session, actions, reply, state, 0)) return false;
+        }
+        else
+        {
+          // The emulator lost the savestates (e.g. after a reconnect), so
+          // play the prefix from the reset.
+          discard = tree.Forget();
+          anchor = tree.Anchor(node, actions);
+          actions.push_back(uint8_t(action));
+        }
+      }
+
+      if (!resumed && (!Reset(session, discard) || !GameInfo(session, state)))
+      {
+        return false;
+      }
+
+      for (size_t i = resumed ? maxSequence : 0; i < actions.size();
+          i += maxSequence)
+      {
+        session.Sequence(Replay(session, actions, i), reply);
+        if (!Replayed(session, actions, reply, state, i)) return false;
+      }
+    }
+    catch (const std::exception& ex)
+    {
+      mlpack::Log::Warn << ex.what() << std::endl;
+      return false;
+    }
+    catch (...)
+    {
+      mlpack::Log::Warn << "Receive timeout." << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  /*
+   * Create the action sequence message of the given actions, at most
+   * maxSequence actions starting at the given offset.
+   *
+   * @param session The session instance.
+   * @param actions The actions.
+   * @param offset The first action of the sequence.
+   * @param slot Load this savestate slot before the sequence, 0 doesn't load
+   *        a savestate.
+   */
+  std::string Replay(session::Session& session,
+                     const std::vector<uint8_t>& actions,
+                     const size_t offset,
+                     const int slot = 0)
+  {
+    std::vector<std::pair<std::string, int> > json;
+    std::vector<std::pair<uint8_t, int> > binary;
+    for (size_t i = offset; i < actions.size() && i < offset + maxSequence;
+        ++i)
+    {
+      json.push_back(std::make_pair(std::string(Key(actions[i])),
+          int(frameDivisor)));
+      binary.push_back(std::make_pair(BinaryKey(actions[i]),
+          int(frameDivisor)));
+    }
+
+    // The load and the sequence are handled within the same frame.
+    if (session.Protocol() == messages::BINARY)
+    {
+      return (slot ? messages::binary::LoadState(slot) : "") +
+          messages::binary::Sequence(binary);
+    }
+
+    std::string message = slot ? messages::LoadState(slot) : "";
+    messages::Append(message, messages::Sequence(json));
+    return messages::JSONMessage(message);
+  }
+
+  /*
+   * Fill the game state using the trajectory of a replayed action sequence.
+   *
+   * @param session The session instance.
+   * @param actions The replayed actions.
+   * @param reply The received trajectory.
+   * @param state The game state to be filled.
+   * @param offset The first action of the sequence.
+   * @return False if the sequence stopped early.
+   */
+  bool Replayed(session::Session& session,
+                const std::vector<uint8_t>& actions,
+                const boost::string_ref& reply,
+                GameState& state,
+                const size_t offset)
+  {
+    // The last observation of the trajectory is the current game info.
+    Update(session.Parser(), reply, state);
+
+    std::vector<int> states;
+    session.Parser().TrajectoryPlayerState(states);
+    return states.size() == std::min(actions.size() - offset,
+        size_t(maxSequence));
+  }
+
+  //! Get the prefix tree of the given session, NULL if the prefix evaluation
+  // is disabled.
+  PrefixTree* Tree(session::Session& session)
+  {
+    if (!prefixes) return NULL;
+
+    // The savestate slots belong to the emulator connection of the session,
+    // so every session has its own tree, which is cleared once the session
+    // connects again; a closed session is connected by the reset of the
+    // episode.
+    const size_t connection = session.Connections() +
+        (session.IsOpen() ? 0 : 1);
+
+    std::lock_guard<std::mutex> lock(prefixes->mutex);
+    PrefixTrees::Entry& entry = prefixes->trees[session.Id()];
+    if (!entry.tree)
+    {
+      entry.tree.reset(new PrefixTree());
+    }
+    else if (entry.connection != connection)
+    {
+      entry.tree->Clear();
+    }
+    entry.connection = connection;
+
+    return entry.tree.get();
+  }
+
+  //! Get the max x position of the episode with the given fitness.
+  static int Progress(const double fitness)
+  {
+    return fitness < 1 ? int(std::lround(1 / fitness)) : 0;
+  }
+
+  //! Get the JSON key of the given action.
+  static const char* Key(const size_t action)
+  {
+    static const char* keys[] = { "Right", "Left", "Up", "Down", "A" };
+    return keys[action];
+  }
+
+  //! Get the binary key of the given action.
+  static uint8_t BinaryKey(const size_t action)
+  {
+    static const uint8_t keys[] = {
+        messages::binary::KEY_RIGHT, messages::binary::KEY_LEFT,
+        messages::binary::KEY_UP, messages::binary::KEY_DOWN,
+        messages::binary::KEY_A };
+    return keys[action];
+  }
+
+  /*
+   * Parse the game informations and fill the game state.
+   *
+   * @param parser The parser instance.
+   * @param json The received game informations.
+   * @param state The game state to be filled.
+   */
+  void Update(parser::Parser& parser,
+              const boost::string_ref& json,
+              GameState& state)
+  {
+    NES_TIME(PARSE);
+
+    parser.Parse(json);
+    parser.Observation(state);
+  }
+
+  //! Locally stored pool of emulator sessions; shared between copies of the
+  // task.
+  std::shared_ptr<session::SessionPool> sessions;
+
+  //! Locally stored success indicator; set to true if task solved. Shared
+  // between copies of the task and set concurrently by parallel evaluations.
+  std::shared_ptr<std::atomic<bool> > success;
+
+  //! Locally stored fitness cache; shared between copies of the task.
+  std::shared_ptr<fitness::FitnessCache> cache;
+
+  //! Locally stored trajectory recorder; shared between copies of the task,
+  // NULL if the recording is disabled.
+  std::shared_ptr<trajectory::Recorder> recorder;
+
+  //! The prefix trees of the sessions.
+  struct PrefixTrees
+  {
+    //! The mutex that guards the trees.
+    std::mutex mutex;
+
+    //! The prefix tree of a session.
+    struct Entry
+    {
+      //! The connection of the session the tree was recorded on (see
+      // session::Session::Connections).
+      size_t connection;
+
+      //! The prefix tree.
+      std::unique_ptr<PrefixTree> tree;
+    };
+
+    //! The prefix tree of every session by session id.
+    std::map<uint64_t, Entry> trees;
+  };
+
+  //! Locally stored prefix trees; shared between copies of the task, NULL if
+  // the prefix evaluation is disabled.
+  std::shared_ptr<PrefixTrees> prefixes;
+
+  //! Locally stored progress curves of the racing cut; shared between copies
+  // of the task, NULL if the cut is disabled.
+  std::shared_ptr<racing::Racing> race;
+
+  //! Locally stored population size.
+  size_t populationSize;
+
+  //! The keyframe interval of the delta observations.
+  static const int keyframeInterval = 30;
+
+  //! The frame divisor, the number of frames per step.
+  static const int frameDivisor = 4;
+
+  //! The number of steps without progress before the episode is aborted.
+  static const size_t stallSteps = 70;
+
+  //! The maximum number of steps of an episode.
+  static const size_t maxSteps = 100000000;
+
+  //! The x position of the end of the first level.
+  static const int levelEnd = 3266;
+
+  //! The number of actions (Right, Left, Up, Down, A).
+  static const size_t numActions = 5;
+
+  //! The maximum number of actions of an action sequence.
+  static const size_t maxSequence = 255;
+};
+
+#endif
@@ -11,6 +11,7 @@
 local readMemory = require("read_memory");
 local writeJoypad = require("write_joypad");
 local server = require("server");
+local frameRing = require("frame_ring");
 local json = require("cjson");
 
 -- Check for the gd module.
@@ -34,8 +35,43 @@ frameDivisor = 30
 -- Locally stored image quality parameter.
 imageQuality = 80
 
--- Locally stored port.
-port = 4561
+-- Locally stored port; the supervisor assigns the port of every worker using
+-- the NES_PORT environment variable.
+port = tonumber(os.getenv("NES_PORT")) or 4561
+
+-- Locally stored unix domain socket path; listen on the path instead of the
+-- port if set, e.g. "/tmp/nes.sock" for clients that connect to
+-- unix:/tmp/nes.sock. The supervisor sets it using NES_SOCKET.
+socketPath = os.getenv("NES_SOCKET")
+
+-- Locally stored step indication parameter; set if the game info has to be
+-- sent once the frame divisor is advanced.
+pendingStep = false
+
+-- Locally stored keyframe interval of the delta observations; 0 disables the
+-- delta observations.
+deltaInterval = 0
+
+-- Locally stored tiles (matrix order) of the last game info.
+lastTiles = nil
+
+-- Locally stored number of delta replies since the last keyframe.
+deltaCount = 0
+
+-- Locally stored running action sequence as list of {key, frames} pairs.
+sequence = nil
+
+-- Locally stored index of the running action of the sequence.
+sequenceIndex = 0
+
+-- Locally stored number of frames left for the running action.
+sequenceFrames = 0
+
+-- Locally stored observations of the running action sequence.
+trajectory = {}
+
+-- Locally stored savestate slots of the connected client.
+stateSlots = {}
 
 
 -- Skip the start screen and create a savestate.
@@ -60,6 +96,419 @@ function StartGame()
   end
 end
 
+-- Locally stored wire protocol (json, binary).
+protocol = "json"
+
+-- Binary protocol opcodes and values (see messages.hpp).
+local OP_KEY = 0x01
+local OP_GAME = 0x02
+local OP_CONFIG = 0x03
+local OP_STEP = 0x04
+local OP_SEQUENCE = 0x05
+local OP_STATE = 0x06
+local OP_REPLY_INFO = 0x81
+local OP_REPLY_TILES = 0x82
+local OP_REPLY_IMAGE = 0x83
+local OP_REPLY_PROTOCOL = 0x84
+local OP_REPLY_DELTA = 0x85
+local OP_REPLY_TRAJECTORY = 0x86
+local OP_REPLY_FRAME = 0x87
+local OP_REPLY_MISSING = 0x88
+
+-- Shared memory frame ring (see frame_ring.hpp).
+local RING_SLOTS = 4
+local RING_CAPACITY = 256 * 240 * 4
+
+local keyValues = {"A", "B", "Right", "Left", "Up", "Down", "Start"}
+local gameValues = {"Reset", "Tiles", "Info", "Image"}
+local configFields = {"frame", "image", "divisor", "speed", "protocol",
+                      "delta", "shm"}
+local speedValues = {[0] = "normal", [1] = "maximum", [2] = "turbo"}
+local protocolValues = {[0] = "json", [1] = "binary"}
+local stateOperations = {"save", "load", "discard"}
+
+-- Encode the given number as big-endian integer.
+-- @param value The number to encode.
+-- @param size The number of bytes.
+-- @return The encoded number.
+local function EncodeInt(value, size)
+  local bytes = {}
+  for i = size, 1, -1 do
+    bytes[i] = string.char(value % 256)
+    value = math.floor(value / 256)
+  end
+
+  return table.concat(bytes)
+end
+
+-- Flatten the tiles in the matrix order used by the C++ parser: rows -radius
+-- to -1, followed by row 1 (mario), rows 2 to radius and row 0.
+-- @param tiles The tiles returned by readMemory.ReadTiles.
+-- @param radius The radius of the view field (Default 6).
+-- @return The tiles, row by row.
+local function FlattenTiles(tiles, radius)
+  local radius = radius or 6
+  local size = 2 * radius + 1
+  local rows = {}
+  local values = {}
+
+  for row = -radius, -1 do rows[#rows + 1] = row end
+  for row = 1, radius do rows[#rows + 1] = row end
+  rows[#rows + 1] = 0
+
+  for i = 1, #rows do
+    for col = 1, size do
+      values[#values + 1] = tiles[rows[i]][col]
+    end
+  end
+
+  return values
+end
+
+-- Encode the tiles in the matrix order used by the C++ parser.
+-- @param tiles The tiles returned by readMemory.ReadTiles.
+-- @param radius The radius of the view field (Default 6).
+-- @return The size of the view field followed by the tiles, row by row.
+local function EncodeTiles(tiles, radius)
+  local radius = radius or 6
+  local values = FlattenTiles(tiles, radius)
+  local bytes = {}
+
+  for i = 1, #values do
+    bytes[i] = string.char(values[i])
+  end
+
+  return string.char(2 * radius + 1)..table.concat(bytes)
+end
+
+-- Get the tiles that changed since the last game info.
+-- @param values The flattened tiles.
+-- @return The changed tiles as list of (matrix index, value) pairs or nil if
+-- a keyframe has to be sent.
+local function DeltaTiles(values)
+  if (deltaInterval <= 0 or lastTiles == nil or
+      deltaCount >= deltaInterval) then
+    return nil
+  end
+
+  local changes = {}
+  for i = 1, #values do
+    if (values[i] ~= lastTiles[i]) then
+      changes[#changes + 1] = i - 1
+      changes[#changes + 1] = values[i]
+    end
+  end
+
+  -- A keyframe is smaller if most of the tiles changed.
+  if (#changes > #values) then
+    return nil
+  end
+
+  return changes
+end
+
+-- Send the reply using the negotiated protocol.
+-- @param values The reply as table (json).
+-- @param opcode The reply opcode (binary).
+-- @param payload The encoded reply (binary).
+local function Reply(values, opcode, payload)
+  if (protocol == "binary") then
+    server.SendFrame(string.char(opcode)..payload)
+  else
+    server.Send(json.encode(values))
+  end
+end
+
+-- Read the current game info.
+-- @return The game info as table (mario, tiles, lives, coins, state).
+local function Observation()
+  local mario = readMemory.MarioPostion();
+
+  return {mario = mario,
+          tiles = readMemory.ReadTiles(mario['x'], mario['y']),
+          lives = readMemory.MarioLives(),
+          coins = readMemory.MarioCoins(),
+          state = readMemory.PlayersState()}
+end
+
+-- Encode the position, lives, coins and player state of the given game info.
+-- @param info The game info returned by Observation.
+-- @return The encoded attributes without the tiles.
+local function EncodeStatus(info)
+  return EncodeInt(info.mario['x'], 2)..EncodeInt(info.mario['y'], 2)..
+         string.char(info.lives % 256, info.coins % 256, info.state % 256)
+end
+
+-- Send the observations of the finished action sequence.
+local function SendTrajectory()
+  local records = {}
+  for i = 1, #trajectory do
+    records[i] = EncodeStatus(trajectory[i])..EncodeTiles(trajectory[i].tiles)
+  end
+
+  -- The client keeps the tiles of the last observation, so the next delta is
+  -- based on them.
+  if (#trajectory > 0) then
+    lastTiles = FlattenTiles(trajectory[#trajectory].tiles)
+  end
+
+  if (frameRing.IsOpen()) then
+    frameRing.PublishScreen()
+  end
+
+  Reply({trajectory = trajectory}, OP_REPLY_TRAJECTORY,
+        string.char(#trajectory)..table.concat(records))
+end
+
+-- Get the shared memory name of the frame ring (see RingName in
+-- frame_ring.hpp), e.g. /nes-4561 or /nes-tmp-nes.sock.
+local function RingName()
+  if socketPath ~= nil then
+    return "/nes"..string.gsub(socketPath, "/", "-")
+  end
+
+  return "/nes-"..port
+end
+
+-- Press the given key and continue with that key.
+-- @param key The key value (A, B, Right, Left, Up, Down, Start).
+function KeyHandler(key)
+  if (key == "A") then
+    currentKey = "A"
+    writeJoypad.PressA()
+  elseif (key == "B") then
+    currentKey = "B"
+    writeJoypad.PressB()
+  elseif (key == "Right") then
+    currentKey = "Right"
+    writeJoypad.PressRight()
+  elseif (key == "Left") then
+    currentKey = "Left"
+    writeJoypad.PressLeft()
+  elseif (key == "Up") then
+    currentKey = "Up"
+    writeJoypad.PressUp()
+  elseif (key == "Down") then
+    currentKey = "Down"
+    writeJoypad.PressDown()
+  elseif (key == "Start") then
+    currentKey = "Start"
+    writeJoypad.PressStart()
+  else
+    print("Unknown key value: "..tostring(key))
+  end
+end
+
+-- Handle the given game value.
+-- @param value The game value (Reset, Image, Tiles, Info).
+function GameHandler(value)
+  if (value == "Reset") then
+    savestate.load(saveState)
+  end
+
+  -- Publish the frame into the shared memory ring instead of sending the
+  -- image, if the ring is enabled.
+  if (value == "Image" and frameRing.IsOpen()) then
+    local frame = frameRing.PublishScreen() or 0
+    Reply({frame = frame}, OP_REPLY_FRAME, EncodeInt(frame, 4))
+  elseif (value == "Image" and hasgd) then
+    local gdStr = gui.gdscreenshot();
+    local gdImg = gd.createFromGdStr(gdStr);
+    local image = gdImg:jpegStr(imageQuality)
+
+    if (protocol == "binary") then
+      server.SendFrame(string.char(OP_REPLY_IMAGE)..image)
+    else
+      server.Send(image)
+    end
+  end
+
+  if (value == "Tiles") then
+
+    local mario = readMemory.MarioPostion();
+    local tiles = readMemory.ReadTiles(mario['x'], mario['y']);
+
+    -- The client keeps these tiles, so the next delta is based on them.
+    lastTiles = FlattenTiles(tiles)
+
+    Reply({tiles = tiles}, OP_REPLY_TILES, EncodeTiles(tiles))
+  end
+
+  if (value == "Info") then
+
+    local info = Observation()
+
+    -- The frame is published before the game info is sent.
+    if (frameRing.IsOpen()) then
+      frameRing.PublishScreen()
+    end
+
+    -- Send the changed tiles only, if delta observations are enabled.
+    local values = FlattenTiles(info.tiles)
+    local changes = DeltaTiles(values)
+    lastTiles = values
+
+    if (changes ~= nil) then
+      deltaCount = deltaCount + 1
+
+      local bytes = {}
+      for i = 1, #changes do
+        bytes[i] = string.char(changes[i])
+      end
+
+      Reply({mario = info.mario,
+             lives = info.lives,
+             coins = info.coins,
+             state = info.state,
+             delta = changes}, OP_REPLY_DELTA,
+             EncodeStatus(info)..string.char(#changes / 2)..
+             table.concat(bytes))
+      return
+    end
+
+    deltaCount = 0
+    Reply(info, OP_REPLY_INFO, EncodeStatus(info)..EncodeTiles(info.tiles))
+  end
+end
+
+-- Press the given key and send the game info once the frame divisor is
+-- advanced.
+-- @param key The key value (A, B, Right, Left, Up, Down, Start).
+function StepHandler(key)
+  KeyHandler(key)
+  pendingStep = true
+end
+
+-- Start the given action sequence; every key is pressed for the given number
+-- of frames and the game info after every action is sent as single
+-- trajectory once the sequence is finished or mario died.
+-- @param actions The actions as list of {key, frames} pairs.
+function SequenceHandler(actions)
+  trajectory = {}
+
+  if (actions == nil or #actions == 0) then
+    SendTrajectory()
+    return
+  end
+
+  sequence = actions
+  sequenceIndex = 1
+  sequenceFrames = math.max(sequence[1][2], 1)
+  KeyHandler(sequence[1][1])
+end
+
+-- Continue the running action sequence; called before every frame.
+function SequenceFrame()
+  if (sequenceFrames > 0) then
+    return
+  end
+
+  -- The frames of the running action are advanced.
+  local info = Observation()
+  trajectory[#trajectory + 1] = info
+
+  if (info.state == 11 or sequenceIndex == #sequence) then
+    SendTrajectory()
+    sequence = nil
+
+    -- Handle the next message right away.
+    frameCounter = 0
+    return
+  end
+
+  sequenceIndex = sequenceIndex + 1
+  sequenceFrames = math.max(sequence[sequenceIndex][2], 1)
+  KeyHandler(sequence[sequenceIndex][1])
+end
+
+-- Save, load or discard the given savestate slot.
+-- @param operation The operation (save, load, discard).
+-- @param slot The savestate slot.
+-- @return False if the slot to load doesn't exist; the rest of the message is
+-- ignored.
+function StateHandler(operation, slot)
+  if (operation == "save") then
+    -- Anonymous savestates are kept in memory.
+    if (stateSlots[slot] == nil) then
+      stateSlots[slot] = savestate.object()
+    end
+
+    savestate.save(stateSlots[slot])
+  elseif (operation == "load") then
+    if (stateSlots[slot] == nil) then
+      Reply({missing = slot}, OP_REPLY_MISSING, EncodeInt(slot, 2))
+      return false
+    end
+
+    savestate.load(stateSlots[slot])
+  elseif (operation == "discard") then
+    stateSlots[slot] = nil
+  else
+    print("Unknown savestate operation: "..tostring(operation))
+  end
+
+  return true
+end
+
+-- Handle the given config value.
+-- @param field The config field (frame, image, divisor, speed, protocol).
+-- @param value The config value.
+function ConfigHandler(field, value)
+  if (field == "frame") then
+
+    -- Set frame counter.
+    frameCounter = value
+  elseif (field == "image") then
+
+    -- Set image quality.
+    imageQuality = value
+  elseif (field == "divisor") then
+
+    -- Set frame divisor.
+    frameDivisor = value
+  elseif (field == "speed") then
+
+    -- Set emulation speed (maximum, normal, turbo).
+    if (value == "maximum") then
+      emu.speedmode("maximum")
+    elseif (value == "normal") then
+      emu.speedmode("normal")
+    elseif (value == "turbo") then
+      emu.speedmode("turbo")
+    else
+      print("Unknown speed value: "..tostring(value))
+    end
+  elseif (field == "delta") then
+
+    -- Set the keyframe interval of the delta observations, the next game info
+    -- is a keyframe.
+    deltaInterval = value
+    lastTiles = nil
+  elseif (field == "shm") then
+
+    -- Create the frame ring using the token of the client, 0 removes it.
+    if (value ~= 0) then
+      frameRing.Open(RingName(), RING_SLOTS, RING_CAPACITY, value)
+    else
+      frameRing.Close()
+    end
+  elseif (field == "protocol") then
+
+    -- Switch the protocol and acknowledge using the new protocol.
+    if (value == "binary") then
+      protocol = "binary"
+      server.SendFrame(string.char(OP_REPLY_PROTOCOL, 1))
+    elseif (value == "json") then
+      protocol = "json"
+      server.Send(json.encode({protocol = "json"}))
+    else
+      print("Unknown protocol value: "..tostring(value))
+    end
+  else
+    print("Unknown config value: "..tostring(field))
+  end
+end
+
 -- Function handler for following events:
 -- Press A -> "key" : {"value" : "A"}
 -- Press B -> "key" : {"value" : "B"}
@@ -72,116 +521,68 @@ end
 -- Send game tiles -> "game" : {"value" : "Tiles"}
 -- Send all game Infos -> "game" : {"value" : "Info"}
 -- Set the frame divisor -> "config" : frameDivisor
+-- Switch the protocol -> "config" : {"protocol" : "binary"}
+-- Delta observations -> "config" : {"delta" : keyframeInterval}
+-- Shared memory frames -> "config" : {"shm" : token}
+-- Step -> "step" : {"value" : "Right"}
+-- Sequence -> "sequence" : {"value" : [["Right", 8], ["A", 4]]}
+-- Savestate -> "savestate" : {"save" : slot} (or "load", "discard")
 function FunctionHandler(data)
   if data ~= nil and string.len(data) > 2 then
 
     -- Act as balancer in case the client sends a get enpoint message.
     if string.match(data, "get") then
-      endpoint = {host = "*", port = port}
+      endpoint = {host = "*", port = socketPath and "" or port}
       server.Send(json.encode({endpoint = endpoint}))
       return
     end
 
+    -- Act as balancer with a single endpoint.
+    if string.match(data, "count") then
+      server.Send(json.encode({count = 1}))
+      return
+    end
+
     local success, values = pcall(json.decode, data);
     if (success) then
 
       if (values ~= nil) then
 
+        -- Check the savestate values first, the other commands of the
+        -- message continue from the loaded state.
+        if (values["savestate"] ~= nil) then
+          for _, operation in ipairs({"discard", "save", "load"}) do
+            local slot = values["savestate"][operation]
+            if (slot ~= nil and not StateHandler(operation, slot)) then
+              return
+            end
+          end
+        end
+
         -- Check the key values.
         if (values["key"] ~= nil) then
-          if (values["key"]["value"] == "A") then
-            currentKey = "A"
-            writeJoypad.PressA()
-          elseif (values["key"]["value"] == "B") then
-            currentKey = "B"
-            writeJoypad.PressB()
-          elseif (values["key"]["value"] == "Right") then
-            currentKey = "Right"
-            writeJoypad.PressRight()
-          elseif (values["key"]["value"] == "Left") then
-            currentKey = "Left"
-            writeJoypad.PressLeft()
-          elseif (values["key"]["value"] == "Up") then
-            currentKey = "Up"
-            writeJoypad.PressUp()
-          elseif (values["key"]["value"] == "Down") then
-            currentKey = "Down"
-            writeJoypad.PressDown()
-          elseif (values["key"]["value"] == "Start") then
-            currentKey = "Start"
-            writeJoypad.PressStart()
-          else
-            print("Unknown key value: " + values["key"]["value"])
-          end
+          KeyHandler(values["key"]["value"])
         end
 
         -- Check the game values.
         if (values["game"] ~= nil) then
-          if (values["game"]["value"] == "Reset") then
-            savestate.load(saveState)
-          end
-
-          if (values["game"]["value"] == "Image" and hasgd) then
-            local gdStr = gui.gdscreenshot();
-            local gdImg = gd.createFromGdStr(gdStr);
-            local image = gdImg:jpegStr(imageQuality)
-
-            server.Send(image)
-          end
-
-          if (values["game"]["value"] == "Tiles") then
-
-            local mario = readMemory.MarioPostion();
-            local tiles = readMemory.ReadTiles(mario['x'], mario['y']);
-
-            server.Send(json.encode({tiles = tiles}))
-          end
-
-          if (values["game"]["value"] == "Info") then
+          GameHandler(values["game"]["value"])
+        end
 
-            local mario = readMemory.MarioPostion();
-            local tiles = readMemory.ReadTiles(mario['x'], mario['y']);
-            local lives = readMemory.MarioLives();
-            local coins = readMemory.MarioCoins();
-            local state = readMemory.PlayersState();
+        -- Check the step values.
+        if (values["step"] ~= nil) then
+          StepHandler(values["step"]["value"])
+        end
 
-            server.Send(json.encode({mario = mario,
-                                     tiles = tiles,
-                                     lives = lives,
-                                     coins = coins,
-                                     state = state}))
-          end
+        -- Check the sequence values.
+        if (values["sequence"] ~= nil) then
+          SequenceHandler(values["sequence"]["value"])
         end
 
          -- Check the config values.
         if (values["config"] ~= nil) then
-          if (values["config"]["frame"] ~= nil) then
-
-            -- Set frame counter.
-            frameCounter = values["config"]["frame"]
-          elseif (values["config"]["image"] ~= nil) then
-
-            -- Set image quality.
-            imageQuality = values["config"]["image"]
-          elseif (values["config"]["divisor"] ~= nil) then
-
-            -- Set frame divisor.
-            frameDivisor = values["config"]["divisor"]
-          elseif (values["config"]["speed"] ~= nil) then
-
-            -- Set emulation speed (maximum, normal, turbo).
-            local speed = values["config"]["speed"]
-            if (speed == "maximum") then
-              emu.speedmode("maximum")
-            elseif (speed == "normal") then
-              emu.speedmode("normal")
-            elseif (speed == "turbo") then
-              emu.speedmode("turbo")
-            else
-              print("Unknown speed value: " + speed)
-            end
-          else
-            print("Unknown config value: " + values["config"])
+          for field, value in pairs(values["config"]) do
+            ConfigHandler(field, value)
           end
         end
       end
@@ -189,27 +590,112 @@ function FunctionHandler(data)
   end
 end
 
+-- Function handler for binary frames, see messages.hpp for the layout:
+-- Press key -> KEY <key>
+-- Game -> GAME <game>
+-- Config -> CONFIG <field> <value>
+-- Step -> STEP <key>
+-- Sequence -> SEQUENCE <count> (<key> <frames:2>)*count
+-- Savestate -> STATE <operation> <slot:2>
+function BinaryHandler(data)
+  local offset = 1
+
+  while (offset + 1 <= string.len(data)) do
+    local opcode, value = string.byte(data, offset, offset + 1)
+    offset = offset + 2
+
+    if (opcode == OP_KEY) then
+      KeyHandler(keyValues[value])
+    elseif (opcode == OP_GAME) then
+      GameHandler(gameValues[value])
+    elseif (opcode == OP_STEP) then
+      StepHandler(keyValues[value])
+    elseif (opcode == OP_SEQUENCE) then
+      local actions = {}
+      for i = 1, value do
+        local key, f1, f2 = string.byte(data, offset, offset + 2)
+        actions[i] = {keyValues[key], f1 * 256 + f2}
+        offset = offset + 3
+      end
+
+      SequenceHandler(actions)
+    elseif (opcode == OP_STATE) then
+      local s1, s2 = string.byte(data, offset, offset + 1)
+      offset = offset + 2
+
+      if (not StateHandler(stateOperations[value], s1 * 256 + s2)) then
+        return
+      end
+    elseif (opcode == OP_CONFIG) then
+      local field = configFields[value]
+      local b1, b2, b3, b4 = string.byte(data, offset, offset + 3)
+      local number = ((b1 * 256 + b2) * 256 + b3) * 256 + b4
+      offset = offset + 4
+
+      if (field == "speed") then
+        ConfigHandler(field, speedValues[number])
+      elseif (field == "protocol") then
+        ConfigHandler(field, protocolValues[number])
+      else
+        ConfigHandler(field, number)
+      end
+    else
+      print("Unknown opcode: "..tostring(opcode))
+      return
+    end
+  end
+end
+
 -- Start the game and wait for connections.
 StartGame()
-server.Server("*", port, 1)
+server.Server(socketPath and ("unix:"..socketPath) or "*", port, 1)
 server.Accept()
 savestate.load(saveState)
 
 while (true) do
+  -- Continue the running action sequence.
+  if (sequence ~= nil) then
+    SequenceFrame()
+  end
+
   -- Handle the input data.
-  if (frameCounter % frameDivisor) == 0 then
-    local data = server.Receive()
+  if (sequence == nil and (frameCounter % frameDivisor) == 0) then
+    -- Answer the last step with the game info after the frame divisor.
+    if (pendingStep) then
+      pendingStep = false
+      GameHandler("Info")
+    end
+
+    local data = nil
+    if (protocol == "binary") then
+      data = server.ReceiveFrame()
+    else
+      data = server.Receive()
+    end
+
     if (data ~= nil) then
-      FunctionHandler(data)
+      if (protocol == "binary") then
+        BinaryHandler(data)
+      else
+        FunctionHandler(data)
+      end
     else
       print("Lost connection listen.")
       server.Accept()
       savestate.load(saveState)
+      protocol = "json"
+      pendingStep = false
+      deltaInterval = 0
+      lastTiles = nil
+      sequence = nil
+      stateSlots = {}
+      frameRing.Close()
     end
   end
 
-  -- Continue with the last key if the divisor isn't 1.
-  if (frameDivisor ~= 1) then
+  -- Continue with the last key if the divisor isn't 1 or an action sequence
+  -- is running.
+  if (frameDivisor ~= 1 or sequence ~= nil) then
     if (currentKey == "A") then
       writeJoypad.PressA()
     elseif (currentKey == "B") then
@@ -225,6 +711,10 @@ while (true) do
     end
   end
 
+  if (sequence ~= nil) then
+    sequenceFrames = sequenceFrames - 1
+  end
+
   frameCounter = frameCounter + 1
   emu.frameadvance()
 end
\ No newline at end of file
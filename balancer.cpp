@@ -6,135 +6,457 @@
  */
 
 #include "messages.hpp"
+#include "endpoint.hpp"
+#include "registry.hpp"
 
+#include <algorithm>
 #include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <istream>
+#include <memory>
 #include <thread>
 #include <utility>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/algorithm/string.hpp>
-
-using boost::asio::ip::tcp;
+#include <boost/version.hpp>
 
 const int maxLength = 1024;
 
-std::vector<std::string> host;
-std::vector<std::string> port;
-size_t backlog;
+//! The time after that a lease expires if it isn't renewed.
+const int leaseTimeout = 60;
+
+//! The time between two liveness probes of the free endpoints.
+const int probeInterval = 5;
+
+//! The time after that a liveness probe fails.
+const int probeTimeout = 2;
 
-void session(tcp::socket socket)
+//! The number of failed probes after that an endpoint is dropped.
+const size_t maxFailures = 3;
+
+/**
+ * Check if an emulator is alive; the probe connects to the endpoint, sends a
+ * get message and waits for the reply. The handlers run in a strand, the
+ * deadline and the connection complete on different threads otherwise.
+ */
+class Probe : public std::enable_shared_from_this<Probe>
 {
-  try
+ public:
+  Probe(boost::asio::io_service& ioService,
+        const std::string& host,
+        const std::string& port,
+        const std::function<void(bool)>& handler) :
+      strand(ioService),
+      socket(ioService),
+      deadline(ioService),
+      host(host),
+      port(port),
+      handler(handler),
+      done(false)
   {
-    char data[maxLength];
-    boost::system::error_code error;
-    size_t length = socket.read_some(boost::asio::buffer(data), error);
-    if (error == boost::asio::error::eof)
-    {
-      return;
-    }
-    else if (error)
+    /* Nothing to do here */
+  }
+
+  //! Start the probe.
+  void Start()
+  {
+    std::shared_ptr<Probe> self(shared_from_this());
+
+    strand.dispatch([this, self]()
     {
-      throw boost::system::system_error(error);
-    }
+      deadline.expires_from_now(boost::posix_time::seconds(probeTimeout));
+      deadline.async_wait(strand.wrap(
+          [this, self](const boost::system::error_code& error)
+      {
+        if (!error) Finish(false);
+      }));
+
+      endpoint::AsyncConnect(socket, host, port, strand.wrap([this, self](
+          const boost::system::error_code& error)
+      {
+        if (error) return Finish(false);
 
-    std::string message(data);
+        boost::asio::async_write(socket, boost::asio::buffer(request),
+            strand.wrap([this, self](const boost::system::error_code& error,
+                                     size_t)
+        {
+          if (error) return Finish(false);
 
-    if (message.find("get") != std::string::npos)
+          boost::asio::async_read_until(socket, buffer, "\r\n\r\n\r\n",
+              strand.wrap([this, self](const boost::system::error_code& error,
+                                       size_t)
+          {
+            Finish(!error);
+          }));
+        }));
+      }));
+    });
+  }
+
+ private:
+  //! Call the handler once and cancel the outstanding operations.
+  void Finish(const bool alive)
+  {
+    if (done) return;
+    done = true;
+
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    deadline.cancel(ignored);
+
+    handler(alive);
+  }
+
+  //! The probe request.
+  static const std::string request;
+
+  boost::asio::io_service::strand strand;
+  endpoint::Socket socket;
+  boost::asio::deadline_timer deadline;
+  boost::asio::streambuf buffer;
+  std::string host;
+  std::string port;
+  std::function<void(bool)> handler;
+  bool done;
+};
+
+const std::string Probe::request = messages::GetEndpoint() + "\r\n";
+
+/**
+ * A balancer connection. Commands are separated by newlines and handled one
+ * after another:
+ *
+ * get                   -> lease a free endpoint, endpoint message
+ * count                 -> number of endpoints
+ * leased <host>:<port>  -> whether the endpoint is leased, empty message if
+ *                          the endpoint isn't registered
+ * release <host>:<port> -> release the leased endpoint (no reply)
+ * renew                 -> renew the leases of the connection (no reply)
+ * add <host>:<port>     -> (no reply)
+ * remove <host>:<port>  -> (no reply)
+ *
+ * Unix domain socket endpoints are given as unix:<path> instead of
+ * <host>:<port>, their port is empty.
+ *
+ * All leases held by the connection are released once it is closed.
+ */
+class Session : public std::enable_shared_from_this<Session>
+{
+ public:
+  Session(boost::asio::io_service& ioService, registry::Registry& registry) :
+      socket(ioService),
+      buffer(maxLength),
+      registry(registry),
+      owner(registry.Owner())
+  {
+    /* Nothing to do here */
+  }
+
+  //! Release the leases of the connection.
+  ~Session()
+  {
+    registry.Release(owner);
+  }
+
+  endpoint::Socket& Socket() { return socket; }
+
+  //! Start reading commands.
+  void Start()
+  {
+    Read();
+  }
+
+ private:
+  //! Read the next command.
+  void Read()
+  {
+    std::shared_ptr<Session> self(shared_from_this());
+    boost::asio::async_read_until(socket, buffer, '\n',
+        [this, self](const boost::system::error_code& error, size_t)
     {
-      // Send endpoint information.
-      backlog = backlog >= (host.size() - 1) ? 0 : backlog + 1;
+      if (error)
+      {
+        if (error != boost::asio::error::eof)
+        {
+          std::cerr << "Session error: " << error.message() << "\n";
+        }
+        return;
+      }
 
-      std::string endpointMessage = messages::JSONMessage(messages::SendEndpoint(host[backlog],
-          port[backlog])) + "\r\n\r\n\r\n";
+      std::string message;
+      std::istream stream(&buffer);
+      std::getline(stream, message);
+      boost::trim(message);
 
-      boost::system::error_code ignored_error;
-      boost::asio::write(socket, boost::asio::buffer(endpointMessage),
-          boost::asio::transfer_all(), ignored_error);
-    }
-    else if (message.find("add") != std::string::npos)
+      Handle(message);
+    });
+  }
+
+  //! Send the given reply and continue with the next command.
+  void Write(const std::string& reply)
+  {
+    std::shared_ptr<Session> self(shared_from_this());
+    std::shared_ptr<std::string> data(new std::string(reply + "\r\n\r\n\r\n"));
+
+    boost::asio::async_write(socket, boost::asio::buffer(*data),
+        [this, self, data](const boost::system::error_code& error, size_t)
     {
-      // Add endpoint.
-      std::size_t hostStart = message.find("add ");
-      std::size_t portStart = message.find(":", hostStart);
+      if (!error)
+      {
+        Read();
+      }
+    });
+  }
 
-      std::string hostData = message.substr(hostStart + 4,
-          portStart - hostStart - 4);
+  //! Split the given endpoint argument (<host>:<port> or unix:<path>).
+  static bool Endpoint(const std::string& message,
+                       const std::string& command,
+                       std::string& hostData,
+                       std::string& portData)
+  {
+    return endpoint::Split(boost::trim_copy(message.substr(command.size())),
+        hostData, portData);
+  }
 
-      std::string portData = message.substr(portStart + 1,
-          message.length() - portStart - 1);
-      boost::trim_right(portData);
+  //! Handle the given command.
+  void Handle(const std::string& message)
+  {
+    std::string hostData, portData;
 
-      host.push_back(hostData);
-      port.push_back(portData);
+    if (message == "get")
+    {
+      // Lease a free endpoint and send the endpoint information.
+      if (!registry.Lease(owner, hostData, portData))
+      {
+        Write(messages::JSONMessage(""));
+        return;
+      }
 
-      std::cout << "Add endpoint: " << hostData << ":" << portData << std::endl;
+      Write(messages::JSONMessage(messages::SendEndpoint(hostData, portData)));
+      return;
+    }
+    else if (message == "count")
+    {
+      // Send the number of endpoints.
+      Write(messages::JSONMessage(messages::SendEndpointCount(
+          registry.Size())));
+      return;
     }
-    else if (message.find("remove") != std::string::npos)
+    else if (boost::starts_with(message, "leased "))
+    {
+      // Send whether the endpoint is leased.
+      bool leased = false;
+      if (!Endpoint(message, "leased", hostData, portData) ||
+          !registry.Leased(hostData, portData, leased))
+      {
+        Write(messages::JSONMessage(""));
+        return;
+      }
+
+      Write(messages::JSONMessage(messages::SendEndpointLeased(leased)));
+      return;
+    }
+    else if (boost::starts_with(message, "release "))
+    {
+      // Release endpoint.
+      if (Endpoint(message, "release", hostData, portData))
+      {
+        registry.Release(owner, hostData, portData);
+      }
+    }
+    else if (message == "renew")
+    {
+      // Renew the leases.
+      registry.Renew(owner);
+    }
+    else if (boost::starts_with(message, "add "))
+    {
+      // Add endpoint.
+      if (Endpoint(message, "add", hostData, portData))
+      {
+        registry.Add(hostData, portData);
+      }
+    }
+    else if (boost::starts_with(message, "remove "))
     {
       // Remove endpoint.
-      std::size_t hostStart = message.find("remove ");
-      std::size_t portStart = message.find(":", hostStart);
+      if (Endpoint(message, "remove", hostData, portData))
+      {
+        registry.Remove(hostData, portData);
+      }
+    }
+    else if (!message.empty())
+    {
+      std::cerr << "Unknown command: " << message << "\n";
+    }
 
-      std::string hostData = message.substr(hostStart + 7,
-          portStart - hostStart - 7);
+    Read();
+  }
 
-      std::string portData = message.substr(portStart + 1,
-          message.length() - portStart - 1);
-      boost::trim_right(portData);
+  //! Locally stored socket object.
+  endpoint::Socket socket;
 
-      for(size_t i = 0; i < host.size(); ++i)
-      {
-        if (host[i] == hostData && port[i] == portData)
-        {
-          host.erase(host.begin() + i);
-          port.erase(port.begin() + i);
+  //! Locally stored buffer that holds the received commands.
+  boost::asio::streambuf buffer;
 
-          std::cout << "Remove endpoint: " << hostData << ":" << portData << std::endl;
-          break;
-        }
+  //! Locally stored endpoint registry.
+  registry::Registry& registry;
+
+  //! Locally stored lease owner id of the connection.
+  size_t owner;
+};
+
+/**
+ * Accept balancer connections asynchronously.
+ */
+class Server
+{
+ public:
+  /**
+   * Listen on the given address, either the TCP port or unix:<path>.
+   */
+  Server(boost::asio::io_service& ioService,
+         const std::string& address,
+         registry::Registry& registry) :
+      ioService(ioService),
+      acceptor(ioService),
+      registry(registry),
+      timer(ioService),
+      ticks(0)
+  {
+#if BOOST_VERSION >= 106600
+    endpoint::Bind(acceptor, address,
+        boost::asio::socket_base::max_listen_connections);
+#else
+    endpoint::Bind(acceptor, address,
+        boost::asio::socket_base::max_connections);
+#endif
+    Accept();
+    Maintain();
+  }
+
+ private:
+  //! Accept the next connection.
+  void Accept()
+  {
+    std::shared_ptr<Session> session(new Session(ioService, registry));
+    acceptor.async_accept(session->Socket(),
+        [this, session](const boost::system::error_code& error)
+    {
+      if (!error)
+      {
+        session->Start();
       }
-    }
+      else
+      {
+        std::cerr << "Accept error: " << error.message() << "\n";
+      }
+
+      Accept();
+    });
   }
-  catch (std::exception& e)
+
+  //! Expire the leases every second and probe the free endpoints.
+  void Maintain()
   {
-    std::cerr << "Exception in thread: " << e.what() << "\n";
+    timer.expires_from_now(boost::posix_time::seconds(1));
+    timer.async_wait([this](const boost::system::error_code& error)
+    {
+      if (error) return;
+
+      registry.Expire();
+      if (++ticks % probeInterval == 0)
+      {
+        ProbeEndpoints();
+      }
+
+      Maintain();
+    });
   }
-}
 
-void server(boost::asio::io_service& ioService, size_t port)
-{
-  tcp::acceptor a(ioService, tcp::endpoint(tcp::v4(), port));
-  for (;;)
+  //! Probe all free endpoints.
+  void ProbeEndpoints()
   {
-    tcp::socket sock(ioService);
-    a.accept(sock);
-    std::thread(session, std::move(sock)).detach();
+    std::vector<std::pair<std::string, std::string> > endpoints;
+    registry.StartProbes(endpoints);
+    for (size_t i = 0; i < endpoints.size(); ++i)
+    {
+      const std::string host = endpoints[i].first;
+      const std::string port = endpoints[i].second;
+
+      registry::Registry& registry = this->registry;
+      std::shared_ptr<Probe> probe(new Probe(ioService, host, port,
+          [&registry, host, port](bool alive)
+      {
+        if (!alive)
+        {
+          std::cerr << "Probe failed: " << endpoint::Name(host, port) << "\n";
+        }
+
+        registry.FinishProbe(host, port, alive);
+      }));
+
+      probe->Start();
+    }
   }
-}
+
+  boost::asio::io_service& ioService;
+  endpoint::Acceptor acceptor;
+  registry::Registry& registry;
+  boost::asio::deadline_timer timer;
+  size_t ticks;
+};
 
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc < 2 || ((argc - 2) % 2) != 0)
+    if (argc < 2)
     {
-      std::cout << "Usage: <port> <host> <port> ... <host> <port>\n";
+      std::cout << "Usage: <port|unix:path> <host> <port>|unix:<path> ...\n";
       return 1;
     }
 
-    for (size_t i = 2; i < (argc - 1); i += 2)
-    {
-      std::cout << "Add endpoint: " << argv[i] << ":" << argv[i + 1] << std::endl;
+    // Every thread runs the io service, the sessions of different connections
+    // are handled concurrently.
+    const size_t threads = std::max(1u, std::thread::hardware_concurrency());
 
-      host.push_back(argv[i]);
-      port.push_back(argv[i + 1]);
+    // The endpoints are <host> <port> pairs or single unix:<path> arguments.
+    registry::Registry registry(threads, leaseTimeout, maxFailures);
+    for (int i = 2; i < argc; ++i)
+    {
+      if (endpoint::IsLocal(argv[i]))
+      {
+        registry.Add(argv[i], "");
+      }
+      else if (i + 1 < argc)
+      {
+        registry.Add(argv[i], argv[i + 1]);
+        ++i;
+      }
+      else
+      {
+        std::cout << "Missing port of endpoint " << argv[i] << "\n";
+        return 1;
+      }
     }
 
-    backlog = 0;
-
     boost::asio::io_service ioService;
-    server(ioService, std::atoi(argv[1]));
+    Server server(ioService, argv[1], registry);
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i)
+    {
+      workers.push_back(std::thread([&ioService]() { ioService.run(); }));
+    }
+
+    ioService.run();
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+      workers[i].join();
+    }
   }
   catch (std::exception& e)
   {
@@ -142,4 +464,4 @@ int main(int argc, char* argv[])
   }
 
   return 0;
-}
\ No newline at end of file
+}
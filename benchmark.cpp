@@ -0,0 +1,401 @@
+/**
+ * @file benchmark.cpp
+ * @author Marcus Edel
+ *
+ * End-to-end throughput benchmark, drives the emulators through the balancer
+ * using the client, the parser and the session pool. Optionally checks that
+ * the steps don't allocate.
+ */
+
+#include <mlpack/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parser.hpp"
+#include "client.hpp"
+#include "messages.hpp"
+#include "session.hpp"
+#include "observation.hpp"
+#include "instrumentation.hpp"
+
+#include <boost/config.hpp>
+
+//! The number of heap allocations of the current thread, counted by the
+// replaced operator new.
+static thread_local size_t allocations = 0;
+
+// Every replaced operator new allocates with malloc and every operator delete
+// frees with free. The deletes aren't inlined, otherwise GCC sees free() called
+// on the result of a new expression and warns (-Wmismatched-new-delete).
+
+void* operator new(std::size_t size)
+{
+  ++allocations;
+  if (void* pointer = std::malloc(size ? size : 1)) return pointer;
+
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+  ++allocations;
+  if (void* pointer = std::malloc(size ? size : 1)) return pointer;
+
+  throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  ++allocations;
+  return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  ++allocations;
+  return std::malloc(size ? size : 1);
+}
+
+BOOST_NOINLINE void operator delete(void* pointer) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete[](void* pointer) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete(void* pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete[](void* pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete(void* pointer,
+                                    const std::nothrow_t&) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete[](void* pointer,
+                                      const std::nothrow_t&) noexcept
+{
+  std::free(pointer);
+}
+
+/**
+ * The result of a single benchmark worker.
+ */
+struct WorkerResult
+{
+  WorkerResult() :
+      steps(0),
+      resets(0),
+      errors(0),
+      checkedSteps(0),
+      allocatingSteps(0)
+  {
+    /* Nothing to do here */
+  }
+
+  //! The latency of every request in microseconds.
+  std::vector<double> latency;
+
+  //! The number of steps.
+  size_t steps;
+
+  //! The number of game resets.
+  size_t resets;
+
+  //! The number of failed steps.
+  size_t errors;
+
+  //! The number of steps checked for heap allocations.
+  size_t checkedSteps;
+
+  //! The number of checked steps that allocated.
+  size_t allocatingSteps;
+};
+
+/**
+ * Open a session and run the given number of steps using a scripted policy:
+ * run right and jump if there's an obstacle ahead; the game is reset once
+ * mario dies. With a sequence length above 1 the chosen action is repeated
+ * and sent as action sequence, every observation of the trajectory counts as
+ * step.
+ *
+ * A request (message, reply, parse) after the warm-up requests is checked for
+ * heap allocations; the resets aren't part of the steady state and aren't
+ * checked.
+ *
+ * @param pool The session pool.
+ * @param steps The number of steps.
+ * @param keyframeInterval The keyframe interval of the delta observations, 0
+ *        disables the delta observations.
+ * @param sequenceLength The number of actions per request.
+ * @param warmup The number of requests that aren't checked for allocations.
+ * @param result The result of the worker.
+ */
+void Worker(session::SessionPool& pool,
+            const size_t steps,
+            const int keyframeInterval,
+            const size_t sequenceLength,
+            const size_t warmup,
+            WorkerResult& result)
+{
+  static const uint8_t binaryKeys[] = {
+      messages::binary::KEY_RIGHT, messages::binary::KEY_A };
+  static const char* keys[] = { "Right", "A" };
+
+  result.latency.reserve(steps);
+
+  std::unique_ptr<session::Session> session = pool.Acquire();
+  observation::Observation state;
+  std::vector<int> trajectory;
+
+  try
+  {
+    if (!session->IsOpen()) session->Open();
+    session->ConfigSpeed("maximum");
+    session->ConfigDivisor(4);
+    session->ConfigDelta(keyframeInterval);
+    session->Reset();
+    result.resets++;
+
+    std::string actions[2];
+    for (size_t i = 0; i < 2 && sequenceLength > 1; ++i)
+    {
+      actions[i] = session->Message(messages::Sequence(
+          std::vector<std::pair<std::string, int> >(sequenceLength,
+          std::make_pair(std::string(keys[i]), 4))),
+          messages::binary::Sequence(std::vector<std::pair<uint8_t, int> >(
+          sequenceLength, std::make_pair(binaryKeys[i], 4))));
+    }
+
+    size_t action = 0;
+    size_t requests = 0;
+    for (size_t step = 0; step < steps; ++requests)
+    {
+      const std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      const size_t allocated = allocations;
+
+      try
+      {
+        NES_TIME(STEP);
+
+        boost::string_ref observation;
+        if (sequenceLength > 1)
+        {
+          session->Step(actions[action], observation);
+        }
+        else
+        {
+          session->Step(keys[action], binaryKeys[action], observation);
+        }
+
+        NES_TIME(PARSE);
+        parser::Parser& parser = session->Parser();
+        parser.Parse(observation);
+        parser.Observation(state);
+
+        // The single game info accessors return the last observation.
+        if (sequenceLength > 1)
+        {
+          parser.TrajectoryPlayerState(trajectory);
+          step += trajectory.size();
+          result.steps += trajectory.size();
+        }
+        else
+        {
+          step++;
+          result.steps++;
+        }
+      }
+      catch (const std::exception&)
+      {
+        NES_COUNT(FAILED_STEP);
+        result.errors++;
+        step++;
+        continue;
+      }
+
+      result.latency.push_back(std::chrono::duration<double, std::micro>(
+          std::chrono::steady_clock::now() - start).count());
+
+      if (requests >= warmup)
+      {
+        result.checkedSteps++;
+        if (allocations != allocated) result.allocatingSteps++;
+      }
+
+      // Mario died, start again.
+      if (state.playerState == 11 || observation::OnlyMario(state))
+      {
+        session->Reset();
+        result.resets++;
+        action = 0;
+        continue;
+      }
+
+      // Jump if the tile in front of mario isn't free.
+      const size_t row = state.size / 2;
+      const size_t col = state.size / 2 + 1;
+      action = (row > 0 && col < state.size &&
+          (state.Tile(row, col) != 0 || state.Tile(row - 1, col) != 0)) ?
+          1 : 0;
+    }
+  }
+  catch (const std::exception& ex)
+  {
+    std::cerr << "Worker: " << ex.what() << std::endl;
+  }
+
+  pool.Release(std::move(session));
+}
+
+//! Get the given percentile of the sorted values.
+double Percentile(const std::vector<double>& values, const double percentile)
+{
+  if (values.empty()) return 0;
+
+  const size_t index = std::min(values.size() - 1,
+      size_t(percentile / 100.0 * values.size()));
+  return values[index];
+}
+
+int main(int argc, char* argv[])
+{
+  // The allocation check can be enabled anywhere in the argument list.
+  std::vector<std::string> args;
+  bool checkAllocations = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::string(argv[i]) == "--check-allocations")
+    {
+      checkAllocations = true;
+    }
+    else
+    {
+      args.push_back(argv[i]);
+    }
+  }
+
+  if (args.size() < 2)
+  {
+    std::cout << "Usage: <host> <port> [<workers>] [<steps>] [json|binary] "
+              << "[<keyframe interval>] [<sequence length>] "
+              << "[--check-allocations]\n";
+    return 1;
+  }
+
+  const std::string host(args[0]);
+  const std::string port(args[1]);
+  size_t workers = args.size() > 2 ? std::atoi(args[2].c_str()) : 0;
+  const size_t steps = args.size() > 3 ? std::atoi(args[3].c_str()) : 10000;
+
+  messages::Protocol protocol = messages::BINARY;
+  if (args.size() > 4 && args[4] == "json")
+  {
+    protocol = messages::JSON;
+  }
+
+  const int keyframeInterval = args.size() > 5 ?
+      std::atoi(args[5].c_str()) : 0;
+  const size_t sequenceLength = std::min(std::max(
+      args.size() > 6 ? std::atoi(args[6].c_str()) : 1, 1), 255);
+
+  // Without the check every request counts as warm-up.
+  const size_t warmup = checkAllocations ? 100 : size_t(-1);
+
+  session::SessionPool pool(host, port, protocol);
+  if (workers == 0)
+  {
+    workers = std::max(pool.NumEndpoints(), size_t(1));
+  }
+
+  std::vector<WorkerResult> results(workers);
+  std::vector<std::thread> threads;
+
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < workers; ++i)
+  {
+    threads.push_back(std::thread(Worker, std::ref(pool), steps,
+        keyframeInterval, sequenceLength, warmup, std::ref(results[i])));
+  }
+
+  for (size_t i = 0; i < threads.size(); ++i)
+  {
+    threads[i].join();
+  }
+
+  const double time = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  // Merge the results of all workers.
+  WorkerResult total;
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    total.latency.insert(total.latency.end(), results[i].latency.begin(),
+        results[i].latency.end());
+    total.steps += results[i].steps;
+    total.resets += results[i].resets;
+    total.errors += results[i].errors;
+    total.checkedSteps += results[i].checkedSteps;
+    total.allocatingSteps += results[i].allocatingSteps;
+  }
+  std::sort(total.latency.begin(), total.latency.end());
+
+  double mean = 0;
+  for (size_t i = 0; i < total.latency.size(); ++i)
+  {
+    mean += total.latency[i];
+  }
+  mean = total.latency.empty() ? 0 : mean / total.latency.size();
+
+  std::cout << std::fixed << std::setprecision(1)
+            << "Protocol: " << (protocol == messages::BINARY ? "binary" : "json")
+            << std::endl
+            << "Workers: " << workers << std::endl
+            << "Keyframe interval: " << keyframeInterval << std::endl
+            << "Sequence length: " << sequenceLength << std::endl
+            << "Steps: " << total.steps << " (" << total.errors << " errors, "
+            << total.resets << " resets)" << std::endl
+            << "Time: " << time << " s" << std::endl
+            << "Steps/sec: " << (total.steps / time) << std::endl
+            << "Latency (us): mean " << mean
+            << " p50 " << Percentile(total.latency, 50)
+            << " p90 " << Percentile(total.latency, 90)
+            << " p99 " << Percentile(total.latency, 99)
+            << " p99.9 " << Percentile(total.latency, 99.9)
+            << " max " << (total.latency.empty() ? 0 : total.latency.back())
+            << std::endl;
+
+  // Per-phase breakdown, if compiled with instrumentation.
+  NES_DUMP(std::cout);
+
+  if (checkAllocations)
+  {
+    std::cout << "Allocating requests: " << total.allocatingSteps << " of "
+              << total.checkedSteps << " checked" << std::endl;
+    if (total.allocatingSteps > 0 || total.checkedSteps == 0) return 1;
+  }
+
+  return 0;
+}
@@ -4,13 +4,29 @@
  *
  * Miscellaneous client routines.
  */
+#ifndef NES_CLIENT_HPP
+#define NES_CLIENT_HPP
+
 #include <mlpack/core.hpp>
 
+#include "messages.hpp"
+#include "endpoint.hpp"
+#include "handler_memory.hpp"
+#include "instrumentation.hpp"
+#include "trace.hpp"
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
 #include <string>
 #include <boost/asio.hpp>
 #include <boost/asio/deadline_timer.hpp>
+#include <boost/array.hpp>
+#include <boost/bind.hpp>
 #include <boost/lambda/lambda.hpp>
 #include <boost/lambda/bind.hpp>
+#include <boost/utility/string_ref.hpp>
 
 namespace client {
 
@@ -31,18 +47,41 @@ void async_read_handler(const boost::system::error_code& err,
 
 /**
  * Implementation of the Client.
+ *
+ * The blocking functions (Connect, Send, Receive, Step, Sequence) drive the io
+ * service owned by the client. The asynchronous functions (AsyncConnect,
+ * AsyncSend, AsyncReceive, AsyncStep) complete on whatever thread runs the io
+ * service; several requests can be in flight, the replies are handed to the
+ * receive handlers in request order. To drive many clients from a few threads, create
+ * the clients using a shared io service and run it on a thread pool. A client
+ * that uses a shared io service must outlive its asynchronous operations, call
+ * Close() and wait for the outstanding handlers before destroying it.
+ *
+ * Set the NES_TRACE environment variable to a file to trace the messages of
+ * all clients of the process (see trace::Tracer), e.g. for the replay tool.
  */
 class Client {
  public:
+  //! Handler called once a message is sent.
+  typedef std::function<void(const boost::system::error_code&)> SendHandler;
+
+  //! Handler called once a message is received.
+  typedef std::function<void(const boost::system::error_code&,
+                             const std::string&)> ReceiveHandler;
+
   /**
-   * Create the Client object using the given host and port.
-   *
-   * @param host The hostname to connect.
-   * @param port The port used for the connection.
+   * Create the Client object using its own io service.
    */
   Client() :
+      service(new boost::asio::io_service()),
+      io_service(*service),
+      deadline(io_service),
       s(io_service),
-      deadline(io_service)
+      protocol(messages::JSON),
+      strand(io_service),
+      pending(0),
+      tracer(trace::Tracer::Global()),
+      traceId(0)
   {
     deadline.expires_at(boost::posix_time::pos_infin);
 
@@ -50,12 +89,41 @@ class Client {
     check_deadline();
   }
 
-  void Connect(const std::string& host, const std::string& port)
+  /**
+   * Create the Client object using the given (shared) io service. Only the
+   * asynchronous functions should be used with a shared io service.
+   *
+   * @param ioService The io service used for all operations.
+   */
+  Client(boost::asio::io_service& ioService) :
+      io_service(ioService),
+      deadline(io_service),
+      s(io_service),
+      protocol(messages::JSON),
+      strand(io_service),
+      pending(0),
+      tracer(trace::Tracer::Global()),
+      traceId(0)
   {
-    tcp::resolver resolver(io_service);
-    tcp::resolver::query query(tcp::v4(), host, port);
-    tcp::resolver::iterator iterator = resolver.resolve(query);
+    deadline.expires_at(boost::posix_time::pos_infin);
+  }
 
+  //! Trace the closed connection.
+  ~Client()
+  {
+    TraceClose();
+  }
+
+  /**
+   * Connect to the given endpoint.
+   *
+   * @param host The hostname to connect, or unix:<path> to connect to a unix
+   *        domain socket.
+   * @param port The port used for the connection, ignored for unix domain
+   *        sockets.
+   */
+  void Connect(const std::string& host, const std::string& port)
+  {
     // Set a deadline for the asynchronous operation.
     deadline.expires_from_now(boost::posix_time::seconds(10));
 
@@ -64,7 +132,8 @@ class Client {
     boost::system::error_code ec = boost::asio::error::would_block;
 
     // Start the asynchronous operation.
-    boost::asio::async_connect(s, iterator, var(ec) = _1);
+    endpoint::AsyncConnect(s, host, port,
+        [&ec](const boost::system::error_code& error) { ec = error; });
 
     // Block until the asynchronous operation has completed.
     do io_service.run_one(); while (ec == boost::asio::error::would_block);
@@ -75,8 +144,210 @@ class Client {
       throw boost::system::system_error(
           ec ? ec : boost::asio::error::operation_aborted);
     }
+
+    TraceConnect(host, port);
+  }
+
+  /**
+   * Resolve the given host and port and connect asynchronously.
+   *
+   * @param host The hostname to connect, or unix:<path>.
+   * @param port The port used for the connection.
+   * @param handler The handler called once the connection is established.
+   */
+  void AsyncConnect(const std::string& host,
+                    const std::string& port,
+                    const SendHandler& handler)
+  {
+    strand.dispatch([this, host, port, handler]()
+    {
+      Arm();
+      endpoint::AsyncConnect(s, host, port, strand.wrap([this, host, port,
+          handler](const boost::system::error_code& ec)
+      {
+        Disarm();
+        if (!ec) TraceConnect(host, port);
+        if (handler) handler(ec);
+      }));
+    });
+  }
+
+  /**
+   * Resolve the given host and port and connect asynchronously.
+   *
+   * @param host The hostname to connect.
+   * @param port The port used for the connection.
+   * @return Future that becomes ready once the connection is established.
+   */
+  std::future<void> AsyncConnect(const std::string& host,
+                                 const std::string& port)
+  {
+    std::shared_ptr<std::promise<void> > promise(new std::promise<void>());
+    AsyncConnect(host, port, [promise](const boost::system::error_code& ec)
+    {
+      SetPromise(*promise, ec);
+    });
+
+    return promise->get_future();
+  }
+
+  /**
+   * Queue the given message; messages are written in the order they are
+   * queued.
+   *
+   * @param data The data to be send.
+   * @param handler The handler called once the message is written.
+   */
+  void AsyncSend(const std::string& data, const SendHandler& handler)
+  {
+    std::shared_ptr<std::string> frame(new std::string());
+    if (protocol == messages::BINARY)
+    {
+      messages::binary::Put(*frame, data.size(),
+          messages::binary::HEADER_SIZE);
+      *frame += data;
+    }
+    else
+    {
+      *frame = data + "\r\n";
+    }
+
+    if (traceId) tracer->Send(traceId, protocol, data.data(), data.size());
+
+    strand.post([this, frame, handler]()
+    {
+      sendQueue.push_back(std::make_pair(frame, handler));
+      if (sendQueue.size() == 1) DoSend();
+    });
+  }
+
+  /**
+   * Queue the given message.
+   *
+   * @param data The data to be send.
+   * @return Future that becomes ready once the message is written.
+   */
+  std::future<void> AsyncSend(const std::string& data)
+  {
+    std::shared_ptr<std::promise<void> > promise(new std::promise<void>());
+    AsyncSend(data, [promise](const boost::system::error_code& ec)
+    {
+      SetPromise(*promise, ec);
+    });
+
+    return promise->get_future();
+  }
+
+  /**
+   * Queue a receive operation; the n'th queued handler gets the n'th reply.
+   *
+   * @param handler The handler called with the received data.
+   */
+  void AsyncReceive(const ReceiveHandler& handler)
+  {
+    strand.post([this, handler]()
+    {
+      receiveQueue.push_back(handler);
+      if (receiveQueue.size() == 1) DoReceive();
+    });
+  }
+
+  /**
+   * Queue a receive operation.
+   *
+   * @return Future that holds the received data.
+   */
+  std::future<std::string> AsyncReceive()
+  {
+    std::shared_ptr<std::promise<std::string> > promise(
+        new std::promise<std::string>());
+    AsyncReceive([promise](const boost::system::error_code& ec,
+                           const std::string& data)
+    {
+      if (ec)
+      {
+        promise->set_exception(std::make_exception_ptr(
+            boost::system::system_error(ec)));
+      }
+      else
+      {
+        promise->set_value(data);
+      }
+    });
+
+    return promise->get_future();
+  }
+
+  /**
+   * Queue a step message and the receive operation for the resulting
+   * observation.
+   *
+   * @param action The step message (messages::Step, messages::binary::Step).
+   * @param handler The handler called with the resulting observation.
+   */
+  void AsyncStep(const std::string& action, const ReceiveHandler& handler)
+  {
+    AsyncSend(action, SendHandler());
+    AsyncReceive(handler);
+  }
+
+  //! Close the socket; outstanding operations complete with an error.
+  void Close()
+  {
+    TraceClose();
+    strand.dispatch([this]()
+    {
+      boost::system::error_code ignored_ec;
+      s.close(ignored_ec);
+      Disarm();
+    });
+  }
+
+  //! Get the io service used by the client.
+  boost::asio::io_service& Service() { return io_service; }
+
+  //! Return true if the socket is open.
+  bool IsOpen() const { return s.is_open(); }
+
+  /**
+   * Switch the wire protocol of the session. The request is sent using the
+   * current protocol, the acknowledgement is expected in the new protocol.
+   *
+   * @param protocol The protocol used for all following messages.
+   */
+  void Protocol(const messages::Protocol protocol)
+  {
+    if (protocol == this->protocol)
+    {
+      return;
+    }
+
+    if (this->protocol == messages::JSON)
+    {
+      Send(messages::JSONMessage(messages::ConfigProtocol("binary")));
+    }
+    else
+    {
+      Send(messages::binary::ConfigProtocol(protocol));
+    }
+
+    this->protocol = protocol;
+
+    std::string ack;
+    Receive(ack);
+
+    if (protocol == messages::BINARY && (ack.size() != 2 ||
+        uint8_t(ack[0]) != messages::binary::REPLY_PROTOCOL ||
+        uint8_t(ack[1]) != messages::BINARY))
+    {
+      this->protocol = messages::JSON;
+      throw std::runtime_error("Binary protocol not supported by the server.");
+    }
   }
 
+  //! Get the wire protocol of the session.
+  messages::Protocol Protocol() const { return protocol; }
+
   /**
    * Receive a message using the currently open socket.
    *
@@ -84,19 +355,104 @@ class Client {
    */
   void Receive(std::string& data)
   {
+    boost::string_ref view;
+    Receive(view);
+
+    // Assign to reuse the capacity of the given string.
+    data.assign(view.data(), view.size());
+  }
+
+  /**
+   * Receive a message using the currently open socket without copying it.
+   * Bytes received after the message are kept for the next receive operation.
+   *
+   * @param data View of the received data; the view points into the receive
+   *        buffer and is valid until the next receive operation.
+   */
+  void Receive(boost::string_ref& data)
+  {
+    NES_TIME(RECEIVE);
+
+    // Release the message handed out by the last receive operation.
+    Consume();
+
+    size_t offset = 0;
+    size_t reply_length;
+
+    if (protocol == messages::BINARY)
+    {
+      offset = messages::binary::HEADER_SIZE;
+      reply_length = ReceiveFrame();
+    }
+    else
+    {
+      // Set a deadline for the asynchronous operation.
+      deadline.expires_from_now(boost::posix_time::seconds(10));
+
+      // Set up the variable that receives the result of the asynchronous
+      // operation.
+      boost::system::error_code ec = boost::asio::error::would_block;
+
+      boost::asio::async_read_until(s, readBuffer, "\r\n\r\n\r\n",
+        handler::MakeHandler(handlerMemory, boost::bind(async_read_handler,
+          boost::asio::placeholders::error, &ec,
+          boost::asio::placeholders::bytes_transferred, &reply_length)));
+
+      // Block until the asynchronous operation has completed.
+      do io_service.run_one(); while (ec == boost::asio::error::would_block);
+
+      if (ec)
+      {
+        throw boost::system::system_error(ec);
+      }
+    }
+
+    pending = offset + reply_length;
+    data = boost::string_ref(boost::asio::buffer_cast<const char*>(
+        readBuffer.data()) + offset, reply_length);
+
+    if (traceId) tracer->Receive(traceId, protocol, data.data(), data.size());
+  }
+
+  /**
+   * Send a message using the currently open socket.
+   *
+   * @param data The data to be send.
+   */
+  void Send(const std::string& data)
+  {
+    NES_TIME(SEND);
+    static const char delimiter[] = "\r\n";
+
+    if (traceId) tracer->Send(traceId, protocol, data.data(), data.size());
+
     // Set a deadline for the asynchronous operation.
-    deadline.expires_from_now(boost::posix_time::seconds(10));
+    deadline.expires_from_now(boost::posix_time::seconds(1000));
 
     // Set up the variable that receives the result of the asynchronous
     // operation.
     boost::system::error_code ec = boost::asio::error::would_block;
 
-    boost::asio::streambuf response;
-    size_t reply_length;
+    // Gather the frame header (binary) or the delimiter (json) and the data
+    // without copying the data.
+    char header[messages::binary::HEADER_SIZE];
+    boost::array<boost::asio::const_buffer, 2> buffers;
 
-    boost::asio::async_read_until(s, response, "\r\n\r\n\r\n",
-      boost::bind(async_read_handler, boost::asio::placeholders::error, &ec,
-        boost::asio::placeholders::bytes_transferred, &reply_length));
+    if (protocol == messages::BINARY)
+    {
+      messages::binary::Put(header, data.size(),
+          messages::binary::HEADER_SIZE);
+      buffers[0] = boost::asio::buffer(header);
+      buffers[1] = boost::asio::buffer(data);
+    }
+    else
+    {
+      buffers[0] = boost::asio::buffer(data);
+      buffers[1] = boost::asio::buffer(delimiter, sizeof(delimiter) - 1);
+    }
+
+    boost::asio::async_write(s, buffers,
+        handler::MakeHandler(handlerMemory, var(ec) = _1));
 
     // Block until the asynchronous operation has completed.
     do io_service.run_one(); while (ec == boost::asio::error::would_block);
@@ -105,28 +461,93 @@ class Client {
     {
       throw boost::system::system_error(ec);
     }
+  }
 
-    data = std::string(
-        boost::asio::buffers_begin(response.data()),
-        boost::asio::buffers_begin(response.data()) + reply_length);
+  /**
+   * Send a step message and receive the resulting observation in a single
+   * round-trip.
+   *
+   * @param action The step message (messages::Step, messages::binary::Step).
+   * @param observation The received game info.
+   */
+  void Step(const std::string& action, std::string& observation)
+  {
+    Send(action);
+    Receive(observation);
   }
 
   /**
-   * Send a message using the currently open socket.
+   * Send a step message and receive the resulting observation without copying
+   * it.
    *
-   * @param data The data to be send.
+   * @param action The step message (messages::Step, messages::binary::Step).
+   * @param observation View of the received game info, valid until the next
+   *        receive operation.
    */
-  void Send(const std::string& data)
+  void Step(const std::string& action, boost::string_ref& observation)
+  {
+    Send(action);
+    Receive(observation);
+  }
+
+  /**
+   * Send an action sequence and receive the trajectory, the observations
+   * after every action, in a single round-trip.
+   *
+   * @param sequence The sequence message (messages::Sequence,
+   *        messages::binary::Sequence).
+   * @param trajectory View of the received trajectory, valid until the next
+   *        receive operation; use parser::Parser::Trajectory to decode it.
+   */
+  void Sequence(const std::string& sequence, boost::string_ref& trajectory)
+  {
+    Send(sequence);
+    Receive(trajectory);
+  }
+
+ private:
+  /**
+   * Read until the receive buffer holds a complete length-prefixed frame.
+   *
+   * @return The length of the payload that follows the frame header.
+   */
+  size_t ReceiveFrame()
   {
+    Fill(messages::binary::HEADER_SIZE);
+
+    char header[messages::binary::HEADER_SIZE];
+    std::copy(boost::asio::buffers_begin(readBuffer.data()),
+        boost::asio::buffers_begin(readBuffer.data()) +
+        messages::binary::HEADER_SIZE, header);
+
+    const size_t length = messages::binary::Get(header,
+        messages::binary::HEADER_SIZE);
+    Fill(messages::binary::HEADER_SIZE + length);
+
+    return length;
+  }
+
+  //! Read until the receive buffer holds at least the given number of bytes.
+  void Fill(const size_t size)
+  {
+    if (readBuffer.size() >= size)
+    {
+      return;
+    }
+
     // Set a deadline for the asynchronous operation.
-    deadline.expires_from_now(boost::posix_time::seconds(1000));
+    deadline.expires_from_now(boost::posix_time::seconds(10));
 
     // Set up the variable that receives the result of the asynchronous
     // operation.
     boost::system::error_code ec = boost::asio::error::would_block;
+    size_t length;
 
-    boost::asio::async_write(s, boost::asio::buffer(data  + "\r\n"),
-        var(ec) = _1);
+    boost::asio::async_read(s, readBuffer,
+      boost::asio::transfer_at_least(size - readBuffer.size()),
+      handler::MakeHandler(handlerMemory, boost::bind(async_read_handler,
+        boost::asio::placeholders::error, &ec,
+        boost::asio::placeholders::bytes_transferred, &length)));
 
     // Block until the asynchronous operation has completed.
     do io_service.run_one(); while (ec == boost::asio::error::would_block);
@@ -137,7 +558,224 @@ class Client {
     }
   }
 
- private:
+  //! Remove the message handed out by the last receive operation.
+  void Consume()
+  {
+    readBuffer.consume(pending);
+    pending = 0;
+  }
+
+  //! Write the first queued message.
+  void DoSend()
+  {
+    Arm();
+    boost::asio::async_write(s, boost::asio::buffer(*sendQueue.front().first),
+        strand.wrap([this](const boost::system::error_code& ec, size_t)
+    {
+      SendHandler handler = sendQueue.front().second;
+      sendQueue.pop_front();
+
+      if (ec)
+      {
+        // The connection is broken, fail all queued messages.
+        std::deque<std::pair<std::shared_ptr<std::string>, SendHandler> >
+            failed;
+        failed.swap(sendQueue);
+
+        if (handler) handler(ec);
+        for (size_t i = 0; i < failed.size(); ++i)
+        {
+          if (failed[i].second) failed[i].second(ec);
+        }
+        return;
+      }
+
+      if (!sendQueue.empty())
+      {
+        DoSend();
+      }
+      else if (receiveQueue.empty())
+      {
+        Disarm();
+      }
+
+      if (handler) handler(ec);
+    }));
+  }
+
+  //! Read the reply for the first queued receive operation.
+  void DoReceive()
+  {
+    Consume();
+    Arm();
+
+    if (protocol == messages::BINARY)
+    {
+      DoReceiveFrame();
+      return;
+    }
+
+    boost::asio::async_read_until(s, readBuffer, "\r\n\r\n\r\n",
+        strand.wrap([this](const boost::system::error_code& ec, size_t length)
+    {
+      Received(ec, 0, length, length);
+    }));
+  }
+
+  //! Read until the persistent buffer holds a complete frame.
+  void DoReceiveFrame()
+  {
+    const size_t headerSize = messages::binary::HEADER_SIZE;
+    size_t needed = headerSize;
+
+    if (readBuffer.size() >= headerSize)
+    {
+      char header[messages::binary::HEADER_SIZE];
+      std::copy(boost::asio::buffers_begin(readBuffer.data()),
+          boost::asio::buffers_begin(readBuffer.data()) + headerSize, header);
+      needed += messages::binary::Get(header, headerSize);
+
+      if (readBuffer.size() >= needed)
+      {
+        Received(boost::system::error_code(), headerSize, needed - headerSize,
+            needed);
+        return;
+      }
+    }
+
+    boost::asio::async_read(s, readBuffer,
+        boost::asio::transfer_at_least(needed - readBuffer.size()),
+        strand.wrap([this](const boost::system::error_code& ec, size_t)
+    {
+      if (ec)
+      {
+        Received(ec, 0, 0, 0);
+        return;
+      }
+
+      DoReceiveFrame();
+    }));
+  }
+
+  /**
+   * Hand the received message to the first queued receive handler.
+   *
+   * @param ec The result of the read operation.
+   * @param offset The offset of the message in the persistent buffer.
+   * @param length The length of the message.
+   * @param consumed The number of bytes to remove from the persistent buffer.
+   */
+  void Received(const boost::system::error_code& ec,
+                const size_t offset,
+                const size_t length,
+                const size_t consumed)
+  {
+    if (ec)
+    {
+      // The connection is broken, fail all queued receive operations.
+      std::deque<ReceiveHandler> failed;
+      failed.swap(receiveQueue);
+
+      for (size_t i = 0; i < failed.size(); ++i)
+      {
+        if (failed[i]) failed[i](ec, std::string());
+      }
+      return;
+    }
+
+    const std::string data(
+        boost::asio::buffers_begin(readBuffer.data()) + offset,
+        boost::asio::buffers_begin(readBuffer.data()) + offset + length);
+    readBuffer.consume(consumed);
+
+    if (traceId) tracer->Receive(traceId, protocol, data.data(), data.size());
+
+    ReceiveHandler handler = receiveQueue.front();
+    receiveQueue.pop_front();
+
+    if (!receiveQueue.empty())
+    {
+      DoReceive();
+    }
+    else if (sendQueue.empty())
+    {
+      Disarm();
+    }
+
+    if (handler) handler(ec, data);
+  }
+
+  //! Trace the established connection, if tracing is enabled.
+  void TraceConnect(const std::string& host, const std::string& port)
+  {
+    if (!tracer) return;
+
+    TraceClose();
+    traceId = tracer->Connection();
+    tracer->Connect(traceId, host, port);
+  }
+
+  //! Trace the closed connection, if the connection is traced.
+  void TraceClose()
+  {
+    if (!traceId) return;
+
+    tracer->Close(traceId);
+    traceId = 0;
+  }
+
+  //! Set a deadline for the outstanding asynchronous operations.
+  void Arm()
+  {
+    deadline.expires_from_now(boost::posix_time::seconds(10));
+
+    // Clients using a shared io service have no persistent deadline actor.
+    if (!service)
+    {
+      deadline.async_wait(strand.wrap([this](
+          const boost::system::error_code& ec)
+      {
+        if (ec == boost::asio::error::operation_aborted) return;
+
+        if (deadline.expires_at() <= deadline_timer::traits_type::now())
+        {
+          NES_COUNT(TIMEOUTS);
+
+          boost::system::error_code ignored_ec;
+          s.close(ignored_ec);
+        }
+      }));
+    }
+  }
+
+  //! Remove the deadline once no asynchronous operation is outstanding.
+  void Disarm()
+  {
+    if (service)
+    {
+      deadline.expires_at(boost::posix_time::pos_infin);
+    }
+    else
+    {
+      deadline.cancel();
+    }
+  }
+
+  //! Fulfill the given promise using the given result.
+  static void SetPromise(std::promise<void>& promise,
+                         const boost::system::error_code& ec)
+  {
+    if (ec)
+    {
+      promise.set_exception(std::make_exception_ptr(
+          boost::system::system_error(ec)));
+    }
+    else
+    {
+      promise.set_value();
+    }
+  }
+
   void check_deadline()
   {
     // Check whether the deadline has passed. We compare the deadline against
@@ -148,6 +786,8 @@ class Client {
       // The deadline has passed. The socket is closed so that any outstanding
       // asynchronous operations are cancelled. This allows the blocked
       // connect(), read_line() or write_line() functions to return.
+      NES_COUNT(TIMEOUTS);
+
       boost::system::error_code ignored_ec;
       s.close(ignored_ec);
 
@@ -160,13 +800,47 @@ class Client {
     deadline.async_wait(bind(&Client::check_deadline, this));
   }
 
-  //! Locally stored io service.
-  boost::asio::io_service io_service;
+  //! Locally stored io service, if the client owns the io service.
+  std::unique_ptr<boost::asio::io_service> service;
+
+  //! Locally stored io service used for all operations.
+  boost::asio::io_service& io_service;
 
   deadline_timer deadline;
 
-  //! Locally stored socket object.
-  tcp::socket s;
+  //! Locally stored socket object (TCP or unix domain socket).
+  endpoint::Socket s;
+
+  //! Locally stored wire protocol.
+  messages::Protocol protocol;
+
+  //! Locally stored strand that serializes the asynchronous operations.
+  boost::asio::io_service::strand strand;
+
+  //! Locally stored queue of messages to be written.
+  std::deque<std::pair<std::shared_ptr<std::string>, SendHandler> > sendQueue;
+
+  //! Locally stored queue of outstanding receive operations.
+  std::deque<ReceiveHandler> receiveQueue;
+
+  //! Locally stored buffer that keeps received bytes between reads.
+  boost::asio::streambuf readBuffer;
+
+  //! Locally stored memory of the operations of the blocking functions, so a
+  // request doesn't allocate.
+  handler::HandlerMemory handlerMemory;
+
+  //! Locally stored number of bytes of the message handed out by the last
+  // receive operation; released with the next receive operation.
+  size_t pending;
+
+  //! Locally stored tracer of the process, NULL if tracing is disabled.
+  trace::Tracer* tracer;
+
+  //! Locally stored id of the traced connection, 0 if not traced.
+  size_t traceId;
 }; // class Client
 
-} // namespace client
\ No newline at end of file
+} // namespace client
+
+#endif
@@ -0,0 +1,1138 @@
+/**
+ * @file emulator.cpp
+ * @author Marcus Edel
+ *
+ * Stand-in for fceux running super_mario_bros.lua. The emulator speaks the
+ * same JSON and binary protocol and plays a synthetic level, so the client,
+ * the parser and the balancer can be benchmarked without fceux and the ROM.
+ */
+
+#include "messages.hpp"
+#include "endpoint.hpp"
+#include "frame_ring.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <istream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+using endpoint::Socket;
+
+//! The radius of the view field.
+const int radius = 6;
+
+//! The size of the view field.
+const int size = 2 * radius + 1;
+
+//! The frame time in microseconds using the normal emulation speed.
+const int normalFrameTime = 16667;
+
+/**
+ * A synthetic Super Mario Bros. level: ground with holes, pipes, bricks and
+ * enemies. The positions use the units of read_memory.lua.
+ */
+class Game
+{
+ public:
+  Game() { Reset(); }
+
+  //! Load the initial state (savestate).
+  void Reset()
+  {
+    marioX = 40;
+    marioY = 208;
+    velocity = 0;
+    lives = 2;
+    coins = 0;
+    state = 8;
+  }
+
+  //! Advance a single frame using the given key.
+  void Advance(const std::string& key)
+  {
+    // Dying or fallen off the level.
+    if (state == 11) return;
+
+    if (key == "Right" && !Solid(Column(marioX + 2) + 1, Row(marioY)))
+    {
+      marioX = std::min(marioX + 2, 3300);
+    }
+    else if (key == "Left" && !Solid(Column(marioX - 2), Row(marioY)))
+    {
+      marioX = std::max(marioX - 2, 0);
+    }
+    else if (key == "A" && OnGround())
+    {
+      velocity = -10;
+    }
+
+    if (!OnGround() || velocity < 0)
+    {
+      velocity = std::min(velocity + 1, 8);
+      marioY += velocity;
+
+      // Land on the solid tile below.
+      if (velocity > 0 && Solid(Column(marioX + 8), Row(marioY) + 1))
+      {
+        marioY = Row(marioY) * 16 + 48;
+        velocity = 0;
+      }
+    }
+
+    if (Enemy(Column(marioX), Row(marioY)) || marioY >= 0x1B0 + 16 * radius)
+    {
+      state = 11;
+      --lives;
+    }
+  }
+
+  //! Fill the tiles of the view field in the row order of the lua tables
+  // (-radius, ..., radius).
+  void Tiles(int tiles[size][size]) const
+  {
+    for (int dy = -radius; dy <= radius; ++dy)
+    {
+      const int row = Row(marioY + dy * 16);
+      for (int dx = -radius; dx <= radius; ++dx)
+      {
+        const int column = Column(marioX + dx * 16 + 8);
+
+        int tile = 0;
+        if ((marioY + dy * 16) < 0x1B0)
+        {
+          if (Enemy(column, row))
+          {
+            tile = 2;
+          }
+          else if (Solid(column, row))
+          {
+            tile = 1;
+          }
+        }
+
+        tiles[dy + radius][dx + radius] = tile;
+      }
+    }
+
+    tiles[1 + radius][radius] = 3;
+  }
+
+  int marioX;
+  int marioY;
+  int lives;
+  int coins;
+  int state;
+
+ private:
+  //! Whether mario stands on a solid tile.
+  bool OnGround() const
+  {
+    return marioY >= 48 && ((marioY - 48) % 16) == 0 &&
+        Solid(Column(marioX + 8), Row(marioY) + 1);
+  }
+
+  static int Column(const int x) { return x < 0 ? -1 : x / 16; }
+
+  static int Row(const int y)
+  {
+    return y < 48 ? -1 : (y - 48) / 16;
+  }
+
+  //! Whether the tile at the given column and row is solid.
+  static bool Solid(const int column, const int row)
+  {
+    if (column < 0) return true;
+    if (row < 0 || row > 12) return false;
+
+    // Ground with holes.
+    if (row >= 11) return column < 16 || (column % 48) < 30 ||
+        (column % 48) > 31;
+
+    // Pipes.
+    if (row >= 9) return column > 16 && (column % 37) == 20;
+
+    // Bricks.
+    return row == 6 && (column % 29) == 13;
+  }
+
+  //! Whether there's an enemy at the given column and row.
+  static bool Enemy(const int column, const int row)
+  {
+    return row == 10 && column > 16 && (column % 41) == 25;
+  }
+
+  int velocity;
+};
+
+/**
+ * A single emulator instance that serves one client at a time, like the lua
+ * server (backlog 1).
+ */
+class Emulator
+{
+ public:
+  /**
+   * Create the emulator listening on the given address.
+   *
+   * @param address The TCP port or unix:<path>.
+   * @param frameTime The minimum time of a frame in microseconds.
+   */
+  Emulator(const std::string& address, const int frameTime) :
+      address(address),
+      frameTime(frameTime)
+  {
+    /* Nothing to do here */
+  }
+
+  //! Accept clients and run the frame loop.
+  void Run()
+  {
+    boost::asio::io_service ioService;
+    endpoint::Acceptor acceptor(ioService);
+    endpoint::Bind(acceptor, address, 1);
+
+    for (;;)
+    {
+      Socket socket(ioService);
+      acceptor.accept(socket);
+      endpoint::NoDelay(socket);
+
+      // Load the savestate and restore the defaults of the lua script.
+      game.Reset();
+      frameCounter = 0;
+      frameDivisor = 30;
+      imageQuality = 80;
+      speed = "maximum";
+      protocol = messages::JSON;
+      currentKey.clear();
+      pendingStep = false;
+      deltaInterval = 0;
+      deltaCount = 0;
+      lastTiles.clear();
+      sequence.clear();
+      ring.reset();
+      states.clear();
+
+      boost::asio::streambuf buffer;
+      for (;;)
+      {
+        // Continue the running action sequence.
+        if (!sequence.empty())
+        {
+          SequenceFrame(socket);
+        }
+
+        if (sequence.empty() && (frameCounter % frameDivisor) == 0)
+        {
+          // Answer the last step with the game info after the frame divisor.
+          if (pendingStep)
+          {
+            pendingStep = false;
+            GameHandler(socket, "Info");
+          }
+
+          std::string data;
+          if (!Receive(socket, buffer, data)) break;
+
+          if (protocol == messages::BINARY)
+          {
+            BinaryHandler(socket, data);
+          }
+          else
+          {
+            FunctionHandler(socket, data);
+          }
+        }
+
+        // Continue with the last key.
+        game.Advance(currentKey);
+
+        if (!sequence.empty())
+        {
+          sequenceFrames--;
+        }
+
+        frameCounter++;
+        Advance();
+      }
+    }
+  }
+
+ private:
+  //! Wait for the next frame.
+  void Advance()
+  {
+    const int time = speed == "normal" ?
+        std::max(frameTime, normalFrameTime) : frameTime;
+
+    if (time > 0)
+    {
+      std::this_thread::sleep_for(std::chrono::microseconds(time));
+    }
+  }
+
+  //! Receive the next message using the negotiated protocol.
+  bool Receive(Socket& socket,
+               boost::asio::streambuf& buffer,
+               std::string& data)
+  {
+    boost::system::error_code error;
+    if (protocol == messages::BINARY)
+    {
+      if (!Fill(socket, buffer, messages::binary::HEADER_SIZE)) return false;
+
+      const size_t length = messages::binary::Get(
+          boost::asio::buffer_cast<const char*>(buffer.data()),
+          messages::binary::HEADER_SIZE);
+      buffer.consume(messages::binary::HEADER_SIZE);
+
+      if (!Fill(socket, buffer, length)) return false;
+
+      data.assign(boost::asio::buffer_cast<const char*>(buffer.data()),
+          length);
+      buffer.consume(length);
+      return true;
+    }
+
+    boost::asio::read_until(socket, buffer, '\n', error);
+    if (error) return false;
+
+    std::istream stream(&buffer);
+    std::getline(stream, data);
+    if (!data.empty() && data[data.size() - 1] == '\r')
+    {
+      data.erase(data.size() - 1);
+    }
+
+    return true;
+  }
+
+  //! Read until the buffer holds at least the given number of bytes.
+  static bool Fill(Socket& socket,
+                   boost::asio::streambuf& buffer,
+                   const size_t size)
+  {
+    if (buffer.size() >= size) return true;
+
+    boost::system::error_code error;
+    boost::asio::read(socket, buffer,
+        boost::asio::transfer_at_least(size - buffer.size()), error);
+    return !error;
+  }
+
+  //! Send the given reply using the negotiated protocol.
+  void Send(Socket& socket, const std::string& data)
+  {
+    boost::system::error_code error;
+    if (protocol == messages::BINARY)
+    {
+      std::string header;
+      messages::binary::Put(header, data.size(), messages::binary::HEADER_SIZE);
+      boost::asio::write(socket, boost::asio::buffer(header + data), error);
+    }
+    else
+    {
+      boost::asio::write(socket, boost::asio::buffer(data + "\r\n\r\n\r\n"),
+          error);
+    }
+  }
+
+  //! Press the given key and continue with that key.
+  void KeyHandler(const std::string& key)
+  {
+    currentKey = key;
+  }
+
+  //! Handle the given game value (Reset, Image, Tiles, Info).
+  void GameHandler(Socket& socket, const std::string& value)
+  {
+    if (value == "Reset")
+    {
+      game.Reset();
+    }
+    else if (value == "Image" && ring)
+    {
+      // Publish the frame into the shared memory ring instead of sending the
+      // image.
+      const uint32_t frame = PublishScreen();
+      if (protocol == messages::BINARY)
+      {
+        std::string reply(1, char(messages::binary::REPLY_FRAME));
+        messages::binary::Put(reply, frame, 4);
+        Send(socket, reply);
+      }
+      else
+      {
+        Send(socket, "{\"frame\":" + std::to_string(frame) + "}");
+      }
+    }
+    else if (value == "Image")
+    {
+      Send(socket, protocol == messages::BINARY ?
+          std::string(1, char(messages::binary::REPLY_IMAGE)) + Image() :
+          Image());
+    }
+    else if (value == "Tiles" || value == "Info")
+    {
+      int tiles[size][size];
+      game.Tiles(tiles);
+
+      // The frame is published before the game info is sent.
+      if (value == "Info" && ring)
+      {
+        PublishScreen();
+      }
+
+      // Send the changed tiles only, if delta observations are enabled.
+      std::vector<int> values;
+      FlattenTiles(tiles, values);
+
+      std::vector<int> changes;
+      const bool delta = value == "Info" && DeltaTiles(values, changes);
+      lastTiles = values;
+
+      if (delta)
+      {
+        deltaCount++;
+        SendDelta(socket, changes);
+        return;
+      }
+      else if (value == "Info")
+      {
+        deltaCount = 0;
+      }
+
+      if (value == "Info")
+      {
+        Send(socket, protocol == messages::BINARY ?
+            std::string(1, char(messages::binary::REPLY_INFO)) +
+            Observation(tiles, values) : Observation(tiles, values));
+      }
+      else if (protocol == messages::BINARY)
+      {
+        std::string reply(1, char(messages::binary::REPLY_TILES));
+        reply.push_back(char(size));
+        for (size_t i = 0; i < values.size(); ++i)
+        {
+          reply.push_back(char(values[i]));
+        }
+
+        Send(socket, reply);
+      }
+      else
+      {
+        Send(socket, "{\"tiles\":" + TilesJSON(tiles) + "}");
+      }
+    }
+  }
+
+  //! Encode the current game info using the negotiated protocol, without the
+  // binary reply opcode.
+  std::string Observation(int tiles[size][size],
+                          const std::vector<int>& values) const
+  {
+    if (protocol == messages::BINARY)
+    {
+      std::string info;
+      messages::binary::Put(info, game.marioX, 2);
+      messages::binary::Put(info, game.marioY, 2);
+      info.push_back(char(game.lives % 256));
+      info.push_back(char(game.coins % 256));
+      info.push_back(char(game.state % 256));
+      info.push_back(char(size));
+      for (size_t i = 0; i < values.size(); ++i)
+      {
+        info.push_back(char(values[i]));
+      }
+
+      return info;
+    }
+
+    return "{\"mario\":{\"x\":" + std::to_string(game.marioX) + ",\"y\":" +
+        std::to_string(game.marioY) + "},\"lives\":" +
+        std::to_string(game.lives) + ",\"coins\":" +
+        std::to_string(game.coins) + ",\"state\":" +
+        std::to_string(game.state) + ",\"tiles\":" + TilesJSON(tiles) + "}";
+  }
+
+  //! Get the tiles that changed since the last game info, returns false if a
+  // keyframe has to be sent.
+  bool DeltaTiles(const std::vector<int>& values, std::vector<int>& changes)
+  {
+    if (deltaInterval <= 0 || lastTiles.size() != values.size() ||
+        deltaCount >= deltaInterval)
+    {
+      return false;
+    }
+
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+      if (values[i] != lastTiles[i])
+      {
+        changes.push_back(i);
+        changes.push_back(values[i]);
+      }
+    }
+
+    // A keyframe is smaller if most of the tiles changed.
+    return changes.size() <= values.size();
+  }
+
+  //! Send the game info with the given changed tiles.
+  void SendDelta(Socket& socket, const std::vector<int>& changes)
+  {
+    if (protocol == messages::BINARY)
+    {
+      std::string reply;
+      reply.push_back(char(messages::binary::REPLY_DELTA));
+      messages::binary::Put(reply, game.marioX, 2);
+      messages::binary::Put(reply, game.marioY, 2);
+      reply.push_back(char(game.lives % 256));
+      reply.push_back(char(game.coins % 256));
+      reply.push_back(char(game.state % 256));
+      reply.push_back(char(changes.size() / 2));
+
+      for (size_t i = 0; i < changes.size(); ++i)
+      {
+        reply.push_back(char(changes[i]));
+      }
+
+      Send(socket, reply);
+      return;
+    }
+
+    // cjson encodes an empty table as object.
+    std::string delta = changes.empty() ? "{}" : "[";
+    for (size_t i = 0; i < changes.size(); ++i)
+    {
+      delta += (i ? "," : "") + std::to_string(changes[i]);
+    }
+    if (!changes.empty()) delta += "]";
+
+    Send(socket, "{\"mario\":{\"x\":" + std::to_string(game.marioX) +
+        ",\"y\":" + std::to_string(game.marioY) + "},\"lives\":" +
+        std::to_string(game.lives) + ",\"coins\":" +
+        std::to_string(game.coins) + ",\"state\":" +
+        std::to_string(game.state) + ",\"delta\":" + delta + "}");
+  }
+
+  //! Save, load or discard the given savestate slot; returns false if the slot
+  // to load doesn't exist, the rest of the message is ignored.
+  bool StateHandler(Socket& socket,
+                    const std::string& operation,
+                    const int slot)
+  {
+    if (operation == "save")
+    {
+      states[slot] = game;
+    }
+    else if (operation == "load")
+    {
+      const std::map<int, Game>::const_iterator it = states.find(slot);
+      if (it == states.end())
+      {
+        std::string reply(1, char(messages::binary::REPLY_MISSING));
+        messages::binary::Put(reply, slot, 2);
+        Send(socket, protocol == messages::BINARY ? reply :
+            "{\"missing\":" + std::to_string(slot) + "}");
+        return false;
+      }
+
+      game = it->second;
+    }
+    else if (operation == "discard")
+    {
+      states.erase(slot);
+    }
+
+    return true;
+  }
+
+  //! Press the given key and send the game info once the frame divisor is
+  // advanced.
+  void StepHandler(const std::string& key)
+  {
+    KeyHandler(key);
+    pendingStep = true;
+  }
+
+  //! Start the given action sequence; the game info after every action is
+  // sent as single trajectory once the sequence is finished or mario died.
+  void SequenceHandler(Socket& socket,
+                       const std::vector<std::pair<std::string, int> >& actions)
+  {
+    trajectory.clear();
+
+    if (actions.empty())
+    {
+      SendTrajectory(socket);
+      return;
+    }
+
+    sequence = actions;
+    sequenceIndex = 0;
+    sequenceFrames = std::max(sequence[0].second, 1);
+    KeyHandler(sequence[0].first);
+  }
+
+  //! Continue the running action sequence; called before every frame.
+  void SequenceFrame(Socket& socket)
+  {
+    if (sequenceFrames > 0) return;
+
+    // The frames of the running action are advanced.
+    int tiles[size][size];
+    game.Tiles(tiles);
+
+    std::vector<int> values;
+    FlattenTiles(tiles, values);
+    trajectory.push_back(Observation(tiles, values));
+
+    if (game.state == 11 || sequenceIndex + 1 == sequence.size())
+    {
+      // The client keeps the tiles of the last observation, so the next
+      // delta is based on them.
+      lastTiles = values;
+      SendTrajectory(socket);
+      sequence.clear();
+
+      // Handle the next message right away.
+      frameCounter = 0;
+      return;
+    }
+
+    sequenceIndex++;
+    sequenceFrames = std::max(sequence[sequenceIndex].second, 1);
+    KeyHandler(sequence[sequenceIndex].first);
+  }
+
+  //! Send the observations of the finished action sequence.
+  void SendTrajectory(Socket& socket)
+  {
+    if (ring)
+    {
+      PublishScreen();
+    }
+
+    if (protocol == messages::BINARY)
+    {
+      std::string reply(1, char(messages::binary::REPLY_TRAJECTORY));
+      reply.push_back(char(trajectory.size()));
+      for (size_t i = 0; i < trajectory.size(); ++i)
+      {
+        reply += trajectory[i];
+      }
+
+      Send(socket, reply);
+      return;
+    }
+
+    // cjson encodes an empty table as object.
+    std::string reply = trajectory.empty() ? "{" : "[";
+    for (size_t i = 0; i < trajectory.size(); ++i)
+    {
+      reply += (i ? "," : "") + trajectory[i];
+    }
+
+    Send(socket, "{\"trajectory\":" + reply +
+        (trajectory.empty() ? "}" : "]") + "}");
+  }
+
+  //! Handle the given config value.
+  void ConfigHandler(Socket& socket,
+                     const std::string& field,
+                     const std::string& value)
+  {
+    if (field == "frame")
+    {
+      frameCounter = std::atoi(value.c_str());
+    }
+    else if (field == "image")
+    {
+      imageQuality = std::atoi(value.c_str());
+    }
+    else if (field == "divisor")
+    {
+      frameDivisor = std::max(std::atoi(value.c_str()), 1);
+    }
+    else if (field == "speed")
+    {
+      speed = value;
+    }
+    else if (field == "delta")
+    {
+      // The next game info is a keyframe.
+      deltaInterval = std::atoi(value.c_str());
+      lastTiles.clear();
+    }
+    else if (field == "shm")
+    {
+      // Create the frame ring using the token of the client, 0 removes it.
+      const uint32_t token = std::strtoul(value.c_str(), NULL, 10);
+      ring.reset();
+
+      try
+      {
+        if (token != 0)
+        {
+          ring.reset(new frames::FrameRing(endpoint::IsLocal(address) ?
+              frames::RingName(address, "") : frames::RingName("", address),
+              frames::SLOTS, frames::FRAME_CAPACITY, token));
+        }
+      }
+      catch (const std::exception& e)
+      {
+        std::cerr << e.what() << "\n";
+      }
+    }
+    else if (field == "protocol")
+    {
+      // Switch the protocol and acknowledge using the new protocol.
+      if (value == "binary")
+      {
+        protocol = messages::BINARY;
+        Send(socket, std::string(1, char(messages::binary::REPLY_PROTOCOL)) +
+            char(messages::BINARY));
+      }
+      else if (value == "json")
+      {
+        protocol = messages::JSON;
+        Send(socket, "{\"protocol\":\"json\"}");
+      }
+    }
+  }
+
+  //! Handle the given JSON message.
+  void FunctionHandler(Socket& socket, const std::string& data)
+  {
+    if (data.size() <= 2) return;
+
+    // Act as balancer in case the client sends a get enpoint message.
+    if (data.find("get") != std::string::npos)
+    {
+      Send(socket, "{\"endpoint\":{\"host\":\"*\",\"port\":" +
+          (endpoint::IsLocal(address) ? "\"\"" : address) + "}}");
+      return;
+    }
+
+    // Act as balancer with a single endpoint.
+    if (data.find("count") != std::string::npos)
+    {
+      Send(socket, "{\"count\":1}");
+      return;
+    }
+
+    std::vector<std::pair<std::string, std::string> > key, game, step, config,
+        state;
+    std::vector<std::vector<std::pair<std::string, int> > > sequences;
+    if (!Decode(data, key, game, step, config, state, sequences)) return;
+
+    // Same order as the lua handler.
+    static const char* operations[] = { "discard", "save", "load" };
+    for (size_t o = 0; o < 3; ++o)
+    {
+      for (size_t i = 0; i < state.size(); ++i)
+      {
+        if (state[i].first == operations[o] && !StateHandler(socket,
+            state[i].first, std::atoi(state[i].second.c_str())))
+        {
+          return;
+        }
+      }
+    }
+
+    for (size_t i = 0; i < key.size(); ++i)
+      KeyHandler(key[i].second);
+    for (size_t i = 0; i < game.size(); ++i)
+      GameHandler(socket, game[i].second);
+    for (size_t i = 0; i < step.size(); ++i)
+      StepHandler(step[i].second);
+    for (size_t i = 0; i < sequences.size(); ++i)
+      SequenceHandler(socket, sequences[i]);
+    for (size_t i = 0; i < config.size(); ++i)
+      ConfigHandler(socket, config[i].first, config[i].second);
+  }
+
+  //! Handle the given binary frame.
+  void BinaryHandler(Socket& socket, const std::string& data)
+  {
+    static const char* keys[] = {
+        "", "A", "B", "Right", "Left", "Up", "Down", "Start" };
+    static const char* games[] = { "", "Reset", "Tiles", "Info", "Image" };
+    static const char* fields[] = {
+        "", "frame", "image", "divisor", "speed", "protocol", "delta", "shm" };
+    static const char* speeds[] = { "normal", "maximum", "turbo" };
+    static const char* protocols[] = { "json", "binary" };
+    static const char* operations[] = { "", "save", "load", "discard" };
+
+    size_t offset = 0;
+    while (offset + 2 <= data.size())
+    {
+      const uint8_t opcode = data[offset];
+      const uint8_t value = data[offset + 1];
+      offset += 2;
+
+      if (opcode == messages::binary::KEY && value < 8)
+      {
+        KeyHandler(keys[value]);
+      }
+      else if (opcode == messages::binary::GAME && value < 5)
+      {
+        GameHandler(socket, games[value]);
+      }
+      else if (opcode == messages::binary::STEP && value < 8)
+      {
+        StepHandler(keys[value]);
+      }
+      else if (opcode == messages::binary::SEQUENCE &&
+          offset + 3 * size_t(value) <= data.size())
+      {
+        std::vector<std::pair<std::string, int> > actions;
+        for (size_t i = 0; i < value; ++i, offset += 3)
+        {
+          const uint8_t key = data[offset];
+          actions.push_back(std::make_pair(std::string(key < 8 ? keys[key] :
+              ""), int(messages::binary::Get(data.data() + offset + 1, 2))));
+        }
+
+        SequenceHandler(socket, actions);
+      }
+      else if (opcode == messages::binary::STATE && value > 0 && value < 4 &&
+          offset + 2 <= data.size())
+      {
+        const int slot = messages::binary::Get(data.data() + offset, 2);
+        offset += 2;
+
+        if (!StateHandler(socket, operations[value], slot)) return;
+      }
+      else if (opcode == messages::binary::CONFIG && value < 8 &&
+          offset + 4 <= data.size())
+      {
+        const uint32_t number = messages::binary::Get(data.data() + offset, 4);
+        offset += 4;
+
+        const std::string field = fields[value];
+        if (field == "speed" && number < 3)
+        {
+          ConfigHandler(socket, field, speeds[number]);
+        }
+        else if (field == "protocol" && number < 2)
+        {
+          ConfigHandler(socket, field, protocols[number]);
+        }
+        else
+        {
+          ConfigHandler(socket, field, std::to_string(number));
+        }
+      }
+      else
+      {
+        std::cerr << "Unknown opcode: " << int(opcode) << "\n";
+        return;
+      }
+    }
+  }
+
+  /**
+   * Decode the groups of a JSON message: {"<group>": {"<field>": <value>}};
+   * the value of the sequence group is a list of [<key>, <frames>] pairs.
+   * Returns false if the message isn't valid.
+   */
+  static bool Decode(const std::string& data,
+                     std::vector<std::pair<std::string, std::string> >& key,
+                     std::vector<std::pair<std::string, std::string> >& game,
+                     std::vector<std::pair<std::string, std::string> >& step,
+                     std::vector<std::pair<std::string, std::string> >& config,
+                     std::vector<std::pair<std::string, std::string> >& state,
+                     std::vector<std::vector<std::pair<std::string, int> > >&
+                         sequences)
+  {
+    size_t i = 0;
+    std::string group, field, value;
+
+    if (!Token(data, i, '{')) return false;
+    do
+    {
+      if (!String(data, i, group) || !Token(data, i, ':') ||
+          !Token(data, i, '{'))
+      {
+        return false;
+      }
+
+      do
+      {
+        if (!String(data, i, field) || !Token(data, i, ':'))
+        {
+          return false;
+        }
+
+        if (group == "sequence")
+        {
+          sequences.push_back(std::vector<std::pair<std::string, int> >());
+          if (!Actions(data, i, sequences.back())) return false;
+          continue;
+        }
+
+        if (!Value(data, i, value))
+        {
+          return false;
+        }
+
+        std::pair<std::string, std::string> entry(field, value);
+        if (group == "key") key.push_back(entry);
+        else if (group == "game") game.push_back(entry);
+        else if (group == "step") step.push_back(entry);
+        else if (group == "config") config.push_back(entry);
+        else if (group == "savestate") state.push_back(entry);
+      }
+      while (Token(data, i, ','));
+
+      if (!Token(data, i, '}')) return false;
+    }
+    while (Token(data, i, ','));
+
+    return Token(data, i, '}');
+  }
+
+  //! Consume the given token, skipping leading whitespace.
+  static bool Token(const std::string& data, size_t& i, const char c)
+  {
+    while (i < data.size() && std::isspace(data[i])) ++i;
+    if (i < data.size() && data[i] == c)
+    {
+      ++i;
+      return true;
+    }
+
+    return false;
+  }
+
+  //! Read a string.
+  static bool String(const std::string& data, size_t& i, std::string& value)
+  {
+    if (!Token(data, i, '"')) return false;
+
+    const size_t end = data.find('"', i);
+    if (end == std::string::npos) return false;
+
+    value = data.substr(i, end - i);
+    i = end + 1;
+    return true;
+  }
+
+  //! Read a list of [<key>, <frames>] pairs.
+  static bool Actions(const std::string& data,
+                      size_t& i,
+                      std::vector<std::pair<std::string, int> >& actions)
+  {
+    if (!Token(data, i, '[')) return false;
+    if (Token(data, i, ']')) return true;
+
+    std::string key, frames;
+    do
+    {
+      if (!Token(data, i, '[') || !String(data, i, key) ||
+          !Token(data, i, ',') || !Value(data, i, frames) ||
+          !Token(data, i, ']'))
+      {
+        return false;
+      }
+
+      actions.push_back(std::make_pair(key, std::atoi(frames.c_str())));
+    }
+    while (Token(data, i, ','));
+
+    return Token(data, i, ']');
+  }
+
+  //! Read a string or number.
+  static bool Value(const std::string& data, size_t& i, std::string& value)
+  {
+    if (String(data, i, value)) return true;
+
+    const size_t start = i;
+    while (i < data.size() && (std::isdigit(data[i]) || data[i] == '-')) ++i;
+
+    value = data.substr(start, i - start);
+    return !value.empty();
+  }
+
+  //! Flatten the tiles in matrix order: rows -radius to -1, row 1 (mario),
+  // rows 2 to radius and row 0.
+  static void FlattenTiles(int tiles[size][size], std::vector<int>& values)
+  {
+    values.clear();
+    for (int i = 0; i < size; ++i)
+    {
+      const int row = i < radius ? i : (i == size - 1 ? radius : i + 1);
+      for (int col = 0; col < size; ++col)
+      {
+        values.push_back(tiles[row][col]);
+      }
+    }
+  }
+
+  //! Encode the tiles like cjson encodes the lua table.
+  static std::string TilesJSON(int tiles[size][size])
+  {
+    std::string json = "{";
+    for (int row = 0; row < size; ++row)
+    {
+      json += (row ? ",\"" : "\"") + std::to_string(row - radius) + "\":[";
+      for (int col = 0; col < size; ++col)
+      {
+        json += (col ? "," : "") + std::to_string(tiles[row][col]);
+      }
+      json += "]";
+    }
+
+    return json + "}";
+  }
+
+  //! Render the view field as 256x240 ARGB frame and publish it into the
+  // frame ring; every tile is a 16x16 block.
+  uint32_t PublishScreen()
+  {
+    static const uint8_t colors[][3] = {
+        { 92, 148, 252 }, { 200, 76, 12 }, { 0, 168, 0 }, { 248, 56, 0 },
+        { 252, 188, 176 } };
+    const int width = 256, height = 240;
+
+    int tiles[size][size];
+    game.Tiles(tiles);
+
+    pixels.resize(width * height * 4);
+    for (int y = 0; y < height; ++y)
+    {
+      uint8_t* line = &pixels[y * width * 4];
+
+      // The 16 lines of a tile row are the same.
+      if (y % 16 != 0)
+      {
+        std::copy(line - width * 4, line, line);
+        continue;
+      }
+
+      for (int x = 0; x < width; ++x)
+      {
+        // Scroll with mario, the view field is centered on the screen.
+        const int row = y / 16 - 1, col = (x + game.marioX % 16) / 16 - 2;
+        const int tile = (row >= 0 && row < size && col >= 0 && col < size) ?
+            tiles[row][col] % 5 : 0;
+
+        uint8_t* pixel = line + x * 4;
+        pixel[0] = 0;
+        pixel[1] = colors[tile][0];
+        pixel[2] = colors[tile][1];
+        pixel[3] = colors[tile][2];
+      }
+    }
+
+    return ring->Publish(width, height, frames::FORMAT_ARGB, pixels.data(),
+        pixels.size());
+  }
+
+  //! Create a jpeg sized blob; the size grows with the image quality.
+  std::string Image() const
+  {
+    std::string image(150 * std::max(imageQuality, 1), '\0');
+    image[0] = char(0xFF);
+    image[1] = char(0xD8);
+
+    uint32_t seed = frameCounter + 1;
+    for (size_t i = 2; i < image.size() - 2; ++i)
+    {
+      seed = seed * 1103515245 + 12345;
+      image[i] = char((seed >> 16) & 0xFF);
+
+      // Avoid the JSON reply delimiter.
+      if (image[i] == '\r') image[i] = 0;
+    }
+
+    image[image.size() - 2] = char(0xFF);
+    image[image.size() - 1] = char(0xD9);
+    return image;
+  }
+
+  std::string address;
+  int frameTime;
+
+  Game game;
+  int frameCounter;
+  int frameDivisor;
+  int imageQuality;
+  std::string speed;
+  messages::Protocol protocol;
+  std::string currentKey;
+  bool pendingStep;
+  int deltaInterval;
+  int deltaCount;
+  std::vector<int> lastTiles;
+  std::vector<std::pair<std::string, int> > sequence;
+  size_t sequenceIndex;
+  int sequenceFrames;
+  std::vector<std::string> trajectory;
+  std::unique_ptr<frames::FrameRing> ring;
+  std::vector<uint8_t> pixels;
+  std::map<int, Game> states;
+};
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    std::cout << "Usage: <port|unix:path> [<count>] [<frame time (us)>]\n";
+    return 1;
+  }
+
+  const std::string base(argv[1]);
+  const int count = argc > 2 ? std::atoi(argv[2]) : 1;
+  const int frameTime = argc > 3 ? std::atoi(argv[3]) : 0;
+
+  // Every emulator listens on its own port, like a fceux instance; unix
+  // domain socket paths get the index as suffix if there are several
+  // emulators.
+  std::vector<std::thread> emulators;
+  for (int i = 0; i < count; ++i)
+  {
+    std::string address;
+    if (endpoint::IsLocal(base))
+    {
+      address = count > 1 ? base + "-" + std::to_string(i) : base;
+    }
+    else
+    {
+      address = std::to_string(std::atoi(base.c_str()) + i);
+    }
+
+    emulators.push_back(std::thread([address, frameTime]()
+    {
+      try
+      {
+        Emulator emulator(address, frameTime);
+        emulator.Run();
+      }
+      catch (std::exception& e)
+      {
+        std::cerr << "Exception: " << e.what() << "\n";
+      }
+    }));
+
+    std::cout << "Emulator: " << address << std::endl;
+  }
+
+  for (size_t i = 0; i < emulators.size(); ++i)
+  {
+    emulators[i].join();
+  }
+
+  return 0;
+}
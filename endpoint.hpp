@@ -0,0 +1,239 @@
+/**
+ * @file endpoint.hpp
+ * @author Marcus Edel
+ *
+ * Endpoint addressing for TCP (<host>:<port>) and unix domain socket
+ * (unix:<path>) connections.
+ */
+#ifndef NES_ENDPOINT_HPP
+#define NES_ENDPOINT_HPP
+
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <boost/version.hpp>
+
+namespace endpoint {
+
+//! Socket that holds a TCP or a unix domain socket connection.
+typedef boost::asio::generic::stream_protocol::socket Socket;
+
+//! Acceptor for TCP or unix domain socket connections.
+typedef boost::asio::basic_socket_acceptor<
+    boost::asio::generic::stream_protocol> Acceptor;
+
+//! Handler called once the connection is established.
+typedef std::function<void(const boost::system::error_code&)> ConnectHandler;
+
+//! The host prefix of unix domain socket endpoints.
+const char LOCAL_PREFIX[] = "unix:";
+
+//! Return true if the given host is a unix domain socket (unix:<path>).
+inline bool IsLocal(const std::string& host)
+{
+  return host.compare(0, sizeof(LOCAL_PREFIX) - 1, LOCAL_PREFIX) == 0;
+}
+
+//! Get the socket path of the given unix domain socket host.
+inline std::string Path(const std::string& host)
+{
+  return host.substr(sizeof(LOCAL_PREFIX) - 1);
+}
+
+//! Get the printable name of the given endpoint.
+inline std::string Name(const std::string& host, const std::string& port)
+{
+  return IsLocal(host) ? host : host + ":" + port;
+}
+
+/**
+ * Split the given endpoint argument, either <host>:<port> or unix:<path>; the
+ * port of a unix domain socket endpoint is empty.
+ *
+ * @return False if the argument isn't a valid endpoint.
+ */
+inline bool Split(const std::string& argument,
+                  std::string& host,
+                  std::string& port)
+{
+  if (IsLocal(argument))
+  {
+    host = argument;
+    port.clear();
+    return argument.size() > sizeof(LOCAL_PREFIX) - 1;
+  }
+
+  const std::size_t portStart = argument.rfind(":");
+  if (portStart == std::string::npos)
+  {
+    return false;
+  }
+
+  host = argument.substr(0, portStart);
+  port = argument.substr(portStart + 1);
+  return !host.empty() && !port.empty();
+}
+
+/**
+ * Get the address to listen on, unix:<path> or the TCP port on all
+ * interfaces.
+ *
+ * @param address The unix domain socket host or the port.
+ */
+inline boost::asio::generic::stream_protocol::endpoint Listen(
+    const std::string& address)
+{
+  if (IsLocal(address))
+  {
+    return boost::asio::local::stream_protocol::endpoint(Path(address));
+  }
+
+  return boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(),
+      std::atoi(address.c_str()));
+}
+
+/**
+ * Open the acceptor on the given address. A stale unix domain socket file is
+ * removed before binding.
+ *
+ * @param acceptor The acceptor to open.
+ * @param address The unix domain socket host or the port.
+ * @param backlog The number of pending connections.
+ */
+inline void Bind(Acceptor& acceptor,
+                 const std::string& address,
+                 const int backlog)
+{
+  const boost::asio::generic::stream_protocol::endpoint local =
+      Listen(address);
+
+  acceptor.open(local.protocol());
+  if (IsLocal(address))
+  {
+    ::unlink(Path(address).c_str());
+  }
+  else
+  {
+    acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+  }
+
+  acceptor.bind(local);
+  acceptor.listen(backlog);
+}
+
+/**
+ * Disable Nagle's algorithm on TCP connections; requests are small and often
+ * sent back-to-back (e.g. reset followed by a step), so don't wait for the
+ * ack of the previous segment.
+ */
+inline void NoDelay(Socket& socket)
+{
+  boost::system::error_code ignored;
+  if (socket.is_open() &&
+      socket.local_endpoint(ignored).protocol().family() != AF_UNIX)
+  {
+    socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+  }
+}
+
+//! Try the resolved endpoints one after another.
+inline void ConnectNext(
+    Socket& socket,
+    const std::shared_ptr<boost::asio::ip::tcp::resolver>& resolver,
+    const boost::asio::ip::tcp::resolver::iterator& iterator,
+    const ConnectHandler& handler)
+{
+  if (iterator == boost::asio::ip::tcp::resolver::iterator())
+  {
+    handler(boost::asio::error::host_not_found);
+    return;
+  }
+
+  boost::system::error_code ignored;
+  socket.close(ignored);
+
+  const boost::asio::ip::tcp::endpoint remote = *iterator;
+  socket.async_connect(remote, [&socket, resolver, iterator, handler](
+      const boost::system::error_code& error)
+  {
+    if (error && error != boost::asio::error::operation_aborted &&
+        std::next(iterator) != boost::asio::ip::tcp::resolver::iterator())
+    {
+      ConnectNext(socket, resolver, std::next(iterator), handler);
+      return;
+    }
+
+    if (!error) NoDelay(socket);
+    handler(error);
+  });
+}
+
+/**
+ * Connect the given socket asynchronously. Unix domain socket endpoints and
+ * numeric TCP addresses are connected without a resolver query.
+ *
+ * @param socket The socket to connect.
+ * @param host The host name, numeric address or unix:<path>.
+ * @param port The port, ignored for unix domain socket endpoints.
+ * @param handler The handler called once the connection is established.
+ */
+inline void AsyncConnect(Socket& socket,
+                         const std::string& host,
+                         const std::string& port,
+                         const ConnectHandler& handler)
+{
+  boost::system::error_code ignored;
+  socket.close(ignored);
+
+  if (IsLocal(host))
+  {
+    socket.async_connect(boost::asio::local::stream_protocol::endpoint(
+        Path(host)), handler);
+    return;
+  }
+
+  boost::system::error_code error;
+  const boost::asio::ip::address address =
+      boost::asio::ip::address::from_string(host, error);
+  if (!error)
+  {
+    socket.async_connect(boost::asio::ip::tcp::endpoint(address,
+        std::atoi(port.c_str())), [&socket, handler](
+        const boost::system::error_code& error)
+    {
+      if (!error) NoDelay(socket);
+      handler(error);
+    });
+    return;
+  }
+
+#if BOOST_VERSION >= 106600
+  std::shared_ptr<boost::asio::ip::tcp::resolver> resolver(
+      new boost::asio::ip::tcp::resolver(socket.get_executor()));
+#else
+  std::shared_ptr<boost::asio::ip::tcp::resolver> resolver(
+      new boost::asio::ip::tcp::resolver(socket.get_io_service()));
+#endif
+  boost::asio::ip::tcp::resolver::query query(boost::asio::ip::tcp::v4(),
+      host, port);
+
+  resolver->async_resolve(query, [&socket, resolver, handler](
+      const boost::system::error_code& error,
+      boost::asio::ip::tcp::resolver::iterator iterator)
+  {
+    if (error)
+    {
+      handler(error);
+      return;
+    }
+
+    ConnectNext(socket, resolver, iterator, handler);
+  });
+}
+
+} // namespace endpoint
+
+#endif
@@ -0,0 +1,260 @@
+/**
+ * @file fitness_cache.hpp
+ * @author Marcus Edel
+ *
+ * Fitness memoization for genomes whose phenotype didn't change.
+ */
+#ifndef NES_FITNESS_CACHE_HPP
+#define NES_FITNESS_CACHE_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+namespace fitness {
+
+/**
+ * The FitnessCache maps the canonical hash of a genome to its fitness. The
+ * emulator is reset to the same savestate for every evaluation and the
+ * policy is deterministic, so a genome with the same enabled structure and
+ * weights always gets the same fitness; elites and unchanged offspring don't
+ * have to be played again.
+ *
+ * If a file is given, the cache is loaded from the file and every new entry
+ * is appended to it, so the cache is kept across runs. The file contains one
+ * entry per line:
+ *
+ * <hash (hex)> <fitness>
+ *
+ * Lookup and Insert can be called from several threads.
+ */
+class FitnessCache
+{
+ public:
+  /**
+   * Create the FitnessCache object.
+   *
+   * @param salt Value mixed into every hash; use a different salt for every
+   *        task configuration that changes the fitness (e.g. frame divisor),
+   *        so the entries of a differently configured run never match.
+   * @param path The file used to persist the cache, empty keeps the cache in
+   *        memory only.
+   */
+  FitnessCache(const uint64_t salt = 0, const std::string& path = "") :
+      salt(salt),
+      hits(0),
+      misses(0)
+  {
+    if (path.empty()) return;
+
+    Load(path);
+    file.open(path.c_str(), std::ios::out | std::ios::app);
+    if (!file.is_open())
+    {
+      throw std::runtime_error("Could not open the fitness cache " + path +
+          ".");
+    }
+  }
+
+  /**
+   * Get the canonical hash of the given genome. Only the parts of the genome
+   * that change its output are hashed: the neurons (id, type, activation
+   * function and depth, which defines the activation order) and the enabled
+   * links (from, to and weight), both in id order, so the order of the genes
+   * doesn't matter.
+   *
+   * @param genome The genome to hash.
+   */
+  template<typename GenomeType>
+  uint64_t Hash(const GenomeType& genome) const
+  {
+    uint64_t hash = OFFSET;
+    Mix(hash, salt);
+    Mix(hash, uint64_t(genome.NumInput()));
+    Mix(hash, uint64_t(genome.NumOutput()));
+
+    std::vector<std::tuple<int64_t, int64_t, double> > neurons;
+    neurons.reserve(genome.aNeuronGenes.size());
+    for (size_t i = 0; i < genome.aNeuronGenes.size(); ++i)
+    {
+      neurons.push_back(std::make_tuple(genome.aNeuronGenes[i].Id(),
+          int64_t(genome.aNeuronGenes[i].Type()) << 8 |
+          int64_t(genome.aNeuronGenes[i].ActFuncType()),
+          genome.aNeuronGenes[i].Depth()));
+    }
+
+    std::vector<std::tuple<int64_t, int64_t, double> > links;
+    links.reserve(genome.aLinkGenes.size());
+    for (size_t i = 0; i < genome.aLinkGenes.size(); ++i)
+    {
+      if (!genome.aLinkGenes[i].Enabled()) continue;
+
+      links.push_back(std::make_tuple(genome.aLinkGenes[i].FromNeuronId(),
+          genome.aLinkGenes[i].ToNeuronId(), genome.aLinkGenes[i].Weight()));
+    }
+
+    std::sort(neurons.begin(), neurons.end());
+    std::sort(links.begin(), links.end());
+
+    Mix(hash, neurons.size());
+    for (size_t i = 0; i < neurons.size(); ++i)
+    {
+      Mix(hash, std::get<0>(neurons[i]));
+      Mix(hash, std::get<1>(neurons[i]));
+      Mix(hash, std::get<2>(neurons[i]));
+    }
+
+    Mix(hash, links.size());
+    for (size_t i = 0; i < links.size(); ++i)
+    {
+      Mix(hash, std::get<0>(links[i]));
+      Mix(hash, std::get<1>(links[i]));
+      Mix(hash, std::get<2>(links[i]));
+    }
+
+    return hash;
+  }
+
+  /**
+   * Get the fitness of the genome with the given hash.
+   *
+   * @param hash The hash of the genome (see Hash).
+   * @param fitness The cached fitness.
+   * @return False if the genome wasn't evaluated yet.
+   */
+  bool Lookup(const uint64_t hash, double& fitness)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const std::unordered_map<uint64_t, double>::const_iterator it =
+        entries.find(hash);
+    if (it == entries.end())
+    {
+      ++misses;
+      return false;
+    }
+
+    ++hits;
+    fitness = it->second;
+    return true;
+  }
+
+  /**
+   * Store the fitness of the genome with the given hash. Only store the
+   * fitness of complete evaluations; an episode cut short by a connection
+   * error doesn't reflect the genome.
+   *
+   * @param hash The hash of the genome (see Hash).
+   * @param fitness The fitness of the genome.
+   */
+  void Insert(const uint64_t hash, const double fitness)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!entries.insert(std::make_pair(hash, fitness)).second) return;
+
+    if (file.is_open())
+    {
+      char line[64];
+      std::snprintf(line, sizeof(line), "%016llx %.17g\n",
+          (unsigned long long) hash, fitness);
+      file << line << std::flush;
+    }
+  }
+
+  //! Get the number of cached genomes.
+  size_t Size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+  }
+
+  //! Get the number of lookups that found the genome.
+  size_t Hits() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hits;
+  }
+
+  //! Get the number of lookups that didn't find the genome.
+  size_t Misses() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return misses;
+  }
+
+ private:
+  //! FNV-1a offset basis and prime.
+  static const uint64_t OFFSET = 14695981039346656037ULL;
+  static const uint64_t PRIME = 1099511628211ULL;
+
+  //! Mix the bytes of the given value into the hash.
+  static void Mix(uint64_t& hash, const uint64_t value)
+  {
+    for (size_t i = 0; i < sizeof(value); ++i)
+    {
+      hash ^= (value >> (8 * i)) & 0xFF;
+      hash *= PRIME;
+    }
+  }
+
+  //! Mix the given value into the hash.
+  static void Mix(uint64_t& hash, const int64_t value)
+  {
+    Mix(hash, uint64_t(value));
+  }
+
+  //! Mix the bit pattern of the given weight into the hash; -0 and 0 are the
+  // same weight.
+  static void Mix(uint64_t& hash, const double value)
+  {
+    const double weight = value == 0 ? 0 : value;
+    uint64_t bits;
+    std::memcpy(&bits, &weight, sizeof(bits));
+    Mix(hash, bits);
+  }
+
+  //! Load the entries of the given file, malformed lines are skipped.
+  void Load(const std::string& path)
+  {
+    std::ifstream input(path.c_str());
+    std::string line;
+    while (std::getline(input, line))
+    {
+      unsigned long long hash;
+      double fitness;
+      if (std::sscanf(line.c_str(), "%llx %lg", &hash, &fitness) == 2)
+      {
+        entries[uint64_t(hash)] = fitness;
+      }
+    }
+  }
+
+  //! Locally stored salt of the hashes.
+  uint64_t salt;
+
+  //! Locally stored fitness of every evaluated genome.
+  std::unordered_map<uint64_t, double> entries;
+
+  //! Locally stored file the new entries are appended to.
+  std::ofstream file;
+
+  //! Locally stored number of hits.
+  size_t hits;
+
+  //! Locally stored number of misses.
+  size_t misses;
+
+  //! Locally stored mutex that guards the entries, the counters and the file.
+  mutable std::mutex mutex;
+}; // class FitnessCache
+
+} // namespace fitness
+
+#endif
@@ -0,0 +1,386 @@
+/**
+ * @file frame_ring.hpp
+ * @author Marcus Edel
+ *
+ * Shared-memory ring of raw game frames for co-located emulators and clients.
+ */
+#ifndef NES_FRAME_RING_HPP
+#define NES_FRAME_RING_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "endpoint.hpp"
+
+namespace frames {
+
+/**
+ * Shared-memory layout, all fields are 32 bit unsigned integers in
+ * little-endian byte order (the lua module writes the file byte by byte):
+ *
+ * header  <magic> <version> <slots> <capacity> <latest> <token>
+ * slot    <sequence> <frame> <width> <height> <format> <size> <pixels>
+ *
+ * The header and every slot header are HEADER_SIZE bytes, the pixels of a slot
+ * are followed by the next slot. Frame n (starting at 1) is stored in slot
+ * n % slots; latest is the number of the last published frame (0 if there is
+ * none). The sequence of a slot is odd while the writer updates the slot
+ * (seqlock). The token is chosen by the client that enabled the ring, so the
+ * client can tell the ring of its emulator from a stale ring.
+ */
+const uint32_t MAGIC = 0x4653454E;
+const uint32_t VERSION = 1;
+const size_t HEADER_SIZE = 64;
+
+//! The number of slots of a ring.
+const uint32_t SLOTS = 4;
+
+//! Pixel formats.
+const uint32_t FORMAT_ARGB = 1;
+
+//! The number of bytes of an ARGB NES frame (256x240).
+const uint32_t FRAME_CAPACITY = 256 * 240 * 4;
+
+/**
+ * Get the shared memory name of the ring of the emulator at the given
+ * endpoint: /nes-<port>, or the socket path with '-' as separator for unix
+ * domain socket endpoints (unix:/tmp/nes.sock -> /nes-tmp-nes.sock).
+ *
+ * @param host The host of the emulator endpoint.
+ * @param port The port of the emulator endpoint.
+ */
+inline std::string RingName(const std::string& host, const std::string& port)
+{
+  if (!endpoint::IsLocal(host)) return "/nes-" + port;
+
+  std::string name = "/nes" + endpoint::Path(host);
+  std::replace(name.begin() + 1, name.end(), '/', '-');
+  return name;
+}
+
+/**
+ * A frame of the ring. The pixels point into the shared memory; the frame
+ * stays valid until the writer reuses the slot, check Valid() after the pixels
+ * are consumed.
+ */
+struct Frame
+{
+  //! The frame number.
+  uint32_t number;
+
+  //! The width of the frame in pixels.
+  uint32_t width;
+
+  //! The height of the frame in pixels.
+  uint32_t height;
+
+  //! The pixel format (FORMAT_ARGB).
+  uint32_t format;
+
+  //! The number of pixel bytes.
+  uint32_t size;
+
+  //! The pixels.
+  const uint8_t* pixels;
+
+  //! Locally stored sequence of the slot when the frame was read.
+  uint32_t sequence;
+
+  //! Locally stored slot of the frame.
+  uint32_t slot;
+};
+
+/**
+ * Implementation of the frame ring. The writer (emulator) creates the ring and
+ * publishes frames, any number of readers map the ring read-only and get the
+ * latest frame without copying it.
+ */
+class FrameRing
+{
+ public:
+  /**
+   * Map the ring with the given name read-only.
+   *
+   * @param name The shared memory name (see RingName).
+   * @param token The token the ring has to carry, 0 accepts any token.
+   */
+  FrameRing(const std::string& name, const uint32_t token = 0) :
+      name(name),
+      owner(false),
+      slots(0),
+      capacity(0),
+      memory(NULL),
+      length(0)
+  {
+    const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+      throw std::runtime_error("Could not open the frame ring " + name + ".");
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < HEADER_SIZE)
+    {
+      close(fd);
+      throw std::runtime_error("Invalid frame ring " + name + ".");
+    }
+
+    Map(fd, info.st_size, PROT_READ);
+
+    if (Field(0) != MAGIC || Field(4) != VERSION || Field(8) == 0 ||
+        length < HEADER_SIZE + Field(8) * SlotSize(Field(12)) ||
+        (token != 0 && Field(20) != token))
+    {
+      Unmap();
+      throw std::runtime_error("Invalid frame ring " + name + ".");
+    }
+
+    slots = Field(8);
+    capacity = Field(12);
+  }
+
+  /**
+   * Create the ring with the given name and map it for writing; the ring is
+   * removed once the object is destroyed.
+   *
+   * @param name The shared memory name (see RingName).
+   * @param slots The number of slots.
+   * @param capacity The maximum number of pixel bytes per frame.
+   * @param token The token chosen by the client.
+   */
+  FrameRing(const std::string& name,
+            const uint32_t slots,
+            const uint32_t capacity,
+            const uint32_t token) :
+      name(name),
+      owner(true),
+      slots(slots),
+      capacity(capacity),
+      memory(NULL),
+      length(0)
+  {
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+      throw std::runtime_error("Could not create the frame ring " + name +
+          ".");
+    }
+
+    const size_t size = HEADER_SIZE + slots * SlotSize(capacity);
+    if (ftruncate(fd, size) != 0)
+    {
+      close(fd);
+      shm_unlink(name.c_str());
+      throw std::runtime_error("Could not create the frame ring " + name +
+          ".");
+    }
+
+    Map(fd, size, PROT_READ | PROT_WRITE);
+
+    SetField(4, VERSION);
+    SetField(8, slots);
+    SetField(12, capacity);
+    SetField(16, 0);
+    SetField(20, token);
+    Store(Pointer(0), MAGIC);
+  }
+
+  ~FrameRing()
+  {
+    Unmap();
+    if (owner) shm_unlink(name.c_str());
+  }
+
+  /**
+   * Publish the given frame.
+   *
+   * @param width The width of the frame in pixels.
+   * @param height The height of the frame in pixels.
+   * @param format The pixel format.
+   * @param pixels The pixels.
+   * @param size The number of pixel bytes, at most the capacity.
+   * @return The frame number.
+   */
+  uint32_t Publish(const uint32_t width,
+                   const uint32_t height,
+                   const uint32_t format,
+                   const void* pixels,
+                   const uint32_t size)
+  {
+    if (size > capacity)
+    {
+      throw std::runtime_error("Frame exceeds the frame ring capacity.");
+    }
+
+    const uint32_t number = Field(16) + 1;
+    const size_t offset = SlotOffset(number % slots);
+    uint32_t* sequence = Pointer(offset);
+    const uint32_t current = Load(sequence);
+
+    // Mark the slot as being written before any byte of it changes.
+    __atomic_store_n(sequence, current + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    SetField(offset + 4, number);
+    SetField(offset + 8, width);
+    SetField(offset + 12, height);
+    SetField(offset + 16, format);
+    SetField(offset + 20, size);
+    std::memcpy(memory + offset + HEADER_SIZE, pixels, size);
+
+    Store(sequence, current + 2);
+    Store(Pointer(16), number);
+    return number;
+  }
+
+  /**
+   * Get the latest frame without copying it.
+   *
+   * @param frame The latest frame.
+   * @return False if no frame was published yet.
+   */
+  bool Latest(Frame& frame) const
+  {
+    for (;;)
+    {
+      const uint32_t number = Load(Pointer(16));
+      if (number == 0) return false;
+
+      frame.slot = number % slots;
+      const size_t offset = SlotOffset(frame.slot);
+
+      frame.sequence = Load(Pointer(offset));
+      if (frame.sequence & 1) continue;
+
+      frame.number = Field(offset + 4);
+      frame.width = Field(offset + 8);
+      frame.height = Field(offset + 12);
+      frame.format = Field(offset + 16);
+      frame.size = Field(offset + 20);
+      frame.pixels = memory + offset + HEADER_SIZE;
+
+      // Retry if the slot was reused while reading the slot header.
+      if (frame.number == number && frame.size <= capacity && Valid(frame))
+      {
+        return true;
+      }
+    }
+  }
+
+  /**
+   * Check that the given frame wasn't overwritten, e.g. after the pixels are
+   * consumed or copied.
+   *
+   * @param frame The frame returned by Latest.
+   * @return False if the slot of the frame was reused.
+   */
+  bool Valid(const Frame& frame) const
+  {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(Pointer(SlotOffset(frame.slot)),
+        __ATOMIC_RELAXED) == frame.sequence;
+  }
+
+  //! Get the number of the last published frame.
+  uint32_t LatestNumber() const { return Load(Pointer(16)); }
+
+  //! Get the token of the ring.
+  uint32_t Token() const { return Field(20); }
+
+ private:
+  //! Get the size of a slot including the slot header.
+  static size_t SlotSize(const uint32_t capacity)
+  {
+    return HEADER_SIZE + (size_t(capacity) + HEADER_SIZE - 1) /
+        HEADER_SIZE * HEADER_SIZE;
+  }
+
+  //! Get the offset of the given slot.
+  size_t SlotOffset(const uint32_t slot) const
+  {
+    return HEADER_SIZE + slot * SlotSize(capacity);
+  }
+
+  //! Map the given shared memory object; the descriptor is closed.
+  void Map(const int fd, const size_t size, const int protection)
+  {
+    void* address = mmap(NULL, size, protection, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (address == MAP_FAILED)
+    {
+      if (owner) shm_unlink(name.c_str());
+      throw std::runtime_error("Could not map the frame ring " + name + ".");
+    }
+
+    memory = static_cast<uint8_t*>(address);
+    length = size;
+  }
+
+  //! Unmap the shared memory.
+  void Unmap()
+  {
+    if (memory) munmap(memory, length);
+    memory = NULL;
+  }
+
+  //! Get the 32 bit field at the given offset.
+  uint32_t* Pointer(const size_t offset) const
+  {
+    return reinterpret_cast<uint32_t*>(memory + offset);
+  }
+
+  //! Read the field at the given offset.
+  uint32_t Field(const size_t offset) const
+  {
+    return __atomic_load_n(Pointer(offset), __ATOMIC_RELAXED);
+  }
+
+  //! Write the field at the given offset.
+  void SetField(const size_t offset, const uint32_t value)
+  {
+    __atomic_store_n(Pointer(offset), value, __ATOMIC_RELAXED);
+  }
+
+  //! Read the given sequence or frame number.
+  static uint32_t Load(const uint32_t* value)
+  {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+  }
+
+  //! Write the given sequence or frame number.
+  static void Store(uint32_t* value, const uint32_t number)
+  {
+    __atomic_store_n(value, number, __ATOMIC_RELEASE);
+  }
+
+  //! Locally stored shared memory name.
+  std::string name;
+
+  //! Locally stored indication if the ring was created by this object.
+  bool owner;
+
+  //! Locally stored number of slots.
+  uint32_t slots;
+
+  //! Locally stored maximum number of pixel bytes per frame.
+  uint32_t capacity;
+
+  //! Locally stored mapped memory.
+  uint8_t* memory;
+
+  //! Locally stored size of the mapped memory.
+  size_t length;
+}; // class FrameRing
+
+} // namespace frames
+
+#endif
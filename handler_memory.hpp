@@ -0,0 +1,186 @@
+/**
+ * @file handler_memory.hpp
+ * @author Marcus Edel
+ *
+ * Preallocated memory for the asynchronous operations of a connection.
+ */
+#ifndef NES_HANDLER_MEMORY_HPP
+#define NES_HANDLER_MEMORY_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace handler {
+
+/**
+ * The HandlerMemory is an arena for the state of an asynchronous operation.
+ * Asio allocates the state of every operation (async_read, async_write) using
+ * the allocator associated with the completion handler; without one, the
+ * state is only recycled if the operation is started from within the io
+ * service, so the blocking functions of the client allocate twice per request.
+ * A handler created with MakeHandler takes the state from the arena; the
+ * state is released before the handler is called, so a sequence of
+ * operations (including the intermediate operations of a composed operation)
+ * reuses the same block. If the block is in use or too small the memory is
+ * taken from the heap.
+ *
+ * The arena isn't thread-safe, use it for operations that are started one
+ * after another.
+ */
+class HandlerMemory
+{
+ public:
+  //! Create the HandlerMemory object.
+  HandlerMemory() : inUse(false)
+  {
+    /* Nothing to do here */
+  }
+
+  HandlerMemory(const HandlerMemory&) = delete;
+  HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+  //! Allocate the given number of bytes.
+  void* Allocate(const size_t size)
+  {
+    if (!inUse && size <= sizeof(storage))
+    {
+      inUse = true;
+      return &storage;
+    }
+
+    return ::operator new(size);
+  }
+
+  //! Release the given memory.
+  void Deallocate(void* pointer)
+  {
+    if (pointer == &storage)
+    {
+      inUse = false;
+      return;
+    }
+
+    ::operator delete(pointer);
+  }
+
+ private:
+  //! Locally stored block; large enough for the composed read and write
+  // operations of the client.
+  typename std::aligned_storage<1024>::type storage;
+
+  //! Locally stored indication if the block is in use.
+  bool inUse;
+}; // class HandlerMemory
+
+/**
+ * Standard allocator that takes the memory from a HandlerMemory object.
+ */
+template<typename T>
+class HandlerAllocator
+{
+ public:
+  typedef T value_type;
+
+  //! Create the allocator using the given memory.
+  explicit HandlerAllocator(HandlerMemory& memory) : memory(memory)
+  {
+    /* Nothing to do here */
+  }
+
+  //! Create the allocator using the memory of the given allocator.
+  template<typename U>
+  HandlerAllocator(const HandlerAllocator<U>& other) noexcept :
+      memory(other.memory)
+  {
+    /* Nothing to do here */
+  }
+
+  //! Allocate n objects.
+  T* allocate(const size_t n) const
+  {
+    return static_cast<T*>(memory.Allocate(sizeof(T) * n));
+  }
+
+  //! Release the given objects.
+  void deallocate(T* pointer, const size_t /* n */) const
+  {
+    memory.Deallocate(pointer);
+  }
+
+  template<typename U>
+  bool operator==(const HandlerAllocator<U>& other) const noexcept
+  {
+    return &memory == &other.memory;
+  }
+
+  template<typename U>
+  bool operator!=(const HandlerAllocator<U>& other) const noexcept
+  {
+    return &memory != &other.memory;
+  }
+
+ private:
+  template<typename> friend class HandlerAllocator;
+
+  //! Locally stored memory.
+  HandlerMemory& memory;
+}; // class HandlerAllocator
+
+/**
+ * Completion handler that forwards to the given handler and associates the
+ * given memory with the operation, see MakeHandler.
+ */
+template<typename HandlerType>
+class Handler
+{
+ public:
+  typedef HandlerAllocator<HandlerType> allocator_type;
+
+  //! Create the handler using the given memory and handler.
+  Handler(HandlerMemory& memory, const HandlerType& handler) :
+      memory(memory),
+      handler(handler)
+  {
+    /* Nothing to do here */
+  }
+
+  //! Get the allocator of the operation.
+  allocator_type get_allocator() const noexcept
+  {
+    return allocator_type(memory);
+  }
+
+  //! Call the wrapped handler.
+  template<typename... Args>
+  void operator()(Args&&... args)
+  {
+    handler(std::forward<Args>(args)...);
+  }
+
+ private:
+  //! Locally stored memory.
+  HandlerMemory& memory;
+
+  //! Locally stored wrapped handler.
+  HandlerType handler;
+}; // class Handler
+
+/**
+ * Wrap the given completion handler, so the operation takes its memory from
+ * the given arena.
+ *
+ * @param memory The arena of the operation.
+ * @param handler The completion handler.
+ */
+template<typename HandlerType>
+Handler<HandlerType> MakeHandler(HandlerMemory& memory,
+                                 const HandlerType& handler)
+{
+  return Handler<HandlerType>(memory, handler);
+}
+
+} // namespace handler
+
+#endif
@@ -0,0 +1,345 @@
+/**
+ * @file instrumentation.hpp
+ * @author Marcus Edel
+ *
+ * Low-overhead hot-path instrumentation: per-phase timers, log-linear latency
+ * histograms and counters. The instrumentation is only compiled in if
+ * NES_INSTRUMENTATION is defined (cmake -DINSTRUMENTATION=ON), otherwise the
+ * macros expand to nothing.
+ */
+#ifndef NES_INSTRUMENTATION_HPP
+#define NES_INSTRUMENTATION_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+#include <stdint.h>
+
+namespace instrumentation {
+
+//! The timed phases.
+enum Phase
+{
+  SEND,
+  RECEIVE,
+  PARSE,
+  ACTIVATE,
+  RESET,
+  GAME_INFO,
+  STEP,
+  EVALUATION,
+  NUM_PHASES
+};
+
+//! The counted events.
+enum Counter
+{
+  TIMEOUTS,
+  FAILED_GAME_INFO,
+  FAILED_STEP,
+  FAILED_RESET,
+  RECONNECTS,
+  EVALUATIONS,
+  CACHE_HITS,
+  PREFIX_STEPS,
+  STATE_LOADS,
+  RACING_CUTS,
+  NUM_COUNTERS
+};
+
+/**
+ * HDR-style histogram of nanosecond values. Values below 16 are stored
+ * exactly, larger values are stored in 16 linear sub-buckets per power of
+ * two, so every value is recorded with a relative error below 6.25%.
+ * Recording is lock-free and can be done from several threads.
+ */
+class Histogram
+{
+ public:
+  //! The number of bits used for the linear sub-buckets.
+  static const size_t SUB_BUCKET_BITS = 4;
+
+  //! The number of linear sub-buckets per power of two.
+  static const size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+
+  //! The number of buckets needed to cover all 64 bit values.
+  static const size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  Histogram() { Reset(); }
+
+  //! Record the given value.
+  void Record(const uint64_t value)
+  {
+    counts[Index(value)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value,
+        std::memory_order_relaxed)) { }
+  }
+
+  //! Get the value at the given percentile (0 - 100).
+  uint64_t Percentile(const double percentile) const
+  {
+    const uint64_t total = count.load(std::memory_order_relaxed);
+    if (total == 0) return 0;
+
+    uint64_t target = uint64_t(percentile / 100.0 * total + 0.5);
+    target = std::max(target, uint64_t(1));
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+      seen += counts[i].load(std::memory_order_relaxed);
+      if (seen >= target)
+      {
+        return std::min(Value(i), Max());
+      }
+    }
+
+    return Max();
+  }
+
+  //! Get the number of recorded values.
+  uint64_t Count() const { return count.load(std::memory_order_relaxed); }
+
+  //! Get the mean of the recorded values.
+  double Mean() const
+  {
+    const uint64_t total = Count();
+    return total ? double(sum.load(std::memory_order_relaxed)) / total : 0;
+  }
+
+  //! Get the largest recorded value.
+  uint64_t Max() const { return max.load(std::memory_order_relaxed); }
+
+  //! Remove all recorded values.
+  void Reset()
+  {
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+      counts[i].store(0, std::memory_order_relaxed);
+    }
+
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+  }
+
+ private:
+  //! Get the bucket of the given value.
+  static size_t Index(const uint64_t value)
+  {
+    if (value < SUB_BUCKETS) return value;
+
+    const size_t msb = 63 - __builtin_clzll(value);
+    const size_t shift = msb - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + size_t(value >> shift) - SUB_BUCKETS;
+  }
+
+  //! Get the representative (mid) value of the given bucket.
+  static uint64_t Value(const size_t index)
+  {
+    if (index < SUB_BUCKETS) return index;
+
+    const size_t shift = index / SUB_BUCKETS - 1;
+    const uint64_t lower = uint64_t(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    return lower + ((uint64_t(1) << shift) >> 1);
+  }
+
+  std::atomic<uint64_t> counts[BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+};
+
+/**
+ * The phase histograms and counters of the process.
+ */
+class Registry
+{
+ public:
+  Registry() : generation(0), start(std::chrono::steady_clock::now())
+  {
+    Reset();
+  }
+
+  //! Record the duration of the given phase in nanoseconds.
+  void Record(const Phase phase, const uint64_t nanoseconds)
+  {
+    phases[phase].Record(nanoseconds);
+  }
+
+  //! Increment the given counter.
+  void Increment(const Counter counter)
+  {
+    counters[counter].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  //! Get the histogram of the given phase.
+  const Histogram& PhaseHistogram(const Phase phase) const
+  {
+    return phases[phase];
+  }
+
+  //! Get the value of the given counter.
+  uint64_t Count(const Counter counter) const
+  {
+    return counters[counter].load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Count a finished evaluation; once the given number of evaluations
+   * (population size) is reached, the snapshot is written to the given
+   * stream and the histograms and counters are reset.
+   */
+  void Evaluated(const size_t populationSize, std::ostream& stream)
+  {
+    const uint64_t evaluations = counters[EVALUATIONS].fetch_add(1,
+        std::memory_order_relaxed) + 1;
+
+    if (populationSize > 0 && evaluations == populationSize)
+    {
+      Dump(stream);
+      Reset();
+    }
+  }
+
+  //! Write the snapshot of all phases and counters to the given stream.
+  void Dump(std::ostream& stream)
+  {
+    static const char* phaseNames[] = {
+        "send", "receive", "parse", "activate", "reset", "game info", "step",
+        "evaluation" };
+
+    static const char* counterNames[] = {
+        "timeouts", "failed game info", "failed step", "failed reset",
+        "reconnects", "evaluations", "cache hits", "prefix steps",
+        "state loads", "racing cuts" };
+
+    const std::ios::fmtflags flags(stream.flags());
+    const std::streamsize precision(stream.precision());
+
+    const std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(now - start).count();
+
+    stream << "Generation " << generation++ << " (" << std::fixed
+           << std::setprecision(2) << seconds << " s)" << std::endl;
+    stream << std::left << std::setw(12) << "phase" << std::right
+           << std::setw(10) << "count" << std::setw(12) << "total (s)"
+           << std::setw(12) << "mean (us)" << std::setw(12) << "p50 (us)"
+           << std::setw(12) << "p90 (us)" << std::setw(12) << "p99 (us)"
+           << std::setw(12) << "max (us)" << std::endl;
+
+    for (size_t i = 0; i < NUM_PHASES; ++i)
+    {
+      const Histogram& histogram = phases[i];
+      if (histogram.Count() == 0) continue;
+
+      stream << std::left << std::setw(12) << phaseNames[i] << std::right
+             << std::setw(10) << histogram.Count()
+             << std::setw(12) << histogram.Mean() * histogram.Count() * 1e-9
+             << std::setw(12) << histogram.Mean() * 1e-3
+             << std::setw(12) << histogram.Percentile(50) * 1e-3
+             << std::setw(12) << histogram.Percentile(90) * 1e-3
+             << std::setw(12) << histogram.Percentile(99) * 1e-3
+             << std::setw(12) << histogram.Max() * 1e-3 << std::endl;
+    }
+
+    for (size_t i = 0; i < NUM_COUNTERS; ++i)
+    {
+      stream << (i ? ", " : "") << counterNames[i] << " "
+             << counters[i].load(std::memory_order_relaxed);
+    }
+    stream << std::endl;
+
+    stream.flags(flags);
+    stream.precision(precision);
+    start = now;
+  }
+
+  //! Remove all recorded values.
+  void Reset()
+  {
+    for (size_t i = 0; i < NUM_PHASES; ++i)
+    {
+      phases[i].Reset();
+    }
+
+    for (size_t i = 0; i < NUM_COUNTERS; ++i)
+    {
+      counters[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  Histogram phases[NUM_PHASES];
+  std::atomic<uint64_t> counters[NUM_COUNTERS];
+  size_t generation;
+  std::chrono::steady_clock::time_point start;
+};
+
+//! Get the registry of the process.
+inline Registry& Global()
+{
+  static Registry registry;
+  return registry;
+}
+
+/**
+ * Record the lifetime of the timer as duration of the given phase.
+ */
+class ScopedTimer
+{
+ public:
+  ScopedTimer(const Phase phase) :
+      phase(phase),
+      start(std::chrono::steady_clock::now())
+  {
+    /* Nothing to do here */
+  }
+
+  ~ScopedTimer()
+  {
+    Global().Record(phase, std::chrono::duration_cast<
+        std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+        start).count());
+  }
+
+ private:
+  Phase phase;
+  std::chrono::steady_clock::time_point start;
+};
+
+} // namespace instrumentation
+
+#define NES_CONCAT_IMPL(a, b) a##b
+#define NES_CONCAT(a, b) NES_CONCAT_IMPL(a, b)
+
+#ifdef NES_INSTRUMENTATION
+  //! Time the rest of the enclosing scope as the given phase.
+  #define NES_TIME(phase) instrumentation::ScopedTimer \
+      NES_CONCAT(nesTimer, __LINE__)(instrumentation::phase)
+
+  //! Increment the given counter.
+  #define NES_COUNT(counter) \
+      instrumentation::Global().Increment(instrumentation::counter)
+
+  //! Count a finished evaluation and dump the snapshot once per generation.
+  #define NES_EVALUATED(populationSize, stream) \
+      instrumentation::Global().Evaluated(populationSize, stream)
+
+  //! Dump the snapshot.
+  #define NES_DUMP(stream) instrumentation::Global().Dump(stream)
+#else
+  #define NES_TIME(phase)
+  #define NES_COUNT(counter) ((void) 0)
+  #define NES_EVALUATED(populationSize, stream) ((void) 0)
+  #define NES_DUMP(stream) ((void) 0)
+#endif
+
+#endif
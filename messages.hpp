@@ -4,10 +4,28 @@
  *
  * Miscellaneous messages.
  */
+#ifndef NES_MESSAGES_HPP
+#define NES_MESSAGES_HPP
+
+#include <cstdio>
 #include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
 
 namespace messages {
 
+//! Wire protocols supported by the emulator module.
+enum Protocol
+{
+  //! JSON messages framed with a "\r\n" (request) or "\r\n\r\n\r\n"
+  // (reply) sentinel; used for debugging.
+  JSON,
+
+  //! Length-prefixed binary frames with fixed opcodes.
+  BINARY
+};
+
 //! Create press 'A' JSON message.
 static inline std::string PressA()
 {
@@ -74,6 +92,65 @@ static inline std::string GameImage()
   return "\"game\":{\"value\": \"Image\"}";
 }
 
+//! Create message to press the given key (A, B, Right, Left, Up, Down,
+// Start), advance the frame divisor and get the resulting game info.
+static inline std::string Step(const std::string& key)
+{
+  return "\"step\":{\"value\": \"" + key + "\"}";
+}
+
+/**
+ * Create message to run the given action sequence. Every key is pressed for
+ * the given number of frames, the game info after every action is returned in
+ * a single trajectory reply. The sequence stops early if mario dies.
+ *
+ * @param actions The (key, frames) pairs, at most 255.
+ */
+static inline std::string Sequence(
+    const std::vector<std::pair<std::string, int> >& actions)
+{
+  std::string sequence = "\"sequence\":{\"value\": [";
+  for (size_t i = 0; i < actions.size(); ++i)
+  {
+    sequence += (i ? ", [\"" : "[\"") + actions[i].first + "\", " +
+        std::to_string(actions[i].second) + "]";
+  }
+
+  return sequence + "]}";
+}
+
+/**
+ * Create message to save the current game state into the given savestate
+ * slot of the emulator. No frame is advanced between the savestate commands
+ * and the other commands of the same message, so send it with the next step
+ * to save the state the step starts from.
+ *
+ * @param slot The savestate slot (1 - 65535); an existing slot is replaced.
+ */
+static inline std::string SaveState(const int slot)
+{
+  return "\"savestate\":{\"save\": " + std::to_string(slot) + "}";
+}
+
+/**
+ * Create message to load the game state of the given savestate slot, send it
+ * with the next step. If the slot doesn't exist the emulator answers with
+ * {"missing": <slot>} and ignores the rest of the message.
+ *
+ * @param slot The savestate slot.
+ */
+static inline std::string LoadState(const int slot)
+{
+  return "\"savestate\":{\"load\": " + std::to_string(slot) + "}";
+}
+
+//! Create message to remove the given savestate slot. The slots are removed
+// once the client disconnects.
+static inline std::string DiscardState(const int slot)
+{
+  return "\"savestate\":{\"discard\": " + std::to_string(slot) + "}";
+}
+
 //! Create message to set the number of frames that should be run without any
 // interaction.
 static inline std::string ConfigFrame(const int frame)
@@ -96,7 +173,29 @@ static inline std::string ConfigDivisor(const int divisor)
 //! Create message to set the emulation speed (normal, maximum, turbo).
 static inline std::string ConfigSpeed(const std::string& speed)
 {
-  return "\"config\":{\"speed\": " + speed + "}";
+  return "\"config\":{\"speed\": \"" + speed + "\"}";
+}
+
+//! Create message to send the game info as delta to the last game info; a
+// full game info (keyframe) is sent every interval replies, 0 disables the
+// delta observations.
+static inline std::string ConfigDelta(const int interval)
+{
+  return "\"config\":{\"delta\": " + std::to_string(interval) + "}";
+}
+
+//! Create message to publish the game frames into the shared memory ring of
+// the emulator (see frames::FrameRing); the token is stored in the ring, 0
+// disables the ring.
+static inline std::string ConfigShm(const uint32_t token)
+{
+  return "\"config\":{\"shm\": " + std::to_string(token) + "}";
+}
+
+//! Create message to switch the session to the given protocol (json, binary).
+static inline std::string ConfigProtocol(const std::string& protocol)
+{
+  return "\"config\":{\"protocol\": \"" + protocol + "\"}";
 }
 
 //! Create message to send the endpoint.
@@ -112,6 +211,59 @@ static inline std::string GetEndpoint()
   return "get";
 }
 
+//! Create message to send the number of endpoints.
+static inline std::string SendEndpointCount(const size_t count)
+{
+  return "\"count\": " + std::to_string(count);
+}
+
+//! Create message to get the number of endpoints.
+static inline std::string GetEndpointCount()
+{
+  return "count";
+}
+
+//! Create message to send whether an endpoint is leased.
+static inline std::string SendEndpointLeased(const bool leased)
+{
+  return std::string("\"leased\": ") + (leased ? "true" : "false");
+}
+
+//! Create message to ask whether the given endpoint is leased.
+static inline std::string GetEndpointLeased(const std::string& host,
+                                            const std::string& port)
+{
+  return "leased " + host + (port.empty() ? "" : ":" + port);
+}
+
+//! Create message to release the leased endpoint.
+static inline std::string ReleaseEndpoint(const std::string& host,
+                                          const std::string& port)
+{
+  // Unix domain socket endpoints (unix:<path>) have no port.
+  return "release " + host + (port.empty() ? "" : ":" + port);
+}
+
+//! Create message to renew the leased endpoints.
+static inline std::string RenewEndpoint()
+{
+  return "renew";
+}
+
+//! Create message to register the given endpoint at the balancer.
+static inline std::string AddEndpoint(const std::string& host,
+                                      const std::string& port)
+{
+  return "add " + host + (port.empty() ? "" : ":" + port);
+}
+
+//! Create message to remove the given endpoint from the balancer.
+static inline std::string RemoveEndpoint(const std::string& host,
+                                         const std::string& port)
+{
+  return "remove " + host + (port.empty() ? "" : ":" + port);
+}
+
 
 
 //! Function to append a JSON message to JSON another message.
@@ -133,4 +285,386 @@ static inline std::string JSONMessage(const std::string& messageA)
   return "{" + messageA + "}";
 }
 
-} // namespace messages
\ No newline at end of file
+/**
+ * Build the final JSON message of a step (see Step and SaveState) in the given
+ * buffer. The buffer keeps its capacity, so a buffer that is reused for every
+ * step doesn't allocate once it is large enough.
+ *
+ * @param message The buffer to build the message in.
+ * @param key The key to press.
+ * @param slot The savestate slot the state is saved into before the step, 0
+ *        to skip the savestate.
+ */
+static inline void StepMessage(std::string& message,
+                               const char* key,
+                               const int slot = 0)
+{
+  message.assign("{");
+  if (slot != 0)
+  {
+    char number[16];
+    const int length = std::snprintf(number, sizeof(number), "%d", slot);
+    message.append("\"savestate\":{\"save\": ");
+    message.append(number, length);
+    message.append("},");
+  }
+
+  message.append("\"step\":{\"value\": \"");
+  message.append(key);
+  message.append("\"}}");
+}
+
+/**
+ * Binary protocol. Every frame starts with the payload length as 32 bit
+ * unsigned integer (big-endian), followed by the payload. A request payload is
+ * a sequence of commands, each command is an opcode followed by a fixed size
+ * argument:
+ *
+ * KEY      <key:1>
+ * GAME     <game:1>
+ * CONFIG   <field:1> <value:4>
+ * STEP     <key:1>
+ * SEQUENCE <count:1> (<key:1> <frames:2>)*count
+ * STATE    <operation:1> <slot:2>
+ *
+ * A reply payload starts with the reply opcode:
+ *
+ * INFO     <x:2> <y:2> <lives:1> <coins:1> <state:1> <size:1> <tiles:size*size>
+ * DELTA    <x:2> <y:2> <lives:1> <coins:1> <state:1> <count:1>
+ *          <index:1 value:1>*count
+ * TILES    <size:1> <tiles:size*size>
+ * TRAJECTORY <count:1> (<x:2> <y:2> <lives:1> <coins:1> <state:1> <size:1>
+ *          <tiles:size*size>)*count
+ * IMAGE    <jpeg>
+ * PROTOCOL <protocol:1>
+ * FRAME    <frame:4>
+ * MISSING  <slot:2>
+ *
+ * STEP presses the key, advances the frame divisor and is answered with INFO.
+ * SEQUENCE is answered with TRAJECTORY, the game info after every action.
+ * If the shared memory ring is enabled, the game frame is published into the
+ * ring before every game info and an image request is answered with FRAME,
+ * the number of the published frame, instead of IMAGE.
+ *
+ * STATE saves, loads or discards a savestate slot; the commands of a message
+ * are handled within the same frame, so a STATE command followed by STEP
+ * saves (or loads) the state the step starts from. Loading an unknown slot is
+ * answered with MISSING and the rest of the message is ignored.
+ *
+ * The tiles are stored row by row in the same order as the matrix returned by
+ * parser::Parser::Tiles(). A DELTA reply replaces INFO if delta observations
+ * are enabled, it contains the tiles that changed since the last INFO or
+ * DELTA reply; the index is the row-major position in the tiles matrix.
+ */
+namespace binary {
+
+//! Request opcodes.
+const uint8_t KEY = 0x01;
+const uint8_t GAME = 0x02;
+const uint8_t CONFIG = 0x03;
+const uint8_t STEP = 0x04;
+const uint8_t SEQUENCE = 0x05;
+const uint8_t STATE = 0x06;
+
+//! Reply opcodes.
+const uint8_t REPLY_INFO = 0x81;
+const uint8_t REPLY_TILES = 0x82;
+const uint8_t REPLY_IMAGE = 0x83;
+const uint8_t REPLY_PROTOCOL = 0x84;
+const uint8_t REPLY_DELTA = 0x85;
+const uint8_t REPLY_TRAJECTORY = 0x86;
+const uint8_t REPLY_FRAME = 0x87;
+const uint8_t REPLY_MISSING = 0x88;
+
+//! Key values.
+const uint8_t KEY_A = 1;
+const uint8_t KEY_B = 2;
+const uint8_t KEY_RIGHT = 3;
+const uint8_t KEY_LEFT = 4;
+const uint8_t KEY_UP = 5;
+const uint8_t KEY_DOWN = 6;
+const uint8_t KEY_START = 7;
+
+//! Game values.
+const uint8_t GAME_RESET = 1;
+const uint8_t GAME_TILES = 2;
+const uint8_t GAME_INFO = 3;
+const uint8_t GAME_IMAGE = 4;
+
+//! Config fields.
+const uint8_t CONFIG_FRAME = 1;
+const uint8_t CONFIG_IMAGE = 2;
+const uint8_t CONFIG_DIVISOR = 3;
+const uint8_t CONFIG_SPEED = 4;
+const uint8_t CONFIG_PROTOCOL = 5;
+const uint8_t CONFIG_DELTA = 6;
+const uint8_t CONFIG_SHM = 7;
+
+//! Savestate operations.
+const uint8_t STATE_SAVE = 1;
+const uint8_t STATE_LOAD = 2;
+const uint8_t STATE_DISCARD = 3;
+
+//! Speed values.
+const uint8_t SPEED_NORMAL = 0;
+const uint8_t SPEED_MAXIMUM = 1;
+const uint8_t SPEED_TURBO = 2;
+
+//! Size of the frame header (payload length).
+const size_t HEADER_SIZE = 4;
+
+//! Size of the fixed INFO reply fields that precede the tiles.
+const size_t INFO_SIZE = 9;
+
+//! Append the given value as big-endian integer of the given size.
+static inline void Put(std::string& data, const uint32_t value,
+                       const size_t size)
+{
+  for (size_t i = size; i > 0; --i)
+  {
+    data.push_back(static_cast<char>((value >> (8 * (i - 1))) & 0xFF));
+  }
+}
+
+//! Store the given value as big-endian integer of the given size.
+static inline void Put(char* data, const uint32_t value, const size_t size)
+{
+  for (size_t i = size; i > 0; --i)
+  {
+    data[size - i] = static_cast<char>((value >> (8 * (i - 1))) & 0xFF);
+  }
+}
+
+//! Read a big-endian integer of the given size at the given offset.
+static inline uint32_t Get(const char* data, const size_t size)
+{
+  uint32_t value = 0;
+  for (size_t i = 0; i < size; ++i)
+  {
+    value = (value << 8) | static_cast<uint8_t>(data[i]);
+  }
+
+  return value;
+}
+
+//! Create a command with a single byte argument.
+static inline std::string Command(const uint8_t opcode, const uint8_t value)
+{
+  std::string command;
+  command.push_back(static_cast<char>(opcode));
+  command.push_back(static_cast<char>(value));
+  return command;
+}
+
+//! Create a config command.
+static inline std::string Config(const uint8_t field, const int value)
+{
+  std::string command = Command(CONFIG, field);
+  Put(command, static_cast<uint32_t>(value), 4);
+  return command;
+}
+
+//! Create press 'A' binary message.
+static inline std::string PressA()
+{
+  return Command(KEY, KEY_A);
+}
+
+//! Create press 'B' binary message.
+static inline std::string PressB()
+{
+  return Command(KEY, KEY_B);
+}
+
+//! Create press 'Right' binary message.
+static inline std::string PressRight()
+{
+  return Command(KEY, KEY_RIGHT);
+}
+
+//! Create press 'Left' binary message.
+static inline std::string PressLeft()
+{
+  return Command(KEY, KEY_LEFT);
+}
+
+//! Create press 'Up' binary message.
+static inline std::string PressUp()
+{
+  return Command(KEY, KEY_UP);
+}
+
+//! Create press 'Down' binary message.
+static inline std::string PressDown()
+{
+  return Command(KEY, KEY_DOWN);
+}
+
+//! Create press 'Start' binary message.
+static inline std::string PressStart()
+{
+  return Command(KEY, KEY_START);
+}
+
+//! Create binary message to get the tiles.
+static inline std::string GameTiles()
+{
+  return Command(GAME, GAME_TILES);
+}
+
+//! Create binary message to get the game info.
+static inline std::string GameInfo()
+{
+  return Command(GAME, GAME_INFO);
+}
+
+//! Create binary message to reset the game.
+static inline std::string GameReset()
+{
+  return Command(GAME, GAME_RESET);
+}
+
+//! Create binary message to get the game as image (jpeg).
+static inline std::string GameImage()
+{
+  return Command(GAME, GAME_IMAGE);
+}
+
+//! Create binary message to press the given key (KEY_A, ..., KEY_START),
+// advance the frame divisor and get the resulting game info.
+static inline std::string Step(const uint8_t key)
+{
+  return Command(STEP, key);
+}
+
+/**
+ * Create binary message to run the given action sequence, see
+ * messages::Sequence.
+ *
+ * @param actions The (key, frames) pairs (KEY_A, ..., KEY_START), at most 255.
+ */
+static inline std::string Sequence(
+    const std::vector<std::pair<uint8_t, int> >& actions)
+{
+  std::string sequence = Command(SEQUENCE, uint8_t(actions.size()));
+  for (size_t i = 0; i < actions.size(); ++i)
+  {
+    sequence.push_back(static_cast<char>(actions[i].first));
+    Put(sequence, static_cast<uint32_t>(actions[i].second), 2);
+  }
+
+  return sequence;
+}
+
+//! Create a savestate command.
+static inline std::string State(const uint8_t operation, const int slot)
+{
+  std::string command = Command(STATE, operation);
+  Put(command, static_cast<uint32_t>(slot), 2);
+  return command;
+}
+
+//! Create binary message to save the current game state into the given
+// savestate slot, see messages::SaveState.
+static inline std::string SaveState(const int slot)
+{
+  return State(STATE_SAVE, slot);
+}
+
+//! Create binary message to load the game state of the given savestate slot,
+// see messages::LoadState.
+static inline std::string LoadState(const int slot)
+{
+  return State(STATE_LOAD, slot);
+}
+
+//! Create binary message to remove the given savestate slot.
+static inline std::string DiscardState(const int slot)
+{
+  return State(STATE_DISCARD, slot);
+}
+
+//! Build the binary message of a step in the given buffer, see
+// messages::StepMessage.
+static inline void StepMessage(std::string& message,
+                               const uint8_t key,
+                               const int slot = 0)
+{
+  message.clear();
+  if (slot != 0)
+  {
+    message.push_back(static_cast<char>(STATE));
+    message.push_back(static_cast<char>(STATE_SAVE));
+    Put(message, static_cast<uint32_t>(slot), 2);
+  }
+
+  message.push_back(static_cast<char>(STEP));
+  message.push_back(static_cast<char>(key));
+}
+
+//! Create binary message to set the number of frames that should be run
+// without any interaction.
+static inline std::string ConfigFrame(const int frame)
+{
+  return Config(CONFIG_FRAME, frame);
+}
+
+//! Create binary message to set the image quality (jpeg).
+static inline std::string ConfigImage(const int quality)
+{
+  return Config(CONFIG_IMAGE, quality);
+}
+
+//! Create binary message to set the divisor.
+static inline std::string ConfigDivisor(const int divisor)
+{
+  return Config(CONFIG_DIVISOR, divisor);
+}
+
+//! Create binary message to set the emulation speed (normal, maximum, turbo).
+static inline std::string ConfigSpeed(const std::string& speed)
+{
+  if (speed == "normal")
+  {
+    return Config(CONFIG_SPEED, SPEED_NORMAL);
+  }
+  else if (speed == "turbo")
+  {
+    return Config(CONFIG_SPEED, SPEED_TURBO);
+  }
+
+  return Config(CONFIG_SPEED, SPEED_MAXIMUM);
+}
+
+//! Create binary message to send the game info as delta to the last game info;
+// a keyframe is sent every interval replies, 0 disables the delta
+// observations.
+static inline std::string ConfigDelta(const int interval)
+{
+  return Config(CONFIG_DELTA, interval);
+}
+
+//! Create binary message to publish the game frames into the shared memory
+// ring of the emulator; the token is stored in the ring, 0 disables the ring.
+static inline std::string ConfigShm(const uint32_t token)
+{
+  return Config(CONFIG_SHM, token);
+}
+
+//! Create binary message to switch the session to the given protocol.
+static inline std::string ConfigProtocol(const Protocol protocol)
+{
+  return Config(CONFIG_PROTOCOL, protocol);
+}
+
+//! Function to append a binary message to another binary message.
+static inline void Append(std::string& messageA, const std::string& messageB)
+{
+  messageA += messageB;
+}
+
+} // namespace binary
+
+} // namespace messages
+
+#endif
@@ -13,11 +13,14 @@
 #endif
 
 #include <iostream>
+#include <memory>
+#include <random>
 #include <string>
 
 #include "parser.hpp"
 #include "client.hpp"
 #include "messages.hpp"
+#include "frame_ring.hpp"
 
 using namespace mlpack;
 
@@ -32,6 +35,13 @@ int main(int argc, char* argv[])
     client::Client client;
     client.Connect(host, port);
 
+    // Ask the emulator to publish the frames into the shared memory ring; if
+    // the emulator runs on another host the images are sent as jpeg.
+    std::random_device device;
+    const uint32_t token = device() | 1;
+    client.Send(messages::JSONMessage(messages::ConfigShm(token)));
+    std::unique_ptr<frames::FrameRing> ring;
+
     parser::Parser parser;
     std::string command;
     arma::mat tiles;
@@ -87,6 +97,44 @@ int main(int argc, char* argv[])
         std::string imageStr;
         client.Receive(imageStr);
 
+        // The frame was published into the shared memory ring.
+        if (imageStr.compare(0, 9, "{\"frame\":") == 0)
+        {
+          try
+          {
+            if (!ring)
+            {
+              ring.reset(new frames::FrameRing(frames::RingName(host, port),
+                  token));
+            }
+          }
+          catch (const std::exception&)
+          {
+            // Not on the same host, fall back to the jpeg images.
+            client.Send(messages::JSONMessage(messages::ConfigShm(0)));
+            client.Send(messages::JSONMessage(json));
+            client.Receive(imageStr);
+          }
+        }
+
+        frames::Frame frame;
+        if (ring && ring->Latest(frame))
+        {
+          #ifdef HAS_OPENCV
+            // The pixels are ARGB, convert to BGR for displaying.
+            cv::Mat argb(frame.height, frame.width, CV_8UC4,
+                const_cast<uint8_t*>(frame.pixels));
+            cv::Mat image(frame.height, frame.width, CV_8UC3);
+            const int fromTo[] = { 1, 2, 2, 1, 3, 0 };
+            cv::mixChannels(&argb, 1, &image, 1, fromTo, 3);
+
+            imshow("image", image);
+            if(cv::waitKey(1) >= 0) break;
+          #endif
+
+          continue;
+        }
+
         parser.GameImage(imageStr, imageStr);
         std::vector<char> vectordata(imageStr.begin(), imageStr.end());
 
@@ -0,0 +1,120 @@
+/**
+ * @file observation.hpp
+ * @author Marcus Edel
+ *
+ * Compact game observation and the kernels that work on it.
+ */
+#ifndef NES_OBSERVATION_HPP
+#define NES_OBSERVATION_HPP
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+namespace observation {
+
+//! The tile value of mario.
+const uint8_t MARIO = 3;
+
+/**
+ * The Observation holds a game info: the tiles around mario, one byte per
+ * tile, and the state of mario. The tiles (0 - 3) are stored in column-major
+ * order, the order of the tiles matrix returned by parser::Parser::Tiles, so
+ * a 13x13 view field takes 169 bytes instead of the 1352 bytes of a matrix
+ * of doubles. Copies reuse the memory of the tiles if the size matches.
+ */
+struct Observation
+{
+  //! Create an empty observation.
+  Observation() :
+      size(0),
+      marioPostionX(0),
+      marioPostionY(0),
+      marioLives(0),
+      playerState(0)
+  {
+    /* Nothing to do here */
+  }
+
+  //! Get the tile at the given row and column.
+  uint8_t Tile(const size_t row, const size_t col) const
+  {
+    return tiles[col * size + row];
+  }
+
+  //! The number of rows (and columns) of the tiles.
+  size_t size;
+
+  //! The tiles in column-major order.
+  std::vector<uint8_t> tiles;
+
+  //! The x coordinate of mario.
+  int marioPostionX;
+
+  //! The y coordinate of mario.
+  int marioPostionY;
+
+  //! The number of lives.
+  int marioLives;
+
+  //! The player state.
+  int playerState;
+};
+
+/**
+ * Expand the tiles into the given input buffer of a network, in the order of
+ * the tiles.
+ *
+ * @param observation The observation.
+ * @param input The buffer, at least observation.tiles.size() values.
+ */
+inline void Expand(const Observation& observation, double* input)
+{
+  // A single pass over contiguous bytes without a dependency between the
+  // iterations, so the conversion can be vectorized.
+  const uint8_t* tiles = observation.tiles.data();
+  const size_t n = observation.tiles.size();
+  for (size_t i = 0; i < n; ++i)
+  {
+    input[i] = tiles[i];
+  }
+}
+
+/**
+ * Sum the given tiles.
+ *
+ * @param tiles The tiles.
+ * @param n The number of tiles.
+ */
+inline size_t Sum(const uint8_t* tiles, const size_t n)
+{
+  // Four independent sums of 32 bit lanes, so the loop can be vectorized.
+  uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    s0 += tiles[i];
+    s1 += tiles[i + 1];
+    s2 += tiles[i + 2];
+    s3 += tiles[i + 3];
+  }
+
+  for (; i < n; ++i) s0 += tiles[i];
+
+  return size_t(s0) + s1 + s2 + s3;
+}
+
+/**
+ * Check whether mario is the only tile left, which is the case once mario
+ * fell into a pit.
+ *
+ * @param observation The observation.
+ */
+inline bool OnlyMario(const Observation& observation)
+{
+  return Sum(observation.tiles.data(), observation.tiles.size()) == MARIO;
+}
+
+} // namespace observation
+
+#endif
@@ -0,0 +1,205 @@
+/**
+ * @file parallel_evaluator.hpp
+ * @author Marcus Edel
+ *
+ * Parallel evaluation of a population over all emulator endpoints.
+ */
+#ifndef NES_PARALLEL_EVALUATOR_HPP
+#define NES_PARALLEL_EVALUATOR_HPP
+
+#include <mlpack/core.hpp>
+
+#include "session.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace evaluator {
+
+/**
+ * The ParallelEvaluator fans the genomes of a population out over a pool of
+ * worker threads. Every worker owns a session (and therefore its own Client
+ * and Parser) and evaluates genomes using
+ *
+ * double TaskType::EvalFitness(GenomeType& genome, session::Session& session)
+ *
+ * The sessions are taken from TaskType::Sessions() and returned using
+ * TaskType::Release(std::unique_ptr<session::Session>), so the task can drop
+ * the state it keeps for a session.
+ *
+ * The fitness values are stored at the position of the genome, so the result
+ * doesn't depend on the scheduling of the workers. A genome whose evaluation
+ * throws gets the worst fitness (1).
+ */
+template<typename TaskType, typename GenomeType>
+class ParallelEvaluator {
+ public:
+  /**
+   * Create the ParallelEvaluator object using the given task and number of
+   * workers.
+   *
+   * @param task The task used to evaluate the genomes.
+   * @param numWorkers The number of workers, if 0 the number of endpoints
+   *        registered at the balancer is used.
+   */
+  ParallelEvaluator(TaskType& task, size_t numWorkers = 0) :
+      task(task),
+      genomes(NULL),
+      fitness(NULL),
+      next(0),
+      active(0),
+      generation(0),
+      stop(false)
+  {
+    if (numWorkers == 0)
+    {
+      try
+      {
+        numWorkers = task.Sessions().NumEndpoints();
+      }
+      catch (const std::exception& ex)
+      {
+        mlpack::Log::Warn << ex.what() << std::endl;
+      }
+    }
+
+    numWorkers = std::max(numWorkers, size_t(1));
+    for (size_t i = 0; i < numWorkers; ++i)
+    {
+      workers.push_back(std::thread(&ParallelEvaluator::Worker, this));
+    }
+  }
+
+  //! Stop and join the workers.
+  ~ParallelEvaluator()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+
+    start.notify_all();
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+      workers[i].join();
+    }
+  }
+
+  /**
+   * Evaluate the given genomes and block until all genomes are evaluated.
+   *
+   * @param genomes The genomes to be evaluated.
+   * @param fitness The fitness of the i'th genome is stored at position i.
+   */
+  void Evaluate(std::vector<GenomeType*>& genomes, std::vector<double>& fitness)
+  {
+    fitness.assign(genomes.size(), 1);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    this->genomes = &genomes;
+    this->fitness = &fitness;
+    next = 0;
+    active = workers.size();
+    ++generation;
+
+    start.notify_all();
+    done.wait(lock, [this] { return active == 0; });
+
+    this->genomes = NULL;
+    this->fitness = NULL;
+  }
+
+  //! Get the number of workers.
+  size_t NumWorkers() const { return workers.size(); }
+
+ private:
+  //! Take genomes until all genomes of the current generation are evaluated.
+  void Worker()
+  {
+    std::unique_ptr<session::Session> session = task.Sessions().Acquire();
+    size_t seen = 0;
+
+    for (;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        start.wait(lock, [this, seen] { return stop || generation != seen; });
+        if (stop) break;
+
+        seen = generation;
+      }
+
+      for (size_t i = next++; i < genomes->size(); i = next++)
+      {
+        // A failed evaluation keeps the worst fitness, so the generation is
+        // still finished; the state of the session is unknown, so the next
+        // evaluation connects again.
+        try
+        {
+          (*fitness)[i] = task.EvalFitness(*(*genomes)[i], *session);
+        }
+        catch (const std::exception& ex)
+        {
+          mlpack::Log::Warn << "Evaluation failed: " << ex.what()
+              << std::endl;
+          session->Close();
+        }
+        catch (...)
+        {
+          mlpack::Log::Warn << "Evaluation failed." << std::endl;
+          session->Close();
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--active == 0)
+      {
+        done.notify_all();
+      }
+    }
+
+    task.Release(std::move(session));
+  }
+
+  //! Locally stored task.
+  TaskType& task;
+
+  //! Locally stored worker threads.
+  std::vector<std::thread> workers;
+
+  //! Locally stored genomes of the current generation.
+  std::vector<GenomeType*>* genomes;
+
+  //! Locally stored fitness values of the current generation.
+  std::vector<double>* fitness;
+
+  //! Locally stored index of the next genome to be evaluated.
+  std::atomic<size_t> next;
+
+  //! Locally stored number of workers still busy with the current generation.
+  size_t active;
+
+  //! Locally stored generation counter used to wake up the workers.
+  size_t generation;
+
+  //! Locally stored indicator; set to true to stop the workers.
+  bool stop;
+
+  //! Locally stored mutex that guards the generation state.
+  std::mutex mutex;
+
+  //! Locally stored condition to start the workers.
+  std::condition_variable start;
+
+  //! Locally stored condition to signal that all workers are done.
+  std::condition_variable done;
+}; // class ParallelEvaluator
+
+} // namespace evaluator
+
+#endif
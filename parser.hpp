@@ -4,46 +4,92 @@
  *
  * Miscellaneous parser routines.
  */
+#ifndef NES_PARSER_HPP
+#define NES_PARSER_HPP
+
 #include <mlpack/core.hpp>
 
+#include "messages.hpp"
+#include "observation.hpp"
+
 #include <iostream>
+#include <stdexcept>
 #include <string>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
+#include <vector>
+#include <boost/utility/string_ref.hpp>
 
 namespace parser {
 
-using boost::property_tree::ptree;
-
-
+/**
+ * Single-pass decoder for the JSON and binary replies of the emulator module
+ * and the balancer. All known attributes are extracted while parsing; the
+ * tiles are decoded into a byte buffer that is kept and reused between
+ * messages.
+ * Delta observations are applied to the tiles of the last message, so a
+ * session should use the same parser for all game infos. For a trajectory
+ * reply the single game info accessors return the last observation.
+ */
 class Parser {
  public:
   /**
    * Create the Parser object.
    */
-  Parser() { /* Nothing to do here */ }
+  Parser() :
+      fields(0),
+      gridSize(0),
+      trajectoryLength(0),
+      cursor(NULL),
+      last(NULL)
+  {
+    /* Nothing to do here */
+  }
 
   /**
-   * Create the Parser object using the specified json string and create the
-   * tree to extract the attributes.
+   * Create the Parser object using the specified json string and extract the
+   * attributes.
    *
    * @param data The data encoded as json string.
    */
-  Parser(const std::string& data)
+  Parser(const std::string& data) :
+      fields(0),
+      gridSize(0),
+      trajectoryLength(0),
+      cursor(NULL),
+      last(NULL)
   {
     Parse(data);
   }
 
   /**
-   * Parse the specified json string and create a tree to extract the
-   * attributes.
+   * Parse the specified json string and extract the attributes. Binary
+   * replies (see messages::binary) are detected by their reply opcode.
    *
-   * @param data The data encoded as json string.
+   * @param data The data encoded as json string or binary reply.
    */
   void Parse(const std::string& data)
   {
-    std::stringstream ss(data);
-    boost::property_tree::read_json(ss, pt);
+    Parse(boost::string_ref(data));
+  }
+
+  /**
+   * Parse the specified view of a json string or binary reply, e.g. the view
+   * returned by client::Client::Receive.
+   *
+   * @param data The data encoded as json string or binary reply.
+   */
+  void Parse(const boost::string_ref& data)
+  {
+    fields = 0;
+
+    if (!data.empty() && (uint8_t(data[0]) & 0x80))
+    {
+      ParseBinary(data);
+      return;
+    }
+
+    cursor = data.data();
+    last = data.data() + data.size();
+    ParseJSON();
   }
 
   /**
@@ -54,8 +100,9 @@ class Parser {
    */
   void MarioPostion(int& x, int& y)
   {
-    x = pt.get_child("mario").get<int>("x");
-    y = pt.get_child("mario").get<int>("y");
+    Require(MARIO, "mario");
+    x = marioX;
+    y = marioY;
   }
 
   /**
@@ -66,35 +113,482 @@ class Parser {
    */
   void Endpoint(std::string& host, std::string& port)
   {
-    host = pt.get_child("endpoint").get<std::string>("host");
-    port = pt.get_child("endpoint").get<std::string>("port");
+    Require(ENDPOINT, "endpoint");
+    host = endpointHost;
+    port = endpointPort;
+  }
+
+  /**
+   * Parse the number of endpoints.
+   *
+   * @param count The number of endpoints registered at the balancer.
+   */
+  void EndpointCount(int& count)
+  {
+    Require(COUNT, "count");
+    count = endpointCount;
   }
 
   /**
    * Parse the tiles data and return in matrix form.
    *
-   * @param tiles The tiles as matrix.
+   * @param tiles The tiles as matrix; the memory is reused if the matrix
+   *        already has the right size.
    */
   void Tiles(arma::mat& tiles)
   {
-    int radius = 0;
-    ptree::const_iterator end = pt.get_child("tiles").end();
+    Require(TILES, "tiles");
+    Matrix(grid, tiles);
+  }
+
+  /**
+   * Parse the tiles and the state of mario into the given compact
+   * observation.
+   *
+   * @param observation The observation; the memory of the tiles is reused if
+   *        the observation already has the right size.
+   */
+  void Observation(observation::Observation& observation)
+  {
+    Require(TILES, "tiles");
+    Require(MARIO, "mario");
+    Require(LIVES, "lives");
+    Require(STATE, "state");
+
+    observation.size = gridSize;
+    observation.tiles = grid;
+    observation.marioPostionX = marioX;
+    observation.marioPostionY = marioY;
+    observation.marioLives = marioLives;
+    observation.playerState = playerState;
+  }
+
+  /**
+   * Parse the number lives.
+   *
+   * @param lives The current lives.
+   */
+  void MarioLives(int& lives)
+  {
+    Require(LIVES, "lives");
+    lives = marioLives;
+  }
+
+  /**
+   * Parse the number coins.
+   *
+   * @param coins The current number of coins.
+   */
+  void MarioCoins(int& coins)
+  {
+    Require(COINS, "coins");
+    coins = marioCoins;
+  }
+
+  /**
+   * Parse the player state.
+   *
+   * @param state The current player state.
+   */
+  void PlayerState(int& state)
+  {
+    Require(STATE, "state");
+    state = playerState;
+  }
+
+  /**
+   * Parse the tiles of every observation of the trajectory returned for an
+   * action sequence (see messages::Sequence).
+   *
+   * @param tiles The tiles as cube, one slice per observation.
+   */
+  void Trajectory(arma::cube& tiles)
+  {
+    Require(TRAJECTORY, "trajectory");
+
+    if (trajectoryLength == 0)
+    {
+      tiles.set_size(0, 0, 0);
+      return;
+    }
+
+    tiles.set_size(gridSize, gridSize, trajectoryLength);
+    for (size_t i = 0; i < trajectoryLength; ++i)
+    {
+      Matrix(trajectoryGrids[i], tiles.slice(i));
+    }
+  }
+
+  /**
+   * Parse the postion of mario of every observation of the trajectory.
+   *
+   * @param x The x coordinates of mario.
+   * @param y The y coordinates of mario.
+   */
+  void TrajectoryMarioPostion(std::vector<int>& x, std::vector<int>& y)
+  {
+    Require(TRAJECTORY, "trajectory");
+    x = trajectoryX;
+    y = trajectoryY;
+  }
+
+  /**
+   * Parse the player state of every observation of the trajectory.
+   *
+   * @param state The player states.
+   */
+  void TrajectoryPlayerState(std::vector<int>& state)
+  {
+    Require(TRAJECTORY, "trajectory");
+    state = trajectoryState;
+  }
+
+  /**
+   * Parse the number of the frame that was published into the shared memory
+   * ring (see frames::FrameRing).
+   *
+   * @param number The frame number.
+   */
+  void FrameNumber(int& number)
+  {
+    Require(FRAME, "frame");
+    number = frameNumber;
+  }
+
+  /**
+   * Parse the current game image.
+   *
+   * @param image The current game image as string.
+   */
+  void GameImage(const std::string& json, std::string& image)
+  {
+    if (!json.empty() &&
+        uint8_t(json[0]) == messages::binary::REPLY_IMAGE)
+    {
+      image = json.substr(1);
+      return;
+    }
+
+    image = json;
+  }
+
+ private:
+  //! Attributes extracted from the last message.
+  enum Field
+  {
+    MARIO = 1 << 0,
+    TILES = 1 << 1,
+    LIVES = 1 << 2,
+    COINS = 1 << 3,
+    STATE = 1 << 4,
+    ENDPOINT = 1 << 5,
+    COUNT = 1 << 6,
+    TRAJECTORY = 1 << 7,
+    FRAME = 1 << 8
+  };
+
+  //! Throw if the last message didn't contain the given attribute.
+  void Require(const int field, const char* name) const
+  {
+    if (!(fields & field))
+    {
+      throw std::runtime_error(std::string("No such node (") + name + ")");
+    }
+  }
+
+  //! Decode the attributes of a binary INFO, DELTA, TILES, TRAJECTORY or
+  // FRAME reply.
+  void ParseBinary(const boost::string_ref& payload)
+  {
+    const uint8_t opcode = uint8_t(payload[0]);
+    if (opcode == messages::binary::REPLY_INFO)
+    {
+      ParseGrid(payload, ParseStatus(payload, 1));
+    }
+    else if (opcode == messages::binary::REPLY_DELTA)
+    {
+      size_t offset = ParseStatus(payload, 1);
+      if (payload.size() <= offset)
+      {
+        throw std::runtime_error("Truncated binary reply.");
+      }
+
+      const size_t count = uint8_t(payload[offset++]);
+      if (payload.size() < offset + 2 * count)
+      {
+        throw std::runtime_error("Truncated binary reply.");
+      }
 
-    // Get the number of tiles in one row.
-    for (ptree::const_iterator it = pt.get_child("tiles").begin();
-        it != end; ++it, radius++);
+      CheckKeyframe();
+      for (size_t i = 0; i < count; ++i, offset += 2)
+      {
+        ApplyDelta(uint8_t(payload[offset]), uint8_t(payload[offset + 1]));
+      }
+
+      fields |= TILES;
+    }
+    else if (opcode == messages::binary::REPLY_TILES && payload.size() > 1)
+    {
+      ParseGrid(payload, 1);
+    }
+    else if (opcode == messages::binary::REPLY_TRAJECTORY &&
+        payload.size() > 1)
+    {
+      const size_t count = uint8_t(payload[1]);
+
+      ClearTrajectory();
+      for (size_t i = 0, offset = 2; i < count; ++i)
+      {
+        offset = ParseGrid(payload, ParseStatus(payload, offset));
+        AppendTrajectory();
+      }
+    }
+    else if (opcode == messages::binary::REPLY_FRAME && payload.size() >= 5)
+    {
+      frameNumber = messages::binary::Get(payload.data() + 1, 4);
+      fields |= FRAME;
+    }
+
+    // Replies without attributes, e.g. the protocol acknowledgement, are
+    // ignored.
+  }
+
+  /**
+   * Decode the position, lives, coins and player state of a binary game info
+   * that starts at the given offset.
+   *
+   * @return The offset of the first byte after the attributes.
+   */
+  size_t ParseStatus(const boost::string_ref& payload, const size_t offset)
+  {
+    if (payload.size() < offset + 7)
+    {
+      throw std::runtime_error("Truncated binary reply.");
+    }
+
+    marioX = messages::binary::Get(payload.data() + offset, 2);
+    marioY = messages::binary::Get(payload.data() + offset + 2, 2);
+    marioLives = uint8_t(payload[offset + 4]);
+    marioCoins = uint8_t(payload[offset + 5]);
+    playerState = uint8_t(payload[offset + 6]);
+    fields |= MARIO | LIVES | COINS | STATE;
+
+    return offset + 7;
+  }
+
+  /**
+   * Decode the binary tiles (<size:1> <tiles:size*size>) that start at the
+   * given offset.
+   *
+   * @return The offset of the first byte after the tiles.
+   */
+  size_t ParseGrid(const boost::string_ref& payload, size_t offset)
+  {
+    if (payload.size() <= offset)
+    {
+      throw std::runtime_error("Truncated binary reply.");
+    }
+
+    const size_t size = uint8_t(payload[offset++]);
+    if (payload.size() < offset + size * size)
+    {
+      throw std::runtime_error("Truncated binary reply.");
+    }
+
+    // The tiles are already stored in matrix order, row by row.
+    Grid(size);
+    for (size_t row = 0; row < size; ++row)
+    {
+      for (size_t col = 0; col < size; ++col)
+      {
+        grid[col * size + row] = uint8_t(payload[offset++]);
+      }
+    }
+
+    fields |= TILES;
+    return offset;
+  }
+
+  //! Extract the known attributes of a json message in a single pass.
+  void ParseJSON()
+  {
+    Expect('{');
+    if (Accept('}')) return;
+
+    do
+    {
+      const boost::string_ref key = Key();
+
+      if (key == "mario")
+      {
+        ParseMario();
+      }
+      else if (key == "tiles")
+      {
+        ParseTiles();
+      }
+      else if (key == "delta")
+      {
+        ParseDelta();
+      }
+      else if (key == "trajectory")
+      {
+        ParseTrajectory();
+      }
+      else if (key == "lives")
+      {
+        marioLives = Int();
+        fields |= LIVES;
+      }
+      else if (key == "coins")
+      {
+        marioCoins = Int();
+        fields |= COINS;
+      }
+      else if (key == "state")
+      {
+        playerState = Int();
+        fields |= STATE;
+      }
+      else if (key == "endpoint")
+      {
+        ParseEndpoint();
+      }
+      else if (key == "count")
+      {
+        endpointCount = Int();
+        fields |= COUNT;
+      }
+      else if (key == "frame")
+      {
+        frameNumber = Int();
+        fields |= FRAME;
+      }
+      else
+      {
+        SkipValue();
+      }
+    }
+    while (Accept(','));
+
+    Expect('}');
+  }
+
+  //! Extract the postion of mario: {"x": <int>, "y": <int>}.
+  void ParseMario()
+  {
+    int found = 0;
+
+    Expect('{');
+    if (!Accept('}'))
+    {
+      do
+      {
+        const boost::string_ref key = Key();
+        if (key == "x")
+        {
+          marioX = Int();
+          found |= 1;
+        }
+        else if (key == "y")
+        {
+          marioY = Int();
+          found |= 2;
+        }
+        else
+        {
+          SkipValue();
+        }
+      }
+      while (Accept(','));
+
+      Expect('}');
+    }
+
+    if (found == 3) fields |= MARIO;
+  }
+
+  //! Extract the endpoint: {"host": <string>, "port": <string or int>}.
+  void ParseEndpoint()
+  {
+    int found = 0;
+
+    Expect('{');
+    if (!Accept('}'))
+    {
+      do
+      {
+        const boost::string_ref key = Key();
+        if (key == "host")
+        {
+          Scalar(endpointHost);
+          found |= 1;
+        }
+        else if (key == "port")
+        {
+          Scalar(endpointPort);
+          found |= 2;
+        }
+        else
+        {
+          SkipValue();
+        }
+      }
+      while (Accept(','));
+
+      Expect('}');
+    }
+
+    if (found == 3) fields |= ENDPOINT;
+  }
+
+  /**
+   * Extract the tiles: {"<row>": [<int>, ...], ...}. The row keys are relative
+   * to the row of mario and are mapped to the matrix rows once the number of
+   * rows is known.
+   */
+  void ParseTiles()
+  {
+    rowKeys.clear();
+    rowOffsets.clear();
+    values.clear();
+
+    Expect('{');
+    if (!Accept('}'))
+    {
+      do
+      {
+        rowKeys.push_back(RowKey(Key()));
+        rowOffsets.push_back(values.size());
+
+        Expect('[');
+        if (!Accept(']'))
+        {
+          do
+          {
+            values.push_back(Int());
+          }
+          while (Accept(','));
+
+          Expect(']');
+        }
+      }
+      while (Accept(','));
+
+      Expect('}');
+    }
+    rowOffsets.push_back(values.size());
 
     // Create the tiles matrix.
-    tiles = arma::zeros<arma::mat>(radius, radius);
+    const int size = rowKeys.size();
+    Grid(size);
 
     // Get the radius (view field).
-    radius = std::floor(radius / 2);
+    const int radius = size / 2;
 
-    // Transform json string to armadillo matrix.
-    for (ptree::const_iterator it = pt.get_child("tiles").begin();
-        it != end; ++it)
+    for (size_t i = 0; i < rowKeys.size(); ++i)
     {
-      int index = std::stoi(it->first);
+      int index = rowKeys[i];
 
       // Map the index to the right matrix postion.
       if (index > 1)
@@ -109,7 +603,7 @@ class Parser {
         }
         else
         {
-          index = tiles.n_rows - 1;
+          index = size - 1;
         }
       }
       else
@@ -117,65 +611,434 @@ class Parser {
         index = radius;
       }
 
-      Vec(it->second, it->second.get_value<std::string>(), tiles, index);
+      const size_t length = rowOffsets[i + 1] - rowOffsets[i];
+      if (index < 0 || index >= size || length > size_t(size))
+      {
+        throw std::runtime_error("Invalid tiles row.");
+      }
+
+      for (size_t col = 0; col < length; ++col)
+      {
+        grid[col * size + index] = uint8_t(values[rowOffsets[i] + col]);
+      }
     }
+
+    fields |= TILES;
   }
 
   /**
-   * Parse the number lives.
-   *
-   * @param lives The current lives.
+   * Apply the changed tiles to the tiles of the last message:
+   * [<index>, <value>, ...]. The index is the row-major position in the tiles
+   * matrix. An empty delta is encoded as {} by cjson.
    */
-  void MarioLives(int& lives)
+  void ParseDelta()
   {
-    lives = pt.get<int>("lives");
+    CheckKeyframe();
+
+    if (Accept('{'))
+    {
+      Expect('}');
+    }
+    else
+    {
+      Expect('[');
+      if (!Accept(']'))
+      {
+        do
+        {
+          const int index = Int();
+          Expect(',');
+          ApplyDelta(index, Int());
+        }
+        while (Accept(','));
+
+        Expect(']');
+      }
+    }
+
+    fields |= TILES;
   }
 
   /**
-   * Parse the number coins.
-   *
-   * @param coins The current number of coins.
+   * Extract the observations of a trajectory: [<game info>, ...]. Every
+   * observation is a game info object; an empty trajectory is encoded as {}
+   * by cjson.
    */
-  void MarioCoins(int& coins)
+  void ParseTrajectory()
   {
-    coins = pt.get<int>("coins");
+    ClearTrajectory();
+
+    if (Accept('{'))
+    {
+      Expect('}');
+    }
+    else
+    {
+      Expect('[');
+      if (!Accept(']'))
+      {
+        do
+        {
+          ParseJSON();
+          AppendTrajectory();
+        }
+        while (Accept(','));
+
+        Expect(']');
+      }
+    }
+
+    fields |= TRAJECTORY;
   }
 
-  /**
-   * Parse the player state.
-   *
-   * @param state The current player state.
-   */
-  void PlayerState(int& state)
+  //! Remove the observations of the last trajectory, the memory is kept.
+  void ClearTrajectory()
   {
-    state = pt.get<int>("state");
+    trajectoryLength = 0;
+    trajectoryX.clear();
+    trajectoryY.clear();
+    trajectoryState.clear();
+    fields |= TRAJECTORY;
   }
 
-  /**
-   * Parse the current game image.
-   *
-   * @param image The current game image as string.
-   */
-  void GameImage(const std::string& json, std::string& image)
+  //! Store the current game info as next observation of the trajectory.
+  void AppendTrajectory()
   {
-    image = json;
+    Require(MARIO, "mario");
+    Require(STATE, "state");
+    Require(TILES, "tiles");
+
+    if (trajectoryLength == trajectoryGrids.size())
+    {
+      trajectoryGrids.push_back(std::vector<uint8_t>());
+    }
+
+    trajectoryGrids[trajectoryLength++] = grid;
+    trajectoryX.push_back(marioX);
+    trajectoryY.push_back(marioY);
+    trajectoryState.push_back(playerState);
   }
 
- private:
-  //! Store results of the given json string in the row'th of the given
-  // matrix v.
-  void Vec(const ptree& pt, const ptree::key_type& key, arma::mat& v, int row)
+  //! Throw if there are no tiles the delta could be applied to.
+  void CheckKeyframe() const
+  {
+    if (grid.empty())
+    {
+      throw std::runtime_error("Delta observation without keyframe.");
+    }
+  }
+
+  //! Set the size of the tiles and clear them, the memory is reused.
+  void Grid(const size_t size)
+  {
+    gridSize = size;
+    grid.assign(size * size, 0);
+  }
+
+  //! Convert the given tiles into a matrix.
+  void Matrix(const std::vector<uint8_t>& tiles, arma::mat& matrix) const
+  {
+    matrix.set_size(gridSize, gridSize);
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+      matrix(i) = tiles[i];
+    }
+  }
+
+  //! Set the tile at the given row-major index.
+  void ApplyDelta(const int index, const int value)
   {
-    int col = 0;
-    for (auto& item : pt.get_child(key))
+    if (index < 0 || size_t(index) >= grid.size())
     {
-      v(row, col++) = item.second.get_value<int>();
+      throw std::runtime_error("Invalid delta index.");
     }
+
+    grid[(index % gridSize) * gridSize + index / gridSize] = uint8_t(value);
   }
 
-  //! Locally stored property_tree to parse the json string.
-  ptree pt;
+  //! Convert the given row key to an integer.
+  static int RowKey(const boost::string_ref& key)
+  {
+    size_t i = 0;
+    const bool negative = !key.empty() && key[0] == '-';
+    if (negative) ++i;
+
+    if (i == key.size())
+    {
+      throw std::runtime_error("Invalid tiles row key.");
+    }
+
+    int value = 0;
+    for (; i < key.size(); ++i)
+    {
+      if (key[i] < '0' || key[i] > '9')
+      {
+        throw std::runtime_error("Invalid tiles row key.");
+      }
+
+      value = value * 10 + (key[i] - '0');
+    }
+
+    return negative ? -value : value;
+  }
+
+  //! Skip whitespace.
+  void Skip()
+  {
+    while (cursor < last && (*cursor == ' ' || *cursor == '\n' ||
+        *cursor == '\r' || *cursor == '\t'))
+    {
+      ++cursor;
+    }
+  }
+
+  //! Consume the given character if it is the next token.
+  bool Accept(const char c)
+  {
+    Skip();
+    if (cursor < last && *cursor == c)
+    {
+      ++cursor;
+      return true;
+    }
+
+    return false;
+  }
+
+  //! Consume the given character or throw.
+  void Expect(const char c)
+  {
+    if (!Accept(c))
+    {
+      throw std::runtime_error("Invalid JSON message.");
+    }
+  }
+
+  //! Parse an object key including the following colon.
+  boost::string_ref Key()
+  {
+    Expect('"');
+    const char* begin = cursor;
+    while (cursor < last && *cursor != '"')
+    {
+      if (*cursor == '\\') ++cursor;
+      ++cursor;
+    }
+
+    if (cursor >= last)
+    {
+      throw std::runtime_error("Invalid JSON message.");
+    }
+
+    const boost::string_ref key(begin, cursor - begin);
+    ++cursor;
+
+    Expect(':');
+    return key;
+  }
+
+  //! Parse a number and convert it to an integer.
+  int Int()
+  {
+    Skip();
+
+    const bool negative = cursor < last && *cursor == '-';
+    if (negative) ++cursor;
+
+    if (cursor >= last || *cursor < '0' || *cursor > '9')
+    {
+      throw std::runtime_error("Invalid JSON number.");
+    }
+
+    double value = 0;
+    for (; cursor < last && *cursor >= '0' && *cursor <= '9'; ++cursor)
+    {
+      value = value * 10 + (*cursor - '0');
+    }
+
+    // Fraction and exponent; the emulator module only sends integers.
+    if (cursor < last && *cursor == '.')
+    {
+      double scale = 0.1;
+      for (++cursor; cursor < last && *cursor >= '0' && *cursor <= '9';
+          ++cursor, scale /= 10)
+      {
+        value += (*cursor - '0') * scale;
+      }
+    }
+
+    if (cursor < last && (*cursor == 'e' || *cursor == 'E'))
+    {
+      ++cursor;
+      const bool negativeExponent = cursor < last && *cursor == '-';
+      if (cursor < last && (*cursor == '-' || *cursor == '+')) ++cursor;
+
+      int exponent = 0;
+      for (; cursor < last && *cursor >= '0' && *cursor <= '9'; ++cursor)
+      {
+        exponent = exponent * 10 + (*cursor - '0');
+      }
+
+      value *= std::pow(10.0, negativeExponent ? -exponent : exponent);
+    }
+
+    return static_cast<int>(negative ? -value : value);
+  }
+
+  //! Parse a string or a literal/number as string.
+  void Scalar(std::string& value)
+  {
+    value.clear();
+
+    if (Accept('"'))
+    {
+      while (cursor < last && *cursor != '"')
+      {
+        if (*cursor == '\\' && cursor + 1 < last)
+        {
+          ++cursor;
+          switch (*cursor)
+          {
+            case 'n': value.push_back('\n'); break;
+            case 'r': value.push_back('\r'); break;
+            case 't': value.push_back('\t'); break;
+            case 'b': value.push_back('\b'); break;
+            case 'f': value.push_back('\f'); break;
+            default: value.push_back(*cursor);
+          }
+        }
+        else
+        {
+          value.push_back(*cursor);
+        }
+
+        ++cursor;
+      }
+
+      Expect('"');
+      return;
+    }
+
+    while (cursor < last && *cursor != ',' && *cursor != '}' &&
+        *cursor != ']' && *cursor != ' ' && *cursor != '\r' &&
+        *cursor != '\n' && *cursor != '\t')
+    {
+      value.push_back(*cursor++);
+    }
+
+    if (value.empty())
+    {
+      throw std::runtime_error("Invalid JSON value.");
+    }
+  }
+
+  //! Skip a value of any type.
+  void SkipValue()
+  {
+    if (Accept('{'))
+    {
+      if (Accept('}')) return;
+
+      do
+      {
+        Key();
+        SkipValue();
+      }
+      while (Accept(','));
+
+      Expect('}');
+    }
+    else if (Accept('['))
+    {
+      if (Accept(']')) return;
+
+      do
+      {
+        SkipValue();
+      }
+      while (Accept(','));
+
+      Expect(']');
+    }
+    else
+    {
+      Scalar(skipped);
+    }
+  }
+
+  //! Locally stored attributes (see Field) extracted from the last message.
+  int fields;
+
+  //! Locally stored x coordinate of mario.
+  int marioX;
+
+  //! Locally stored y coordinate of mario.
+  int marioY;
+
+  //! Locally stored number of lives.
+  int marioLives;
+
+  //! Locally stored number of coins.
+  int marioCoins;
+
+  //! Locally stored player state.
+  int playerState;
+
+  //! Locally stored number of endpoints.
+  int endpointCount;
+
+  //! Locally stored number of the published frame.
+  int frameNumber;
+
+  //! Locally stored endpoint hostname.
+  std::string endpointHost;
+
+  //! Locally stored endpoint port.
+  std::string endpointPort;
+
+  //! Locally stored tiles in column-major order (see
+  // observation::Observation), reused between messages.
+  std::vector<uint8_t> grid;
+
+  //! Locally stored number of rows (and columns) of the tiles.
+  size_t gridSize;
+
+  //! Locally stored tiles of the trajectory observations, reused between
+  // messages.
+  std::vector<std::vector<uint8_t> > trajectoryGrids;
+
+  //! Locally stored number of trajectory observations.
+  size_t trajectoryLength;
+
+  //! Locally stored x coordinates of mario of the trajectory observations.
+  std::vector<int> trajectoryX;
+
+  //! Locally stored y coordinates of mario of the trajectory observations.
+  std::vector<int> trajectoryY;
+
+  //! Locally stored player states of the trajectory observations.
+  std::vector<int> trajectoryState;
+
+  //! Locally stored row keys of the json tiles.
+  std::vector<int> rowKeys;
+
+  //! Locally stored offsets of the json tile rows in the values buffer.
+  std::vector<size_t> rowOffsets;
+
+  //! Locally stored values of the json tile rows.
+  std::vector<int> values;
+
+  //! Locally stored buffer for skipped values.
+  std::string skipped;
+
+  //! Locally stored position of the json decoder.
+  const char* cursor;
+
+  //! Locally stored end of the json message.
+  const char* last;
 
 }; // class Parser
 
-} // namespace parser
\ No newline at end of file
+} // namespace parser
+
+#endif
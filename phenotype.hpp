@@ -0,0 +1,326 @@
+/**
+ * @file phenotype.hpp
+ * @author Marcus Edel
+ *
+ * Flat, compiled phenotype of a NEAT genome.
+ */
+#ifndef NES_PHENOTYPE_HPP
+#define NES_PHENOTYPE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include <mlpack/methods/ne/genome.hpp>
+
+namespace phenotype {
+
+/**
+ * The Phenotype is the network of a genome compiled into contiguous arrays.
+ * Genome::Activate walks the neuron and link genes and looks up the neurons
+ * by id for every link; the phenotype resolves the ids once, orders the
+ * neurons by depth and stores the weights of the incoming links of every
+ * neuron next to each other, grouped in runs of consecutive source neurons.
+ * A fully connected layer (e.g. all inputs to a hidden neuron) becomes a
+ * single dot product over two contiguous arrays.
+ *
+ * The activation follows Genome::Activate: the first NumInput neurons take
+ * the input, every other neuron with an enabled incoming link is computed in
+ * depth order from the current activations of its sources, a neuron without
+ * an enabled incoming link keeps the activation of its gene. The output is
+ * the activation of the NumOutput neurons that follow the inputs. The
+ * incoming links are summed in a different order, so the outputs may differ
+ * from Genome::Activate in the last bits; see Verify.
+ *
+ * Activate doesn't allocate, the buffers are allocated once by the
+ * constructor.
+ */
+class Phenotype
+{
+ public:
+  /**
+   * Compile the given genome.
+   *
+   * @param genome The genome to compile.
+   */
+  template<typename GenomeType>
+  explicit Phenotype(const GenomeType& genome) :
+      numInput(genome.NumInput()),
+      numOutput(genome.NumOutput())
+  {
+    const size_t numNeurons = genome.aNeuronGenes.size();
+    if (numNeurons < numInput + numOutput)
+    {
+      throw std::runtime_error("Genome has fewer neurons than inputs and "
+          "outputs.");
+    }
+
+    std::unordered_map<int64_t, uint32_t> index;
+    values.resize(numNeurons);
+    for (size_t i = 0; i < numNeurons; ++i)
+    {
+      index[genome.aNeuronGenes[i].Id()] = uint32_t(i);
+      values[i] = genome.aNeuronGenes[i].Activation();
+    }
+
+    // The enabled incoming links of every neuron as (source, weight) pairs.
+    std::vector<std::vector<std::pair<uint32_t, double> > > incoming(
+        numNeurons);
+    for (size_t i = 0; i < genome.aLinkGenes.size(); ++i)
+    {
+      if (!genome.aLinkGenes[i].Enabled()) continue;
+
+      const std::unordered_map<int64_t, uint32_t>::const_iterator from =
+          index.find(genome.aLinkGenes[i].FromNeuronId());
+      const std::unordered_map<int64_t, uint32_t>::const_iterator to =
+          index.find(genome.aLinkGenes[i].ToNeuronId());
+      if (from == index.end() || to == index.end())
+      {
+        throw std::runtime_error("Link of a missing neuron.");
+      }
+
+      // Input neurons are set by Activate and never computed.
+      if (to->second < numInput) continue;
+
+      incoming[to->second].push_back(std::make_pair(from->second,
+          genome.aLinkGenes[i].Weight()));
+    }
+
+    // Compute the neurons in depth order, neurons of the same depth in gene
+    // order.
+    std::vector<uint32_t> order;
+    for (size_t i = numInput; i < numNeurons; ++i)
+    {
+      if (!incoming[i].empty()) order.push_back(uint32_t(i));
+    }
+
+    std::stable_sort(order.begin(), order.end(),
+        [&genome](const uint32_t a, const uint32_t b)
+        {
+          return genome.aNeuronGenes[a].Depth() <
+              genome.aNeuronGenes[b].Depth();
+        });
+
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+      std::vector<std::pair<uint32_t, double> >& links = incoming[order[i]];
+      std::stable_sort(links.begin(), links.end(),
+          [](const std::pair<uint32_t, double>& a,
+             const std::pair<uint32_t, double>& b)
+          {
+            return a.first < b.first;
+          });
+
+      Neuron neuron;
+      neuron.index = order[i];
+      neuron.function = Function(genome.aNeuronGenes[order[i]].ActFuncType());
+      neuron.runBegin = uint32_t(runs.size());
+
+      for (size_t j = 0; j < links.size(); ++j)
+      {
+        // Extend the last run if the source follows the last source.
+        if (j > 0 && links[j].first == links[j - 1].first + 1)
+        {
+          ++runs.back().length;
+        }
+        else
+        {
+          Run run;
+          run.source = links[j].first;
+          run.length = 1;
+          run.weight = uint32_t(weights.size());
+          runs.push_back(run);
+        }
+
+        weights.push_back(links[j].second);
+      }
+
+      neuron.runEnd = uint32_t(runs.size());
+      neurons.push_back(neuron);
+    }
+  }
+
+  /**
+   * Activate the network using the given input.
+   *
+   * @param input The input, NumInput values.
+   */
+  void Activate(const double* input)
+  {
+    double* value = values.data();
+    std::copy(input, input + numInput, value);
+
+    const double* weight = weights.data();
+    for (size_t i = 0; i < neurons.size(); ++i)
+    {
+      const Neuron& neuron = neurons[i];
+
+      double sum = 0;
+      for (uint32_t r = neuron.runBegin; r < neuron.runEnd; ++r)
+      {
+        sum += Dot(weight + runs[r].weight, value + runs[r].source,
+            runs[r].length);
+      }
+
+      value[neuron.index] = Activation(neuron.function, sum);
+    }
+  }
+
+  //! Activate the network using the given input.
+  void Activate(const std::vector<double>& input)
+  {
+    if (input.size() != numInput)
+    {
+      throw std::runtime_error("Invalid number of inputs.");
+    }
+
+    Activate(input.data());
+  }
+
+  //! Get the output of the last activation, NumOutput values.
+  const double* Output() const { return values.data() + numInput; }
+
+  //! Get the number of inputs.
+  size_t NumInput() const { return numInput; }
+
+  //! Get the number of outputs.
+  size_t NumOutput() const { return numOutput; }
+
+  //! Get the number of computed neurons.
+  size_t NumNeurons() const { return neurons.size(); }
+
+  //! Get the number of enabled links.
+  size_t NumLinks() const { return weights.size(); }
+
+  /**
+   * Check the output of the last activation against Genome::Activate using
+   * the same input.
+   *
+   * @param genome The compiled genome.
+   * @param input The input of the last activation.
+   * @param tolerance The maximum absolute difference of an output.
+   * @return False if an output differs.
+   */
+  template<typename GenomeType>
+  bool Verify(GenomeType& genome,
+              std::vector<double> input,
+              const double tolerance = 1e-9) const
+  {
+    std::vector<double> output;
+    genome.Activate(input);
+    genome.Output(output);
+
+    if (output.size() != numOutput) return false;
+
+    for (size_t i = 0; i < numOutput; ++i)
+    {
+      if (!(std::abs(output[i] - Output()[i]) <= tolerance)) return false;
+    }
+
+    return true;
+  }
+
+ private:
+  //! The activation functions.
+  enum ActivationFunction
+  {
+    SIGMOID,
+    TANH,
+    LINEAR,
+    RELU
+  };
+
+  //! A computed neuron and the range of its runs.
+  struct Neuron
+  {
+    uint32_t index;
+    uint32_t runBegin;
+    uint32_t runEnd;
+    ActivationFunction function;
+  };
+
+  //! Links from consecutive source neurons with consecutive weights.
+  struct Run
+  {
+    uint32_t source;
+    uint32_t length;
+    uint32_t weight;
+  };
+
+  //! Get the activation function of the given gene function.
+  static ActivationFunction Function(
+      const mlpack::ne::ActivationFuncType type)
+  {
+    switch (type)
+    {
+      case mlpack::ne::TANH:
+        return TANH;
+      case mlpack::ne::LINEAR:
+        return LINEAR;
+      case mlpack::ne::RELU:
+        return RELU;
+      default:
+        return SIGMOID;
+    }
+  }
+
+  //! Apply the given activation function.
+  static double Activation(const ActivationFunction function, const double x)
+  {
+    switch (function)
+    {
+      case TANH:
+        return std::tanh(x);
+      case LINEAR:
+        return x;
+      case RELU:
+        return std::max(0.0, x);
+      default:
+        return 1.0 / (1.0 + std::exp(-x));
+    }
+  }
+
+  //! Dot product of two contiguous arrays; four independent sums, so the
+  // loop can be vectorized without reassociating a single sum.
+  static double Dot(const double* a, const double* b, const size_t n)
+  {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+      s0 += a[i] * b[i];
+      s1 += a[i + 1] * b[i + 1];
+      s2 += a[i + 2] * b[i + 2];
+      s3 += a[i + 3] * b[i + 3];
+    }
+
+    for (; i < n; ++i) s0 += a[i] * b[i];
+
+    return (s0 + s1) + (s2 + s3);
+  }
+
+  //! Locally stored number of inputs.
+  size_t numInput;
+
+  //! Locally stored number of outputs.
+  size_t numOutput;
+
+  //! Locally stored activation of every neuron, in gene order.
+  std::vector<double> values;
+
+  //! Locally stored computed neurons in depth order.
+  std::vector<Neuron> neurons;
+
+  //! Locally stored runs of all computed neurons.
+  std::vector<Run> runs;
+
+  //! Locally stored weights of all runs.
+  std::vector<double> weights;
+}; // class Phenotype
+
+} // namespace phenotype
+
+#endif
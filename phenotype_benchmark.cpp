@@ -0,0 +1,205 @@
+/**
+ * @file phenotype_benchmark.cpp
+ * @author Marcus Edel
+ *
+ * Microbenchmark of the compiled phenotype against Genome::Activate, checks
+ * that both produce the same output.
+ */
+
+#include <mlpack/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "phenotype.hpp"
+
+#include <mlpack/methods/ne/link_gene.hpp>
+#include <mlpack/methods/ne/neuron_gene.hpp>
+#include <mlpack/methods/ne/genome.hpp>
+
+using namespace mlpack::ne;
+
+//! The number of inputs (13x13 tiles and bias) and outputs of the task.
+const ssize_t numInput = 170;
+const ssize_t numOutput = 5;
+
+/**
+ * Create a random feed-forward genome with the input and output layout of the
+ * Super Mario Bros. task: every hidden neuron is connected to a random subset
+ * of the inputs and the hidden neurons of a lower depth, every output to all
+ * hidden neurons and some inputs; some links are disabled.
+ *
+ * @param id The id of the genome.
+ * @param numHidden The number of hidden neurons.
+ * @param numLinks The number of incoming links of a hidden neuron.
+ * @param rng The random number generator.
+ */
+Genome RandomGenome(const ssize_t id,
+                    const size_t numHidden,
+                    const size_t numLinks,
+                    std::mt19937& rng)
+{
+  std::uniform_real_distribution<double> weight(-1, 1);
+  std::uniform_real_distribution<double> depth(0.05, 0.95);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  const ActivationFuncType functions[] = { SIGMOID, TANH, RELU, LINEAR };
+
+  std::vector<NeuronGene> neuronGenes;
+  for (ssize_t i = 0; i < numInput - 1; ++i)
+  {
+    neuronGenes.push_back(NeuronGene(i, INPUT, LINEAR, 0, 0, 0));
+  }
+  neuronGenes.push_back(NeuronGene(numInput - 1, BIAS, LINEAR, 0, 0, 0));
+
+  for (ssize_t i = 0; i < numOutput; ++i)
+  {
+    neuronGenes.push_back(NeuronGene(numInput + i, OUTPUT, SIGMOID, 1, 0, 0));
+  }
+
+  std::vector<double> depths(numHidden);
+  for (size_t i = 0; i < numHidden; ++i)
+  {
+    depths[i] = depth(rng);
+    neuronGenes.push_back(NeuronGene(numInput + numOutput + i, HIDDEN,
+        functions[rng() % 4], depths[i], 0, 0));
+  }
+
+  std::vector<LinkGene> linkGenes;
+  ssize_t innovation = 0;
+  auto link = [&](const ssize_t from, const ssize_t to)
+  {
+    linkGenes.push_back(LinkGene(from, to, innovation++, weight(rng),
+        uniform(rng) > 0.1));
+  };
+
+  for (size_t i = 0; i < numHidden; ++i)
+  {
+    const ssize_t to = numInput + numOutput + i;
+    for (size_t j = 0; j < numLinks; ++j)
+    {
+      link(rng() % numInput, to);
+    }
+
+    for (size_t j = 0; j < numHidden; ++j)
+    {
+      if (depths[j] < depths[i] && uniform(rng) < 0.5)
+      {
+        link(numInput + numOutput + j, to);
+      }
+    }
+  }
+
+  for (ssize_t i = 0; i < numOutput; ++i)
+  {
+    for (size_t j = 0; j < numHidden; ++j)
+    {
+      link(numInput + numOutput + j, numInput + i);
+    }
+
+    for (size_t j = 0; j < 10; ++j)
+    {
+      link(rng() % numInput, numInput + i);
+    }
+  }
+
+  // Genes are stored in an arbitrary order.
+  std::shuffle(linkGenes.begin(), linkGenes.end(), rng);
+  return Genome(id, neuronGenes, linkGenes, numInput, numOutput, 0);
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc > 1 && std::string(argv[1]) == "-h")
+  {
+    std::cout << "Usage: [<genomes>] [<activations>] [<hidden neurons>] "
+              << "[<links per hidden neuron>]\n";
+    return 1;
+  }
+
+  const size_t genomes = argc > 1 ? std::atoi(argv[1]) : 50;
+  const size_t activations = argc > 2 ? std::atoi(argv[2]) : 2000;
+  const size_t numHidden = argc > 3 ? std::atoi(argv[3]) : 10;
+  const size_t numLinks = argc > 4 ? std::atoi(argv[4]) : 170;
+
+  std::mt19937 rng(1);
+
+  // Observations with the tile values of the game (0-3) and the bias.
+  std::vector<std::vector<double> > inputs(activations,
+      std::vector<double>(numInput, 1.0));
+  for (size_t i = 0; i < activations; ++i)
+  {
+    for (ssize_t j = 0; j < numInput - 1; ++j)
+    {
+      inputs[i][j] = rng() % 4;
+    }
+  }
+
+  double graphTime = 0;
+  double compiledTime = 0;
+  double compileTime = 0;
+  double difference = 0;
+  size_t mismatches = 0;
+  size_t links = 0;
+
+  std::vector<double> output;
+  for (size_t g = 0; g < genomes; ++g)
+  {
+    Genome genome = RandomGenome(g, numHidden, numLinks, rng);
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    phenotype::Phenotype network(genome);
+    compileTime += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    links += network.NumLinks();
+
+    // Check every output against the genome.
+    for (size_t i = 0; i < activations; ++i)
+    {
+      network.Activate(inputs[i]);
+      if (!network.Verify(genome, inputs[i])) ++mismatches;
+    }
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < activations; ++i)
+    {
+      genome.Activate(inputs[i]);
+      genome.Output(output);
+      difference += output[i % numOutput];
+    }
+    graphTime += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < activations; ++i)
+    {
+      network.Activate(inputs[i].data());
+      difference -= network.Output()[i % numOutput];
+    }
+    compiledTime += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+
+  const double total = double(genomes) * activations;
+  std::cout << std::fixed << std::setprecision(2)
+            << "Genomes: " << genomes << " (" << numHidden << " hidden, "
+            << (genomes ? links / genomes : 0) << " enabled links)"
+            << std::endl
+            << "Activations: " << size_t(total) << std::endl
+            << "Genome::Activate (us): " << (graphTime / total * 1e6)
+            << std::endl
+            << "Phenotype::Activate (us): " << (compiledTime / total * 1e6)
+            << std::endl
+            << "Compile (us): " << (genomes ? compileTime / genomes * 1e6 : 0)
+            << std::endl
+            << "Speedup: " << (graphTime / compiledTime) << "x" << std::endl
+            << "Mismatches: " << mismatches << " (summed output difference "
+            << std::scientific << difference << ")" << std::endl;
+
+  return mismatches == 0 ? 0 : 1;
+}
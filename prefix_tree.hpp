@@ -0,0 +1,261 @@
+/**
+ * @file prefix_tree.hpp
+ * @author Marcus Edel
+ *
+ * Tree of the observations reached by action prefixes, used to skip the
+ * shared beginning of the episodes.
+ */
+#ifndef NES_PREFIX_TREE_HPP
+#define NES_PREFIX_TREE_HPP
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+namespace prefix {
+
+/**
+ * The PrefixTree stores the observation reached by every played action prefix
+ * of an emulator session. Every episode starts from the same savestate and
+ * the emulator is deterministic, so an episode that chooses the same actions
+ * as an earlier episode gets the same observations; those steps are taken
+ * from the tree without asking the emulator. Once an episode chooses an
+ * action that wasn't played before, the emulator has to be brought into the
+ * state of the current node: the tree keeps savestate slots of the emulator
+ * for some nodes, the nearest saved ancestor is loaded and the remaining
+ * actions are replayed (see Anchor).
+ *
+ * The root is the observation after the reset. Nodes are only added up to
+ * the given depth and the given number of nodes; once full, the tree should be
+ * cleared, so the prefixes of the current population are recorded.
+ */
+template<typename StateType>
+class PrefixTree
+{
+ public:
+  //! Index of a missing node.
+  static const size_t NONE = size_t(-1);
+
+  //! The largest savestate slot of the binary protocol.
+  static const int MAX_SLOT = 65535;
+
+  /**
+   * Create the PrefixTree object.
+   *
+   * @param maxDepth The maximum number of steps of a recorded prefix.
+   * @param maxNodes The maximum number of nodes.
+   * @param slotInterval Save every slotInterval'th step of a prefix into a
+   *        savestate slot.
+   * @param maxSlots The maximum number of savestate slots.
+   */
+  PrefixTree(const size_t maxDepth = 300,
+             const size_t maxNodes = 20000,
+             const size_t slotInterval = 10,
+             const size_t maxSlots = 64) :
+      maxDepth(maxDepth),
+      maxNodes(maxNodes),
+      slotInterval(std::max(slotInterval, size_t(1))),
+      maxSlots(maxSlots),
+      nextSlot(1)
+  {
+    /* Nothing to do here */
+  }
+
+  //! Return true if the observation after the reset isn't known yet.
+  bool Empty() const { return nodes.empty(); }
+
+  //! Return true if the tree reached the maximum number of nodes.
+  bool Full() const { return nodes.size() >= maxNodes; }
+
+  //! Get the number of nodes.
+  size_t Size() const { return nodes.size(); }
+
+  /**
+   * Set the observation after the reset; all nodes are removed.
+   *
+   * @param state The observation after the reset.
+   * @return The slots that have to be discarded on the emulator.
+   */
+  std::vector<int> Root(const StateType& state)
+  {
+    std::vector<int> slots = Clear();
+    nodes.push_back(Node(state, NONE, 0, 0));
+    return slots;
+  }
+
+  /**
+   * Remove all nodes.
+   *
+   * @return The slots that have to be discarded on the emulator.
+   */
+  std::vector<int> Clear()
+  {
+    std::vector<int> slots = Forget();
+    nodes.clear();
+    nextSlot = 1;
+    return slots;
+  }
+
+  //! Get the observation of the given node.
+  const StateType& State(const size_t node) const { return nodes[node].state; }
+
+  //! Get the number of steps from the root to the given node.
+  size_t Depth(const size_t node) const { return nodes[node].depth; }
+
+  /**
+   * Get the node reached by the given action from the given node.
+   *
+   * @return The child or NONE if the action wasn't played yet.
+   */
+  size_t Child(const size_t node, const uint8_t action) const
+  {
+    const std::vector<std::pair<uint8_t, size_t> >& children =
+        nodes[node].children;
+    for (size_t i = 0; i < children.size(); ++i)
+    {
+      if (children[i].first == action) return children[i].second;
+    }
+
+    return NONE;
+  }
+
+  /**
+   * Add the observation reached by the given action from the given node.
+   *
+   * @return The new node or NONE if the tree is full or the prefix too long.
+   */
+  size_t Add(const size_t node, const uint8_t action, const StateType& state)
+  {
+    if (Full() || nodes[node].depth >= maxDepth) return NONE;
+
+    nodes.push_back(Node(state, node, action, nodes[node].depth + 1));
+    nodes[node].children.push_back(std::make_pair(action, nodes.size() - 1));
+    return nodes.size() - 1;
+  }
+
+  //! Get the savestate slot of the given node, 0 if the node isn't saved.
+  int Slot(const size_t node) const { return nodes[node].slot; }
+
+  /**
+   * Get the slot the state of the given node should be saved into, right
+   * before the next step from the node is played.
+   *
+   * @return The slot or 0 if the node shouldn't be saved.
+   */
+  int Save(const size_t node)
+  {
+    Node& current = nodes[node];
+    if (current.slot != 0 || current.depth == 0 ||
+        current.depth % slotInterval != 0 || saved.size() >= maxSlots ||
+        nextSlot > MAX_SLOT)
+    {
+      return 0;
+    }
+
+    current.slot = nextSlot++;
+    saved.push_back(node);
+    return current.slot;
+  }
+
+  /**
+   * Get the nearest ancestor of the given node (or the node itself) that has a
+   * savestate slot, the root if there is none.
+   *
+   * @param node The node the emulator should be brought into.
+   * @param actions The actions from the ancestor to the node.
+   * @return The ancestor.
+   */
+  size_t Anchor(size_t node, std::vector<uint8_t>& actions) const
+  {
+    actions.clear();
+    while (nodes[node].slot == 0 && nodes[node].parent != NONE)
+    {
+      actions.push_back(nodes[node].action);
+      node = nodes[node].parent;
+    }
+
+    std::reverse(actions.begin(), actions.end());
+    return node;
+  }
+
+  /**
+   * Forget all savestate slots, e.g. if the emulator lost them; the
+   * observations are kept.
+   *
+   * @return The forgotten slots.
+   */
+  std::vector<int> Forget()
+  {
+    std::vector<int> slots;
+    for (size_t i = 0; i < saved.size(); ++i)
+    {
+      slots.push_back(nodes[saved[i]].slot);
+      nodes[saved[i]].slot = 0;
+    }
+
+    saved.clear();
+    return slots;
+  }
+
+ private:
+  //! A node of the tree.
+  struct Node
+  {
+    Node(const StateType& state,
+         const size_t parent,
+         const uint8_t action,
+         const size_t depth) :
+        state(state),
+        parent(parent),
+        action(action),
+        depth(depth),
+        slot(0)
+    {
+      /* Nothing to do here */
+    }
+
+    //! The observation of the node.
+    StateType state;
+
+    //! The parent node, NONE for the root.
+    size_t parent;
+
+    //! The action that leads from the parent to the node.
+    uint8_t action;
+
+    //! The number of steps from the root.
+    size_t depth;
+
+    //! The savestate slot, 0 if the node isn't saved.
+    int slot;
+
+    //! The (action, node) pairs of the played actions.
+    std::vector<std::pair<uint8_t, size_t> > children;
+  };
+
+  //! Locally stored maximum depth of a prefix.
+  size_t maxDepth;
+
+  //! Locally stored maximum number of nodes.
+  size_t maxNodes;
+
+  //! Locally stored number of steps between two saved nodes.
+  size_t slotInterval;
+
+  //! Locally stored maximum number of savestate slots.
+  size_t maxSlots;
+
+  //! Locally stored next savestate slot.
+  int nextSlot;
+
+  //! Locally stored nodes.
+  std::vector<Node> nodes;
+
+  //! Locally stored nodes that have a savestate slot.
+  std::vector<size_t> saved;
+}; // class PrefixTree
+
+} // namespace prefix
+
+#endif
@@ -0,0 +1,294 @@
+/**
+ * @file racing.hpp
+ * @author Marcus Edel
+ *
+ * Racing-style early termination of episodes that can't reach the top
+ * genomes of the last generation.
+ */
+#ifndef NES_RACING_HPP
+#define NES_RACING_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+namespace racing {
+
+/**
+ * The Racing object decides whether an episode is hopeless. The progress
+ * (max x position) of every episode is sampled every interval steps; the
+ * curves of the finished episodes of the last generations tell how much
+ * progress an episode that reached a checkpoint still made afterwards. An
+ * episode is cut at a checkpoint if its progress plus the given quantile of
+ * these gains doesn't reach the progress of the k'th best episode of the last
+ * generation.
+ *
+ * The k'th best progress and the gains are computed once all episodes of a
+ * generation are finished and don't change during the next generation, so
+ * whether an episode is cut doesn't depend on the order in which the
+ * episodes of a generation finish. The gains are only taken from episodes
+ * that weren't cut, and only checkpoints with enough samples are used, so
+ * the first generation is always played completely. Genomes that aren't
+ * played again (e.g. cached elites) keep their curve in the statistics as
+ * long as they are part of a kept generation. Record, Hopeless and Drop can
+ * be called from several threads.
+ */
+class Racing
+{
+ public:
+  /**
+   * Create the Racing object.
+   *
+   * @param populationSize The number of episodes of a generation.
+   * @param topK The number of best episodes of a generation an episode has to
+   *        be able to reach; 0 disables the cut.
+   * @param quantile The quantile of the gains used as the optimistic gain of
+   *        an episode, 1 uses the largest gain.
+   * @param minSamples The minimum number of gains of a checkpoint.
+   * @param interval The number of steps between two checkpoints.
+   * @param generations The number of finished generations whose curves are
+   *        used.
+   */
+  Racing(const size_t populationSize,
+         const size_t topK = 15,
+         const double quantile = 1,
+         const size_t minSamples = 30,
+         const size_t interval = 10,
+         const size_t generations = 2) :
+      populationSize(std::max(populationSize, size_t(1))),
+      topK(topK),
+      quantile(std::min(std::max(quantile, 0.0), 1.0)),
+      minSamples(std::max(minSamples, size_t(1))),
+      interval(std::max(interval, size_t(1))),
+      generations(std::max(generations, size_t(1))),
+      episodes(0),
+      threshold(-1)
+  {
+    history.push_back(std::vector<std::shared_ptr<Curve> >());
+  }
+
+  //! Get the number of steps between two checkpoints.
+  size_t Interval() const { return interval; }
+
+  //! Get the number of checkpoints of the longest episode of the finished
+  // generations, used to reserve the curve of an episode.
+  size_t Checkpoints()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bounds.size();
+  }
+
+  /**
+   * Check whether the episode with the given progress at the given
+   * checkpoint can't reach the top-k of the last generation.
+   *
+   * @param checkpoint The checkpoint (step / interval).
+   * @param progress The max x position of the episode at the checkpoint.
+   */
+  bool Hopeless(const size_t checkpoint, const int progress)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (topK == 0 || threshold < 0) return false;
+    if (checkpoint >= bounds.size() || bounds[checkpoint] < 0) return false;
+
+    return progress + bounds[checkpoint] < threshold;
+  }
+
+  /**
+   * Record a finished episode.
+   *
+   * @param genome The hash of the genome.
+   * @param progress The final max x position of the episode.
+   * @param curve The max x position at every checkpoint.
+   */
+  void Record(const uint64_t genome,
+              const int progress,
+              const std::vector<int>& curve)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Best(progress);
+
+    if (!curve.empty())
+    {
+      std::shared_ptr<Curve> played(new Curve(progress, curve));
+      history.back().push_back(played);
+      curves[genome] = played;
+    }
+
+    Finished();
+  }
+
+  /**
+   * Record a genome that wasn't played (e.g. a cached genome); the curve of
+   * the last episode of the genome is used if it is still known.
+   *
+   * @param genome The hash of the genome.
+   * @param progress The final max x position of the genome.
+   */
+  void Record(const uint64_t genome, const int progress)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Best(progress);
+
+    const std::unordered_map<uint64_t, std::weak_ptr<Curve> >::const_iterator
+        it = curves.find(genome);
+    std::shared_ptr<Curve> played;
+    if (it != curves.end() && (played = it->second.lock()))
+    {
+      history.back().push_back(played);
+    }
+
+    Finished();
+  }
+
+  //! Count an episode that was cut or failed; its curve isn't recorded.
+  void Drop()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Finished();
+  }
+
+ private:
+  //! The progress curve of a finished episode.
+  struct Curve
+  {
+    Curve(const int progress, const std::vector<int>& checkpoints) :
+        progress(progress),
+        checkpoints(checkpoints)
+    {
+      /* Nothing to do here */
+    }
+
+    //! The final max x position.
+    int progress;
+
+    //! The max x position at every checkpoint.
+    std::vector<int> checkpoints;
+  };
+
+  //! Insert the given final position into the best positions.
+  void Best(const int progress)
+  {
+    best.insert(std::upper_bound(best.begin(), best.end(), progress,
+        std::greater<int>()), progress);
+    if (best.size() > topK) best.resize(topK);
+  }
+
+  //! Count a finished episode and start the next generation once all
+  // episodes of the generation are finished; the threshold and the bounds
+  // of the next generation are taken from the finished generations.
+  void Finished()
+  {
+    if (++episodes < populationSize) return;
+
+    episodes = 0;
+    threshold = best.size() < topK ? -1 : best[topK - 1];
+    best.clear();
+
+    while (history.size() > generations) history.pop_front();
+    Bounds();
+    history.push_back(std::vector<std::shared_ptr<Curve> >());
+
+    // Forget the genomes whose curve isn't part of a kept generation.
+    for (std::unordered_map<uint64_t, std::weak_ptr<Curve> >::iterator it =
+        curves.begin(); it != curves.end();)
+    {
+      if (it->second.expired())
+      {
+        it = curves.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  //! Compute the optimistic gain of every checkpoint, -1 if the checkpoint
+  // has too few samples.
+  void Bounds()
+  {
+    std::vector<std::vector<int> > gains;
+    for (size_t g = 0; g < history.size(); ++g)
+    {
+      for (size_t i = 0; i < history[g].size(); ++i)
+      {
+        const Curve& curve = *history[g][i];
+        if (curve.checkpoints.size() > gains.size())
+        {
+          gains.resize(curve.checkpoints.size());
+        }
+
+        for (size_t c = 0; c < curve.checkpoints.size(); ++c)
+        {
+          gains[c].push_back(curve.progress - curve.checkpoints[c]);
+        }
+      }
+    }
+
+    bounds.assign(gains.size(), -1);
+    for (size_t c = 0; c < gains.size(); ++c)
+    {
+      if (gains[c].size() < minSamples) continue;
+
+      const size_t k = std::min(gains[c].size() - 1, size_t(std::ceil(
+          quantile * (gains[c].size() - 1))));
+      std::nth_element(gains[c].begin(), gains[c].begin() + k,
+          gains[c].end());
+      bounds[c] = gains[c][k];
+    }
+  }
+
+  //! Locally stored number of episodes of a generation.
+  size_t populationSize;
+
+  //! Locally stored number of best episodes an episode has to reach.
+  size_t topK;
+
+  //! Locally stored quantile of the gains.
+  double quantile;
+
+  //! Locally stored minimum number of gains of a checkpoint.
+  size_t minSamples;
+
+  //! Locally stored number of steps between two checkpoints.
+  size_t interval;
+
+  //! Locally stored number of finished generations whose curves are used.
+  size_t generations;
+
+  //! Locally stored number of finished episodes of the current generation.
+  size_t episodes;
+
+  //! Locally stored final positions of the best episodes of the current
+  // generation, in descending order.
+  std::vector<int> best;
+
+  //! Locally stored final position of the k'th best episode of the last
+  // generation, -1 if the last generation had fewer episodes.
+  int threshold;
+
+  //! Locally stored curves of the finished and the current (last)
+  // generation.
+  std::deque<std::vector<std::shared_ptr<Curve> > > history;
+
+  //! Locally stored curve of every genome of the kept generations.
+  std::unordered_map<uint64_t, std::weak_ptr<Curve> > curves;
+
+  //! Locally stored optimistic gain of every checkpoint, computed from the
+  // finished generations.
+  std::vector<int> bounds;
+
+  //! Locally stored mutex that guards all members.
+  std::mutex mutex;
+}; // class Racing
+
+} // namespace racing
+
+#endif
@@ -0,0 +1,539 @@
+/**
+ * @file registry.hpp
+ * @author Marcus Edel
+ *
+ * Endpoint registry of the balancer with lock-free lookups.
+ */
+#ifndef NES_REGISTRY_HPP
+#define NES_REGISTRY_HPP
+
+#include "endpoint.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+namespace registry {
+
+/**
+ * The Registry holds the emulator endpoints of the balancer. Every emulator
+ * serves a single client, so endpoints are leased by a balancer connection
+ * and only free endpoints are handed out. A lease ends with an explicit
+ * release, with the connection that holds it, or if it isn't renewed within
+ * the lease timeout.
+ *
+ * The endpoint list is an immutable snapshot that is replaced as a whole by
+ * Add and Remove (read-copy-update); the updates are serialized by a mutex.
+ * Lease, Release, Renew and Size never take a lock: a reader announces the
+ * snapshot it uses in its own hazard slot, and a replaced snapshot is only
+ * deleted once no slot refers to it. The lease state of an endpoint lives in
+ * atomics shared by all snapshots that contain the endpoint, so a lease is a
+ * single compare-and-swap. Every thread uses its own slot and round-robin
+ * cursor, so concurrent gets only touch the endpoints they lease.
+ */
+class Registry
+{
+ public:
+  /**
+   * Create an empty registry.
+   *
+   * @param readers The number of threads that access the registry.
+   * @param leaseTimeout The time after that a lease expires if it isn't
+   *        renewed in seconds.
+   * @param maxFailures The number of failed probes after that an endpoint is
+   *        dropped.
+   */
+  Registry(const size_t readers,
+           const int leaseTimeout,
+           const size_t maxFailures) :
+      slots(new Slot[readers]),
+      numSlots(readers),
+      nextSlot(0),
+      leaseTimeout(leaseTimeout),
+      maxFailures(maxFailures),
+      owners(0),
+      current(new Snapshot())
+  {
+    for (size_t i = 0; i < numSlots; ++i)
+    {
+      slots[i].snapshot.store(nullptr);
+      slots[i].cursor = i;
+    }
+  }
+
+  Registry(const Registry&) = delete;
+  Registry& operator=(const Registry&) = delete;
+
+  //! Delete the snapshots.
+  ~Registry()
+  {
+    delete current.load();
+    for (size_t i = 0; i < retired.size(); ++i)
+    {
+      delete retired[i];
+    }
+  }
+
+  //! Get a new lease owner id.
+  size_t Owner() { return ++owners; }
+
+  //! Add the given endpoint.
+  void Add(const std::string& hostData, const std::string& portData)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const Snapshot* snapshot = current.load();
+    if (Find(*snapshot, hostData, portData)) return;
+
+    Snapshot* next = new Snapshot(*snapshot);
+    next->push_back(std::make_shared<Endpoint>(hostData, portData));
+    Publish(next);
+
+    std::cout << "Add endpoint: " << endpoint::Name(hostData, portData)
+              << std::endl;
+  }
+
+  //! Remove the given endpoint.
+  void Remove(const std::string& hostData, const std::string& portData)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const Snapshot* snapshot = current.load();
+    if (!Find(*snapshot, hostData, portData)) return;
+
+    Snapshot* next = new Snapshot();
+    for (size_t i = 0; i < snapshot->size(); ++i)
+    {
+      const Endpoint& entry = *(*snapshot)[i];
+      if (entry.host != hostData || entry.port != portData)
+      {
+        next->push_back((*snapshot)[i]);
+      }
+    }
+    Publish(next);
+
+    std::cout << "Remove endpoint: " << endpoint::Name(hostData, portData)
+              << std::endl;
+  }
+
+  /**
+   * Lease the next free endpoint, returns false if no endpoint is free. A
+   * probed endpoint is free as well: the probe only checks an idle emulator,
+   * so it must not take the endpoint away from a client.
+   *
+   * @param owner The connection that holds the lease.
+   * @param hostData The host name of the leased endpoint.
+   * @param portData The port of the leased endpoint.
+   */
+  bool Lease(const size_t owner, std::string& hostData, std::string& portData)
+  {
+    Reader reader(*this);
+    const Snapshot& snapshot = reader.Endpoints();
+    size_t& cursor = reader.Cursor();
+
+    for (size_t i = 0; i < snapshot.size(); ++i)
+    {
+      cursor = cursor + 1 >= snapshot.size() ? 0 : cursor + 1;
+
+      Endpoint& entry = *snapshot[cursor];
+      size_t free = FREE;
+      if (!entry.owner.compare_exchange_strong(free, owner))
+      {
+        free = PROBING;
+        if (!entry.owner.compare_exchange_strong(free, owner)) continue;
+      }
+
+      entry.expires.store(Deadline());
+      hostData = entry.host;
+      portData = entry.port;
+      return true;
+    }
+
+    return false;
+  }
+
+  //! Release the given endpoint if the lease is held by the given owner.
+  void Release(const size_t owner,
+               const std::string& hostData,
+               const std::string& portData)
+  {
+    Reader reader(*this);
+    Endpoint* endpoint = Find(reader.Endpoints(), hostData, portData);
+    if (endpoint) Free(*endpoint, owner);
+  }
+
+  //! Release all leases held by the given owner.
+  void Release(const size_t owner)
+  {
+    Reader reader(*this);
+    const Snapshot& snapshot = reader.Endpoints();
+    for (size_t i = 0; i < snapshot.size(); ++i)
+    {
+      Free(*snapshot[i], owner);
+    }
+  }
+
+  //! Renew all leases held by the given owner.
+  void Renew(const size_t owner)
+  {
+    const int64_t expires = Deadline();
+
+    Reader reader(*this);
+    const Snapshot& snapshot = reader.Endpoints();
+    for (size_t i = 0; i < snapshot.size(); ++i)
+    {
+      if (snapshot[i]->owner.load() == owner)
+      {
+        snapshot[i]->expires.store(expires);
+      }
+    }
+  }
+
+  //! Release all leases that weren't renewed in time and delete the replaced
+  // snapshots that are no longer used.
+  void Expire()
+  {
+    const int64_t now = Now();
+
+    {
+      Reader reader(*this);
+      const Snapshot& snapshot = reader.Endpoints();
+      for (size_t i = 0; i < snapshot.size(); ++i)
+      {
+        Endpoint& entry = *snapshot[i];
+        size_t owner = entry.owner.load();
+        int64_t expires = entry.expires.load();
+        if (owner == FREE || owner == PROBING || expires > now) continue;
+
+        // Only the thread that resets the deadline frees the endpoint; the
+        // deadline changes if the lease is renewed or taken by another owner
+        // in the meantime.
+        if (!entry.expires.compare_exchange_strong(expires, NEVER))
+        {
+          continue;
+        }
+
+        if (entry.owner.compare_exchange_strong(owner, FREE))
+        {
+          std::cout << "Lease expired: " << endpoint::Name(entry.host,
+              entry.port) << std::endl;
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Reclaim();
+  }
+
+  /**
+   * Mark all free endpoints as probed. A probed endpoint can still be leased,
+   * the probe result of an endpoint that was leased in the meantime is
+   * ignored (see FinishProbe).
+   *
+   * @param probes The host names and ports of the marked endpoints.
+   */
+  void StartProbes(std::vector<std::pair<std::string, std::string> >& probes)
+  {
+    probes.clear();
+
+    Reader reader(*this);
+    const Snapshot& snapshot = reader.Endpoints();
+    for (size_t i = 0; i < snapshot.size(); ++i)
+    {
+      size_t free = FREE;
+      if (snapshot[i]->owner.compare_exchange_strong(free, PROBING))
+      {
+        probes.push_back(std::make_pair(snapshot[i]->host,
+            snapshot[i]->port));
+      }
+    }
+  }
+
+  //! Store the probe result, endpoints that failed too often are dropped. The
+  // result is ignored if the endpoint was leased during the probe, since the
+  // emulator serves a single client and doesn't answer the probe once a client
+  // is connected.
+  void FinishProbe(const std::string& hostData,
+                   const std::string& portData,
+                   const bool alive)
+  {
+    size_t failures = 0;
+    {
+      Reader reader(*this);
+      Endpoint* endpoint = Find(reader.Endpoints(), hostData, portData);
+      if (!endpoint) return;
+
+      size_t probing = PROBING;
+      if (!endpoint->owner.compare_exchange_strong(probing, FREE)) return;
+
+      if (alive)
+      {
+        endpoint->failures.store(0);
+      }
+      else
+      {
+        failures = ++endpoint->failures;
+      }
+    }
+
+    if (failures >= maxFailures)
+    {
+      Remove(hostData, portData);
+    }
+  }
+
+  /**
+   * Check whether the given endpoint is leased, a probed endpoint isn't.
+   *
+   * @param hostData The host name of the endpoint.
+   * @param portData The port of the endpoint.
+   * @param leased Set to true if the endpoint is leased.
+   * @return False if the endpoint isn't registered.
+   */
+  bool Leased(const std::string& hostData,
+              const std::string& portData,
+              bool& leased)
+  {
+    Reader reader(*this);
+    const Endpoint* endpoint = Find(reader.Endpoints(), hostData, portData);
+    if (!endpoint) return false;
+
+    const size_t owner = endpoint->owner.load();
+    leased = owner != FREE && owner != PROBING;
+    return true;
+  }
+
+  //! Get the number of endpoints.
+  size_t Size()
+  {
+    Reader reader(*this);
+    return reader.Endpoints().size();
+  }
+
+ private:
+  //! The owner of a free endpoint.
+  static const size_t FREE = 0;
+
+  //! The owner of a probed endpoint.
+  static const size_t PROBING = std::numeric_limits<size_t>::max();
+
+  //! The deadline of an endpoint that isn't leased.
+  static const int64_t NEVER = std::numeric_limits<int64_t>::max();
+
+  //! A registered endpoint and its lease.
+  struct Endpoint
+  {
+    Endpoint(const std::string& host, const std::string& port) :
+        host(host), port(port), owner(FREE), expires(NEVER), failures(0)
+    {
+      /* Nothing to do here */
+    }
+
+    //! The host name of the endpoint.
+    const std::string host;
+
+    //! The port of the endpoint, empty for unix domain sockets.
+    const std::string port;
+
+    //! The connection that holds the lease, FREE or PROBING.
+    std::atomic<size_t> owner;
+
+    //! The time the lease expires, NEVER if the endpoint isn't leased.
+    std::atomic<int64_t> expires;
+
+    //! The number of consecutive failed probes.
+    std::atomic<size_t> failures;
+  };
+
+  //! An immutable list of endpoints.
+  typedef std::vector<std::shared_ptr<Endpoint> > Snapshot;
+
+  //! The hazard slot and round-robin cursor of a thread; padded, so the slots
+  // of different threads don't share a cache line.
+  struct Slot
+  {
+    std::atomic<const Snapshot*> snapshot;
+    size_t cursor;
+    char padding[128 - sizeof(std::atomic<const Snapshot*>) - sizeof(size_t)];
+  };
+
+  /**
+   * Protects the current snapshot as long as the reader exists; the
+   * snapshot of a thread is announced in the slot of the thread.
+   */
+  class Reader
+  {
+   public:
+    //! Announce and get the current snapshot.
+    explicit Reader(Registry& registry) : slot(registry.ThreadSlot())
+    {
+      const Snapshot* snapshot = registry.current.load();
+      while (true)
+      {
+        slot.snapshot.store(snapshot);
+
+        // The snapshot is safe once it's still current after it was
+        // announced, a writer that replaces it afterwards sees the slot.
+        const Snapshot* check = registry.current.load();
+        if (check == snapshot) break;
+        snapshot = check;
+      }
+
+      endpoints = snapshot;
+    }
+
+    //! Release the snapshot.
+    ~Reader()
+    {
+      slot.snapshot.store(nullptr, std::memory_order_release);
+    }
+
+    //! Get the protected snapshot.
+    const Snapshot& Endpoints() const { return *endpoints; }
+
+    //! Get the round-robin cursor of the thread.
+    size_t& Cursor() { return slot.cursor; }
+
+   private:
+    //! Locally stored slot of the thread.
+    Slot& slot;
+
+    //! Locally stored protected snapshot.
+    const Snapshot* endpoints;
+  };
+
+  //! Get the slot of the calling thread.
+  Slot& ThreadSlot()
+  {
+    // The slot is assigned once per thread; a thread that reads the registry
+    // keeps it for its lifetime.
+    thread_local const Registry* owner = nullptr;
+    thread_local size_t index = 0;
+
+    if (owner != this)
+    {
+      index = nextSlot++;
+      if (index >= numSlots)
+      {
+        throw std::runtime_error("Too many registry reader threads.");
+      }
+
+      owner = this;
+    }
+
+    return slots[index];
+  }
+
+  //! Replace the current snapshot, the caller holds the mutex.
+  void Publish(const Snapshot* next)
+  {
+    retired.push_back(current.exchange(next));
+    Reclaim();
+  }
+
+  //! Delete the replaced snapshots that no reader uses, the caller holds the
+  // mutex.
+  void Reclaim()
+  {
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); ++i)
+    {
+      bool used = false;
+      for (size_t j = 0; j < numSlots && !used; ++j)
+      {
+        used = slots[j].snapshot.load() == retired[i];
+      }
+
+      if (used)
+      {
+        retired[kept++] = retired[i];
+      }
+      else
+      {
+        delete retired[i];
+      }
+    }
+
+    retired.resize(kept);
+  }
+
+  //! Free the given endpoint if the lease is held by the given owner.
+  static void Free(Endpoint& endpoint, size_t owner)
+  {
+    if (endpoint.owner.load() != owner) return;
+
+    // Reset the deadline first, the next lease sets its own deadline once the
+    // endpoint is free.
+    endpoint.expires.store(NEVER);
+    endpoint.owner.compare_exchange_strong(owner, FREE);
+  }
+
+  //! Find the given endpoint in the given snapshot.
+  static Endpoint* Find(const Snapshot& snapshot,
+                        const std::string& hostData,
+                        const std::string& portData)
+  {
+    for (size_t i = 0; i < snapshot.size(); ++i)
+    {
+      if (snapshot[i]->host == hostData && snapshot[i]->port == portData)
+      {
+        return snapshot[i].get();
+      }
+    }
+
+    return nullptr;
+  }
+
+  //! Get the current time.
+  static int64_t Now()
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  //! Get the deadline of a lease that starts now.
+  int64_t Deadline() const
+  {
+    return Now() + int64_t(leaseTimeout) * 1000;
+  }
+
+  //! Locally stored hazard slots of the reader threads.
+  std::unique_ptr<Slot[]> slots;
+
+  //! Locally stored number of slots.
+  size_t numSlots;
+
+  //! Locally stored index of the next unassigned slot.
+  std::atomic<size_t> nextSlot;
+
+  //! Locally stored lease timeout in seconds.
+  int leaseTimeout;
+
+  //! Locally stored number of failed probes after that an endpoint is
+  // dropped.
+  size_t maxFailures;
+
+  //! Locally stored last lease owner id.
+  std::atomic<size_t> owners;
+
+  //! Locally stored current snapshot.
+  std::atomic<const Snapshot*> current;
+
+  //! Locally stored replaced snapshots that may still be read.
+  std::vector<const Snapshot*> retired;
+
+  //! Locally stored mutex that serializes the updates.
+  std::mutex mutex;
+}; // class Registry
+
+} // namespace registry
+
+#endif
@@ -0,0 +1,497 @@
+/**
+ * @file replay.cpp
+ * @author Marcus Edel
+ *
+ * Load generator that replays a message trace (see trace.hpp) against the
+ * emulators, either through the balancer or directly against an emulator.
+ */
+
+#include <mlpack/core.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.hpp"
+#include "client.hpp"
+#include "messages.hpp"
+#include "session.hpp"
+
+/**
+ * The messages of a single traced emulator connection.
+ */
+struct Stream
+{
+  //! The start of the stream in microseconds since the start of the trace.
+  uint64_t start;
+
+  //! The end of the stream in microseconds since the start of the trace.
+  uint64_t end;
+
+  //! The protocol the stream switches to.
+  messages::Protocol protocol;
+
+  //! The send and receive events, without the protocol switch.
+  std::vector<const trace::Event*> events;
+
+  //! The index of the request of every receive event, the size of the events
+  // for unmatched replies.
+  std::vector<size_t> requests;
+};
+
+/**
+ * The latencies of a message kind.
+ */
+struct KindResult
+{
+  //! The traced latency of every request in microseconds.
+  std::vector<double> traced;
+
+  //! The replayed latency of every request in microseconds.
+  std::vector<double> replayed;
+};
+
+/**
+ * The result of a single replay worker.
+ */
+struct WorkerResult
+{
+  WorkerResult() :
+      streams(0),
+      messages(0),
+      errors(0),
+      mismatches(0)
+  {
+    /* Nothing to do here */
+  }
+
+  //! The latencies by request kind.
+  std::map<std::string, KindResult> kinds;
+
+  //! The number of replayed streams.
+  size_t streams;
+
+  //! The number of sent messages.
+  size_t messages;
+
+  //! The number of failed streams.
+  size_t errors;
+
+  //! The number of replies of another kind than the traced reply.
+  size_t mismatches;
+};
+
+/**
+ * Split the given events into the streams of the emulator connections. The
+ * balancer connections are skipped, the session leases the endpoints itself.
+ *
+ * A request kind is answered if a request of the kind is directly followed by
+ * a reply; the replies are matched with the answered requests in order, so
+ * the pipelined requests of the asynchronous client are matched as well.
+ *
+ * @param events The trace events.
+ * @param streams The streams ordered by start time.
+ */
+void Streams(const std::vector<trace::Event>& events,
+             std::vector<Stream>& streams)
+{
+  std::map<size_t, Stream> connections;
+
+  // The connections that wait for the acknowledgement of the protocol switch.
+  std::set<size_t> switches;
+  for (size_t i = 0; i < events.size(); ++i)
+  {
+    const trace::Event& event = events[i];
+    if (event.type == trace::CONNECT)
+    {
+      Stream& stream = connections[event.connection];
+      stream.start = stream.end = event.time;
+      stream.protocol = messages::JSON;
+      stream.events.clear();
+      continue;
+    }
+
+    std::map<size_t, Stream>::iterator it =
+        connections.find(event.connection);
+    if (it == connections.end()) continue;
+
+    Stream& stream = it->second;
+    stream.end = event.time;
+
+    if (event.type == trace::SEND && event.kind == "protocol")
+    {
+      // The session negotiates the protocol, skip the switch and its ack.
+      stream.protocol = event.protocol == messages::JSON ? messages::BINARY :
+          messages::JSON;
+      switches.insert(event.connection);
+    }
+    else if (event.type == trace::RECEIVE && switches.erase(event.connection))
+    {
+      continue;
+    }
+    else if (event.type == trace::SEND || event.type == trace::RECEIVE)
+    {
+      stream.events.push_back(&event);
+    }
+  }
+
+  for (std::map<size_t, Stream>::iterator it = connections.begin();
+      it != connections.end(); ++it)
+  {
+    // Skip the balancer connections and the connections without requests.
+    bool emulator = false;
+    for (size_t i = 0; i < it->second.events.size() && !emulator; ++i)
+    {
+      emulator = it->second.events[i]->type == trace::SEND &&
+          it->second.events[i]->kind != "balancer";
+    }
+
+    if (emulator) streams.push_back(it->second);
+  }
+
+  std::set<std::string> answered;
+  for (size_t i = 0; i < streams.size(); ++i)
+  {
+    const std::vector<const trace::Event*>& events = streams[i].events;
+    for (size_t j = 0; j + 1 < events.size(); ++j)
+    {
+      if (events[j]->type == trace::SEND &&
+          events[j + 1]->type == trace::RECEIVE)
+      {
+        answered.insert(events[j]->kind);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < streams.size(); ++i)
+  {
+    const std::vector<const trace::Event*>& events = streams[i].events;
+    std::deque<size_t> outstanding;
+    streams[i].requests.assign(events.size(), events.size());
+    for (size_t j = 0; j < events.size(); ++j)
+    {
+      if (events[j]->type == trace::SEND)
+      {
+        if (answered.count(events[j]->kind)) outstanding.push_back(j);
+      }
+      else if (!outstanding.empty())
+      {
+        streams[i].requests[j] = outstanding.front();
+        outstanding.pop_front();
+      }
+    }
+  }
+
+  std::sort(streams.begin(), streams.end(),
+      [](const Stream& a, const Stream& b) { return a.start < b.start; });
+}
+
+//! Get the maximum number of overlapping streams.
+size_t Overlap(const std::vector<Stream>& streams)
+{
+  std::vector<std::pair<uint64_t, int> > changes;
+  for (size_t i = 0; i < streams.size(); ++i)
+  {
+    changes.push_back(std::make_pair(streams[i].start, 1));
+    changes.push_back(std::make_pair(streams[i].end, -1));
+  }
+
+  // Ends sort before starts of the same time.
+  std::sort(changes.begin(), changes.end());
+
+  int current = 0, overlap = 0;
+  for (size_t i = 0; i < changes.size(); ++i)
+  {
+    current += changes[i].second;
+    overlap = std::max(overlap, current);
+  }
+
+  return size_t(overlap);
+}
+
+/**
+ * Wait until the given trace time, scaled by the speed-up, has passed since
+ * the given start.
+ *
+ * @param start The replay time of the trace time 0.
+ * @param time The trace time in microseconds.
+ * @param speed The speed-up, 0 doesn't wait.
+ */
+void WaitUntil(const std::chrono::steady_clock::time_point start,
+               const uint64_t time,
+               const double speed)
+{
+  if (speed <= 0) return;
+
+  std::this_thread::sleep_until(start + std::chrono::microseconds(
+      uint64_t(time / speed)));
+}
+
+/**
+ * Replay the streams taken from the shared index. Every stream is replayed
+ * using its own session; the requests are sent at their traced time relative
+ * to the stream start, scaled by the speed-up, or as soon as the previous
+ * reply arrived if the replay falls behind.
+ *
+ * @param host The balancer (or emulator) host.
+ * @param port The balancer (or emulator) port.
+ * @param streams The streams ordered by start time.
+ * @param repeat The number of times the streams are replayed.
+ * @param duration The duration of the trace in microseconds.
+ * @param speed The speed-up, 0 replays without think time.
+ * @param next The index of the next stream.
+ * @param start The start of the replay.
+ * @param result The result of the worker.
+ */
+void Worker(const std::string& host,
+            const std::string& port,
+            const std::vector<Stream>& streams,
+            const size_t repeat,
+            const uint64_t duration,
+            const double speed,
+            std::atomic<size_t>& next,
+            const std::chrono::steady_clock::time_point start,
+            WorkerResult& result)
+{
+  std::string reply;
+  for (size_t index = next++; index < streams.size() * repeat; index = next++)
+  {
+    const Stream& stream = streams[index % streams.size()];
+    const uint64_t offset = (index / streams.size()) * duration;
+
+    WaitUntil(start, offset + stream.start - streams.front().start, speed);
+    const std::chrono::steady_clock::time_point streamStart =
+        std::chrono::steady_clock::now();
+
+    // The replayed send time of every request.
+    std::vector<std::chrono::steady_clock::time_point> sent(
+        stream.events.size());
+
+    session::Session session(host, port, stream.protocol);
+    try
+    {
+      session.Open();
+
+      for (size_t i = 0; i < stream.events.size(); ++i)
+      {
+        const trace::Event& event = *stream.events[i];
+        if (event.type == trace::SEND)
+        {
+          WaitUntil(streamStart, event.time - stream.start, speed);
+
+          sent[i] = std::chrono::steady_clock::now();
+          result.messages++;
+
+          // A request followed by its reply is sent as step, which renews
+          // the lease.
+          if (i + 1 < stream.events.size() &&
+              stream.events[i + 1]->type == trace::RECEIVE)
+          {
+            session.Step(event.payload, reply);
+          }
+          else
+          {
+            session.Send(event.payload);
+            continue;
+          }
+
+          ++i;
+        }
+        else
+        {
+          session.Receive(reply);
+        }
+
+        const trace::Event& received = *stream.events[i];
+        const size_t request = stream.requests[i];
+        if (request < stream.events.size())
+        {
+          KindResult& kind = result.kinds[stream.events[request]->kind];
+          kind.traced.push_back(double(received.time -
+              stream.events[request]->time));
+          kind.replayed.push_back(std::chrono::duration<double, std::micro>(
+              std::chrono::steady_clock::now() - sent[request]).count());
+        }
+
+        if (received.kind != trace::ReplyKind(stream.protocol, reply.data(),
+            reply.size()))
+        {
+          result.mismatches++;
+        }
+      }
+
+      result.streams++;
+    }
+    catch (const std::exception& ex)
+    {
+      std::cerr << "Stream " << index << ": " << ex.what() << std::endl;
+      result.errors++;
+    }
+
+    session.Close();
+  }
+}
+
+//! Get the given percentile of the sorted values.
+double Percentile(const std::vector<double>& values, const double percentile)
+{
+  if (values.empty()) return 0;
+
+  const size_t index = std::min(values.size() - 1,
+      size_t(percentile / 100.0 * values.size()));
+  return values[index];
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc < 4)
+  {
+    std::cout << "Usage: <trace> <host> <port> [speed=<factor>] "
+              << "[concurrency=<streams>] [repeat=<n>]\n";
+    return 1;
+  }
+
+  const std::string host(argv[2]);
+  const std::string port(argv[3]);
+  double speed = 1;
+  size_t concurrency = 0;
+  size_t repeat = 1;
+
+  for (int i = 4; i < argc; ++i)
+  {
+    const std::string arg(argv[i]);
+    if (arg.compare(0, 6, "speed=") == 0)
+    {
+      speed = std::atof(arg.c_str() + 6);
+    }
+    else if (arg.compare(0, 12, "concurrency=") == 0)
+    {
+      concurrency = std::atoi(arg.c_str() + 12);
+    }
+    else if (arg.compare(0, 7, "repeat=") == 0)
+    {
+      repeat = std::max(std::atoi(arg.c_str() + 7), 1);
+    }
+    else
+    {
+      std::cerr << "Unknown argument " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<trace::Event> events;
+  std::vector<Stream> streams;
+  try
+  {
+    trace::Load(argv[1], events);
+  }
+  catch (const std::exception& ex)
+  {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+
+  Streams(events, streams);
+  if (streams.empty())
+  {
+    std::cerr << "No emulator connections in the trace." << std::endl;
+    return 1;
+  }
+
+  // The replay starts with the first stream.
+  uint64_t duration = 0;
+  for (size_t i = 0; i < streams.size(); ++i)
+  {
+    duration = std::max(duration, streams[i].end - streams.front().start);
+  }
+
+  if (concurrency == 0)
+  {
+    concurrency = Overlap(streams);
+  }
+
+  std::vector<WorkerResult> results(concurrency);
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next(0);
+
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < concurrency; ++i)
+  {
+    threads.push_back(std::thread(Worker, host, port, std::cref(streams),
+        repeat, duration, speed, std::ref(next), start,
+        std::ref(results[i])));
+  }
+
+  for (size_t i = 0; i < threads.size(); ++i)
+  {
+    threads[i].join();
+  }
+
+  const double time = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  // Merge the results of all workers.
+  WorkerResult total;
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    for (std::map<std::string, KindResult>::const_iterator it =
+        results[i].kinds.begin(); it != results[i].kinds.end(); ++it)
+    {
+      KindResult& kind = total.kinds[it->first];
+      kind.traced.insert(kind.traced.end(), it->second.traced.begin(),
+          it->second.traced.end());
+      kind.replayed.insert(kind.replayed.end(), it->second.replayed.begin(),
+          it->second.replayed.end());
+    }
+
+    total.streams += results[i].streams;
+    total.messages += results[i].messages;
+    total.errors += results[i].errors;
+    total.mismatches += results[i].mismatches;
+  }
+
+  std::cout << std::fixed << std::setprecision(1)
+            << "Trace: " << argv[1] << " (" << streams.size() << " streams, "
+            << (duration / 1e6) << " s)" << std::endl
+            << "Speed-up: " << speed << std::endl
+            << "Concurrency: " << concurrency << std::endl
+            << "Streams: " << total.streams << " (" << total.errors
+            << " errors)" << std::endl
+            << "Messages: " << total.messages << " (" << total.mismatches
+            << " mismatched replies)" << std::endl
+            << "Time: " << time << " s" << std::endl
+            << "Messages/sec: " << (total.messages / time) << std::endl
+            << "Latency (us):" << std::setw(13) << "count"
+            << std::setw(14) << "traced p50" << std::setw(14) << "traced p99"
+            << std::setw(14) << "replay p50" << std::setw(14) << "replay p99"
+            << std::endl;
+
+  for (std::map<std::string, KindResult>::iterator it = total.kinds.begin();
+      it != total.kinds.end(); ++it)
+  {
+    std::sort(it->second.traced.begin(), it->second.traced.end());
+    std::sort(it->second.replayed.begin(), it->second.replayed.end());
+
+    std::cout << "  " << std::setw(10) << std::left << it->first << std::right
+              << std::setw(13) << it->second.replayed.size()
+              << std::setw(14) << Percentile(it->second.traced, 50)
+              << std::setw(14) << Percentile(it->second.traced, 99)
+              << std::setw(14) << Percentile(it->second.replayed, 50)
+              << std::setw(14) << Percentile(it->second.replayed, 99)
+              << std::endl;
+  }
+
+  return total.errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,690 @@
+/**
+ * @file session.hpp
+ * @author Marcus Edel
+ *
+ * Persistent emulator sessions that are reused across evaluations.
+ */
+#ifndef NES_SESSION_HPP
+#define NES_SESSION_HPP
+
+#include <mlpack/core.hpp>
+
+#include "parser.hpp"
+#include "client.hpp"
+#include "messages.hpp"
+#include "frame_ring.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace session {
+
+/**
+ * A session keeps the connection to an emulator endpoint and the config that
+ * was applied to it, so that the same emulator can be reused across
+ * evaluations with a single reset message.
+ *
+ * The endpoint is leased from the balancer; the balancer connection is kept
+ * open for the lifetime of the session, the lease is renewed while the
+ * session is used and released once the session is closed.
+ */
+class Session {
+ public:
+  /**
+   * Create the Session object using the given balancer host and port.
+   *
+   * @param host The hostname of the balancer (or emulator).
+   * @param port The port of the balancer (or emulator).
+   * @param protocol The wire protocol used for the session.
+   */
+  Session(const std::string& host,
+          const std::string& port,
+          const messages::Protocol protocol) :
+      host(host),
+      port(port),
+      protocol(protocol),
+      id(NextId()),
+      connections(0),
+      divisor(0),
+      delta(0),
+      shmToken(0)
+  {
+    /* Nothing to do here */
+  }
+
+  /**
+   * Ask the balancer for an endpoint, connect and negotiate the protocol.
+   * Any previously open connection is dropped.
+   */
+  void Open()
+  {
+    Close();
+
+    if (!master || !master->IsOpen())
+    {
+      master.reset(new client::Client());
+      master->Connect(host, port);
+    }
+
+    master->Send(messages::GetEndpoint());
+    std::string json;
+    master->Receive(json);
+
+    // The balancer sends an empty message if all endpoints are leased.
+    if (json.compare(0, 2, "{}") == 0)
+    {
+      throw std::runtime_error("No free endpoint.");
+    }
+
+    parser.Parse(json);
+    parser.Endpoint(hostEndpoint, portEndpoint);
+    leaseTime = std::chrono::steady_clock::now();
+
+    // Check if local balancer; the emulator serves a single client, so the
+    // connection has to be closed before connecting to the endpoint.
+    if (hostEndpoint == "*")
+    {
+      hostEndpoint = host;
+      master.reset();
+    }
+
+    connection.reset(new client::Client());
+    ++connections;
+    connection->Connect(hostEndpoint, portEndpoint);
+    connection->Protocol(protocol);
+  }
+
+  //! Drop the connection, release the lease and forget the applied config.
+  void Close()
+  {
+    // Disconnect before the release, so the emulator is ready for the next
+    // client once the endpoint is free again.
+    const bool leased = connection && master;
+    connection.reset();
+
+    if (leased)
+    {
+      try
+      {
+        master->Send(messages::ReleaseEndpoint(hostEndpoint, portEndpoint));
+      }
+      catch (...)
+      {
+        // The balancer releases the leases of a dropped connection.
+        master.reset();
+      }
+    }
+
+    speed.clear();
+    divisor = 0;
+    delta = 0;
+    shmToken = 0;
+    ring.reset();
+  }
+
+  //! Get the id of the session, unique within the process; unlike the
+  // address of the session, an id is never reused.
+  uint64_t Id() const { return id; }
+
+  //! Get the number of connections opened by the session. The emulator drops
+  // the state of a client (e.g. the savestate slots) once the connection is
+  // closed, so state kept for a connection is only valid while the number
+  // doesn't change.
+  size_t Connections() const { return connections; }
+
+  //! Return true if the session holds an open connection.
+  bool IsOpen() const
+  {
+    return connection && connection->IsOpen();
+  }
+
+  /**
+   * Set the emulation speed, the message is only sent if the speed differs
+   * from the applied one.
+   *
+   * @param speed The emulation speed (normal, maximum, turbo).
+   */
+  void ConfigSpeed(const std::string& speed)
+  {
+    if (speed == this->speed) return;
+
+    Send(Message(messages::ConfigSpeed(speed),
+        messages::binary::ConfigSpeed(speed)));
+    this->speed = speed;
+  }
+
+  /**
+   * Set the frame divisor, the message is only sent if the divisor differs
+   * from the applied one.
+   *
+   * @param divisor The frame divisor.
+   */
+  void ConfigDivisor(const int divisor)
+  {
+    if (divisor == this->divisor) return;
+
+    Send(Message(messages::ConfigDivisor(divisor),
+        messages::binary::ConfigDivisor(divisor)));
+    this->divisor = divisor;
+  }
+
+  /**
+   * Enable the delta observations, the message is only sent if the interval
+   * differs from the applied one. The game infos are applied to the tiles
+   * kept by the session parser.
+   *
+   * @param interval The keyframe interval, 0 disables the delta observations.
+   */
+  void ConfigDelta(const int interval)
+  {
+    if (interval == delta) return;
+
+    Send(Message(messages::ConfigDelta(interval),
+        messages::binary::ConfigDelta(interval)));
+    delta = interval;
+  }
+
+  /**
+   * Publish the game frames into the shared memory ring of the emulator. The
+   * ring is only available if the emulator runs on the same host, use Frame()
+   * to check and GameImage over the connection as fallback.
+   *
+   * @param enable Enable or disable the shared memory ring.
+   */
+  void ConfigShm(const bool enable)
+  {
+    if (enable == (shmToken != 0)) return;
+
+    uint32_t token = 0;
+    if (enable)
+    {
+      // The token identifies the ring created for this session.
+      std::random_device device;
+      while (token == 0) token = device();
+    }
+
+    Send(Message(messages::ConfigShm(token),
+        messages::binary::ConfigShm(token)));
+    shmToken = token;
+    ring.reset();
+  }
+
+  /**
+   * Get the latest frame published into the shared memory ring without
+   * copying it; the frame of a game info is published before the game info is
+   * sent.
+   *
+   * @param frame The latest frame, see frames::FrameRing::Latest.
+   * @return False if the ring isn't enabled or not available on this host.
+   */
+  bool Frame(frames::Frame& frame)
+  {
+    if (shmToken == 0) return false;
+
+    if (!ring)
+    {
+      try
+      {
+        ring.reset(new frames::FrameRing(frames::RingName(hostEndpoint,
+            portEndpoint), shmToken));
+      }
+      catch (const std::exception&)
+      {
+        return false;
+      }
+    }
+
+    return ring->Latest(frame);
+  }
+
+  /**
+   * Reset the game state. The initial key is sent within the same message, so
+   * the key of the previous evaluation isn't replayed after the reset.
+   */
+  void Reset()
+  {
+    Renew();
+
+    std::string message;
+    if (protocol == messages::BINARY)
+    {
+      messages::binary::Append(message, messages::binary::PressRight());
+      messages::binary::Append(message, messages::binary::GameReset());
+    }
+    else
+    {
+      messages::Append(message, messages::PressRight());
+      messages::Append(message, messages::GameReset());
+      message = messages::JSONMessage(message);
+    }
+
+    Send(message);
+  }
+
+  /**
+   * Create the message for the given JSON and binary message using the
+   * session protocol.
+   *
+   * @param json The JSON message.
+   * @param binary The binary message.
+   */
+  std::string Message(const std::string& json, const std::string& binary) const
+  {
+    if (protocol == messages::BINARY)
+    {
+      return binary;
+    }
+
+    return messages::JSONMessage(json);
+  }
+
+  //! Send a message using the session connection.
+  void Send(const std::string& data)
+  {
+    if (!connection)
+    {
+      throw std::runtime_error("Session is not open.");
+    }
+
+    connection->Send(data);
+  }
+
+  //! Receive a message using the session connection.
+  void Receive(std::string& data)
+  {
+    if (!connection)
+    {
+      throw std::runtime_error("Session is not open.");
+    }
+
+    connection->Receive(data);
+  }
+
+  //! Receive a message without copying it, see client::Client::Receive.
+  void Receive(boost::string_ref& data)
+  {
+    if (!connection)
+    {
+      throw std::runtime_error("Session is not open.");
+    }
+
+    connection->Receive(data);
+  }
+
+  //! Send a step message and receive the resulting observation.
+  void Step(const std::string& action, std::string& observation)
+  {
+    if (!connection)
+    {
+      throw std::runtime_error("Session is not open.");
+    }
+
+    Renew();
+    connection->Step(action, observation);
+  }
+
+  //! Send a step message and receive the resulting observation without
+  // copying it, see client::Client::Step.
+  void Step(const std::string& action, boost::string_ref& observation)
+  {
+    if (!connection)
+    {
+      throw std::runtime_error("Session is not open.");
+    }
+
+    Renew();
+    connection->Step(action, observation);
+  }
+
+  /**
+   * Press the given key and receive the resulting observation without
+   * copying it. The message is built in a buffer of the session using the
+   * session protocol, so a step doesn't allocate once the buffers of the
+   * session reached their size.
+   *
+   * @param key The JSON key (A, B, Right, Left, Up, Down, Start).
+   * @param binaryKey The binary key (KEY_A, ..., KEY_START).
+   * @param observation The reply of the step.
+   * @param slot The savestate slot the state is saved into before the step, 0
+   *        to skip the savestate.
+   */
+  void Step(const char* key,
+            const uint8_t binaryKey,
+            boost::string_ref& observation,
+            const int slot = 0)
+  {
+    if (!connection)
+    {
+      throw std::runtime_error("Session is not open.");
+    }
+
+    if (protocol == messages::BINARY)
+    {
+      messages::binary::StepMessage(stepMessage, binaryKey, slot);
+    }
+    else
+    {
+      messages::StepMessage(stepMessage, key, slot);
+    }
+
+    Renew();
+    connection->Step(stepMessage, observation);
+  }
+
+  //! Send an action sequence and receive the trajectory without copying it,
+  // see client::Client::Sequence.
+  void Sequence(const std::string& sequence, boost::string_ref& trajectory)
+  {
+    if (!connection)
+    {
+      throw std::runtime_error("Session is not open.");
+    }
+
+    Renew();
+    connection->Sequence(sequence, trajectory);
+  }
+
+  /**
+   * Send a message that starts with a savestate load (see
+   * messages::LoadState), usually followed by a step or an action sequence,
+   * and receive the reply without copying it.
+   *
+   * @param message The message.
+   * @param observation The reply of the message.
+   * @return False if the savestate slot doesn't exist on the emulator (e.g.
+   *         after a reconnect), the rest of the message was ignored.
+   */
+  bool Resume(const std::string& message, boost::string_ref& observation)
+  {
+    if (!connection)
+    {
+      throw std::runtime_error("Session is not open.");
+    }
+
+    Renew();
+    connection->Step(message, observation);
+
+    if (protocol == messages::BINARY)
+    {
+      return observation.empty() ||
+          uint8_t(observation[0]) != messages::binary::REPLY_MISSING;
+    }
+
+    return !observation.starts_with("{\"missing\"");
+  }
+
+  /**
+   * Remove the given savestate slots of the emulator. The removal advances
+   * the frame divisor, so discard slots before a reset or a load.
+   *
+   * @param slots The savestate slots.
+   */
+  void Discard(const std::vector<int>& slots)
+  {
+    if (slots.empty()) return;
+
+    // A JSON message holds a single command per group.
+    std::string message;
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+      if (protocol == messages::BINARY)
+      {
+        messages::binary::Append(message,
+            messages::binary::DiscardState(slots[i]));
+      }
+      else
+      {
+        Send(messages::JSONMessage(messages::DiscardState(slots[i])));
+      }
+    }
+
+    if (!message.empty()) Send(message);
+  }
+
+  //! Get the parser instance of the session.
+  parser::Parser& Parser() { return parser; }
+
+  //! Get the wire protocol of the session.
+  messages::Protocol Protocol() const { return protocol; }
+
+  /**
+   * Renew the lease if the last renewal is older than the renew interval. The
+   * steps renew the lease of a used session, idle sessions have to be renewed
+   * by their owner (see SessionPool).
+   *
+   * @return False if the renewal failed and the lease is lost.
+   */
+  bool Renew()
+  {
+    if (!master) return true;
+
+    const std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (now - leaseTime < std::chrono::seconds(int(renewInterval)))
+    {
+      return true;
+    }
+
+    leaseTime = now;
+    try
+    {
+      master->Send(messages::RenewEndpoint());
+    }
+    catch (...)
+    {
+      // The balancer releases the leases of a dropped connection, so the
+      // next Open() connects again.
+      master.reset();
+      return false;
+    }
+
+    return true;
+  }
+
+  //! The time between two lease renewals in seconds; the balancer lease
+  // timeout is 60 seconds.
+  static const int renewInterval = 15;
+
+ private:
+  //! Get the id of a new session.
+  static uint64_t NextId()
+  {
+    static std::atomic<uint64_t> ids(0);
+    return ++ids;
+  }
+
+  //! Locally stored balancer host name.
+  std::string host;
+
+  //! Locally stored balancer port.
+  std::string port;
+
+  //! Locally stored endpoint host name.
+  std::string hostEndpoint;
+
+  //! Locally stored endpoint port.
+  std::string portEndpoint;
+
+  //! Locally stored wire protocol.
+  messages::Protocol protocol;
+
+  //! Locally stored id of the session.
+  uint64_t id;
+
+  //! Locally stored number of opened connections.
+  size_t connections;
+
+  //! Locally stored connection to the balancer that holds the lease.
+  std::unique_ptr<client::Client> master;
+
+  //! Locally stored time of the last lease renewal.
+  std::chrono::steady_clock::time_point leaseTime;
+
+  //! Locally stored connection to the emulator.
+  std::unique_ptr<client::Client> connection;
+
+  //! Locally stored parser instance.
+  parser::Parser parser;
+
+  //! Locally stored buffer of the step message, reused by every step.
+  std::string stepMessage;
+
+  //! Locally stored applied emulation speed.
+  std::string speed;
+
+  //! Locally stored applied frame divisor.
+  int divisor;
+
+  //! Locally stored applied keyframe interval of the delta observations.
+  int delta;
+
+  //! Locally stored token of the shared memory ring, 0 if disabled.
+  uint32_t shmToken;
+
+  //! Locally stored shared memory ring of the emulator.
+  std::unique_ptr<frames::FrameRing> ring;
+}; // class Session
+
+/**
+ * A pool of idle sessions. Sessions are handed out with Acquire() and returned
+ * with Release(); sessions that lost their connection are dropped.
+ *
+ * The leases of the idle sessions are renewed by a keep-alive thread, since an
+ * expired lease frees the endpoint while the session is still connected and
+ * the balancer would remove the endpoint once its probes time out.
+ */
+class SessionPool {
+ public:
+  /**
+   * Create the SessionPool object using the given balancer host and port.
+   *
+   * @param host The hostname of the balancer (or emulator).
+   * @param port The port of the balancer (or emulator).
+   * @param protocol The wire protocol used for new sessions.
+   */
+  SessionPool(const std::string& host,
+              const std::string& port,
+              const messages::Protocol protocol) :
+      host(host),
+      port(port),
+      protocol(protocol),
+      stop(false)
+  {
+    keepAlive = std::thread(&SessionPool::KeepAlive, this);
+  }
+
+  SessionPool(const SessionPool&) = delete;
+  SessionPool& operator=(const SessionPool&) = delete;
+
+  //! Stop the keep-alive thread.
+  ~SessionPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+
+    wake.notify_one();
+    keepAlive.join();
+  }
+
+  //! Ask the balancer for the number of registered endpoints.
+  size_t NumEndpoints()
+  {
+    client::Client clientMaster;
+    clientMaster.Connect(host, port);
+
+    clientMaster.Send(messages::GetEndpointCount());
+    std::string json;
+    clientMaster.Receive(json);
+
+    int count;
+    parser::Parser parser(json);
+    parser.EndpointCount(count);
+
+    return count > 0 ? count : 0;
+  }
+
+  //! Take an idle session or create a new (unopened) one.
+  std::unique_ptr<Session> Acquire()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (idle.empty())
+    {
+      return std::unique_ptr<Session>(new Session(host, port, protocol));
+    }
+
+    std::unique_ptr<Session> session(std::move(idle.back()));
+    idle.pop_back();
+    return session;
+  }
+
+  //! Return the given session to the pool.
+  void Release(std::unique_ptr<Session> session)
+  {
+    if (!session || !session->IsOpen()) return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    idle.push_back(std::move(session));
+  }
+
+ private:
+  //! Renew the leases of the idle sessions every renew interval; sessions
+  // that lost their lease are closed and dropped.
+  void KeepAlive()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop)
+    {
+      wake.wait_for(lock, std::chrono::seconds(int(Session::renewInterval)));
+      if (stop) break;
+
+      for (size_t i = 0; i < idle.size();)
+      {
+        if (idle[i]->Renew())
+        {
+          ++i;
+          continue;
+        }
+
+        idle[i]->Close();
+        idle.erase(idle.begin() + i);
+      }
+    }
+  }
+
+  //! Locally stored balancer host name.
+  std::string host;
+
+  //! Locally stored balancer port.
+  std::string port;
+
+  //! Locally stored wire protocol.
+  messages::Protocol protocol;
+
+  //! Locally stored idle sessions.
+  std::vector<std::unique_ptr<Session> > idle;
+
+  //! Locally stored mutex that guards the idle sessions.
+  std::mutex mutex;
+
+  //! Locally stored condition to wake the keep-alive thread.
+  std::condition_variable wake;
+
+  //! Locally stored flag to stop the keep-alive thread.
+  bool stop;
+
+  //! Locally stored keep-alive thread.
+  std::thread keepAlive;
+}; // class SessionPool
+
+} // namespace session
+
+#endif
@@ -0,0 +1,817 @@
+/**
+ * @file supervisor.cpp
+ * @author Marcus Edel
+ *
+ * Launch a number of emulator workers (e.g. fceux running
+ * super_mario_bros.lua), register them at the balancer once they accept
+ * connections and restart the workers that exit or stop answering.
+ */
+
+#include "messages.hpp"
+#include "endpoint.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/algorithm/string/replace.hpp>
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//! The restart delay of a worker that exited in seconds; doubled for every
+// restart up to the maximum delay.
+const int minBackoff = 1;
+
+//! The maximum restart delay in seconds.
+const int maxBackoff = 60;
+
+//! The run time in seconds after that the restart delay of a worker is reset.
+const int stableTime = 60;
+
+//! The time between two connection attempts to a started worker in
+// milliseconds.
+const int readyInterval = 500;
+
+//! The time between two health checks of the ready workers in seconds.
+const int healthInterval = 5;
+
+//! The time after that a health check fails in seconds.
+const int healthTimeout = 2;
+
+//! The number of failed health checks after that a worker is restarted.
+const size_t maxHealthFailures = 3;
+
+//! The time the workers get to exit after SIGTERM in seconds.
+const int stopTimeout = 5;
+
+/**
+ * A request with a single reply, e.g. a get message to check whether a worker
+ * answers; the handler gets false if the endpoint doesn't answer within the
+ * health timeout.
+ */
+class Request : public std::enable_shared_from_this<Request>
+{
+ public:
+  Request(boost::asio::io_service& ioService,
+          const std::string& host,
+          const std::string& port,
+          const std::string& request,
+          const std::function<void(bool, const std::string&)>& handler) :
+      socket(ioService),
+      deadline(ioService),
+      host(host),
+      port(port),
+      request(request + "\r\n"),
+      handler(handler),
+      done(false)
+  {
+    /* Nothing to do here */
+  }
+
+  //! Send the request.
+  void Start()
+  {
+    std::shared_ptr<Request> self(shared_from_this());
+
+    deadline.expires_from_now(boost::posix_time::seconds(healthTimeout));
+    deadline.async_wait([this, self](const boost::system::error_code& error)
+    {
+      if (!error) Finish(false);
+    });
+
+    endpoint::AsyncConnect(socket, host, port,
+        [this, self](const boost::system::error_code& error)
+    {
+      if (error) return Finish(false);
+
+      boost::asio::async_write(socket, boost::asio::buffer(request),
+          [this, self](const boost::system::error_code& error, size_t)
+      {
+        if (error) return Finish(false);
+
+        boost::asio::async_read_until(socket, buffer, "\r\n\r\n\r\n",
+            [this, self](const boost::system::error_code& error, size_t)
+        {
+          Finish(!error);
+        });
+      });
+    });
+  }
+
+ private:
+  //! Call the handler once and cancel the outstanding operations.
+  void Finish(const bool answered)
+  {
+    if (done) return;
+    done = true;
+
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    deadline.cancel(ignored);
+
+    std::string reply;
+    if (answered)
+    {
+      reply.assign(boost::asio::buffers_begin(buffer.data()),
+          boost::asio::buffers_end(buffer.data()));
+    }
+
+    handler(answered, reply);
+  }
+
+  endpoint::Socket socket;
+  boost::asio::deadline_timer deadline;
+  boost::asio::streambuf buffer;
+  std::string host;
+  std::string port;
+  std::string request;
+  std::function<void(bool, const std::string&)> handler;
+  bool done;
+};
+
+/**
+ * Connection to the balancer that sends the add and remove commands. The
+ * commands have no reply and are written one after another; if the balancer
+ * isn't reachable the queued commands are dropped. The connected handler is
+ * called once the connection is established again, so the ready workers can
+ * be registered at a restarted balancer.
+ */
+class Balancer
+{
+ public:
+  Balancer(boost::asio::io_service& ioService,
+           const std::string& host,
+           const std::string& port) :
+      socket(ioService),
+      host(host),
+      port(port),
+      connected(false),
+      busy(false),
+      failed(false)
+  {
+    /* Nothing to do here */
+  }
+
+  //! Queue the given command.
+  void Send(const std::string& command)
+  {
+    commands.push_back(command + "\n");
+    Flush();
+  }
+
+  //! Set the handler that is called once the connection is established
+  // again after a failure.
+  void Connected(const std::function<void()>& handler)
+  {
+    reconnected = handler;
+  }
+
+  //! Get the balancer host name.
+  const std::string& Host() const { return host; }
+
+  //! Get the balancer port.
+  const std::string& Port() const { return port; }
+
+ private:
+  //! Connect if necessary and write the next queued command.
+  void Flush()
+  {
+    if (busy || commands.empty()) return;
+    busy = true;
+
+    if (!connected)
+    {
+      endpoint::AsyncConnect(socket, host, port,
+          [this](const boost::system::error_code& error)
+      {
+        busy = false;
+        if (error)
+        {
+          Fail(error);
+          return;
+        }
+
+        connected = true;
+        if (failed)
+        {
+          std::cout << "Balancer connected: " << endpoint::Name(host, port)
+                    << std::endl;
+
+          // The commands of the failed connection were dropped.
+          failed = false;
+          if (reconnected) reconnected();
+        }
+
+        Flush();
+      });
+      return;
+    }
+
+    boost::asio::async_write(socket, boost::asio::buffer(commands.front()),
+        [this](const boost::system::error_code& error, size_t)
+    {
+      busy = false;
+      if (error)
+      {
+        Fail(error);
+        return;
+      }
+
+      commands.pop_front();
+      Flush();
+    });
+  }
+
+  //! Drop the connection and the queued commands.
+  void Fail(const boost::system::error_code& error)
+  {
+    // Report the first failure only, the ready workers are registered again
+    // once the connection is established.
+    if (!failed)
+    {
+      std::cerr << "Balancer error: " << endpoint::Name(host, port) << ": "
+                << error.message() << "\n";
+    }
+
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    connected = false;
+    failed = true;
+    commands.clear();
+  }
+
+  //! Locally stored socket object.
+  endpoint::Socket socket;
+
+  //! Locally stored balancer host name.
+  std::string host;
+
+  //! Locally stored balancer port.
+  std::string port;
+
+  //! Locally stored queued commands.
+  std::deque<std::string> commands;
+
+  //! Locally stored indication if the socket is connected.
+  bool connected;
+
+  //! Locally stored indication if a connect or write operation is
+  // outstanding.
+  bool busy;
+
+  //! Locally stored indication if the last operation failed.
+  bool failed;
+
+  //! Locally stored handler called once the connection is established again.
+  std::function<void()> reconnected;
+};
+
+/**
+ * A worker process and the endpoint it serves.
+ */
+struct Worker
+{
+  Worker(boost::asio::io_service& ioService,
+         const std::string& host,
+         const std::string& port) :
+      host(host),
+      port(port),
+      pid(0),
+      ready(false),
+      checking(false),
+      failures(0),
+      backoff(minBackoff),
+      timer(ioService),
+      socket(ioService)
+  {
+    /* Nothing to do here */
+  }
+
+  //! The host name registered at the balancer.
+  std::string host;
+
+  //! The port registered at the balancer, empty for unix domain sockets.
+  std::string port;
+
+  //! The process id, 0 if the worker isn't running.
+  pid_t pid;
+
+  //! Whether the worker accepts connections and is registered.
+  bool ready;
+
+  //! Whether a health check of the worker is outstanding.
+  bool checking;
+
+  //! The number of consecutive failed health checks.
+  size_t failures;
+
+  //! The restart delay in seconds.
+  int backoff;
+
+  //! The time the worker was started.
+  std::chrono::steady_clock::time_point started;
+
+  //! The timer of the next connection attempt or restart.
+  boost::asio::deadline_timer timer;
+
+  //! The socket used to check whether the worker accepts connections.
+  endpoint::Socket socket;
+};
+
+/**
+ * The Supervisor starts the workers using the given command; "{port}" in the
+ * arguments is replaced by the port of the worker (unix:<path> for unix
+ * domain sockets) and the port is passed as NES_PORT (the path as NES_SOCKET)
+ * environment variable, which super_mario_bros.lua reads. A worker is added to
+ * the balancer once it accepts connections and removed once it exits; exited
+ * workers are started again, the delay doubles with every restart unless the
+ * worker ran for a while. SIGINT and SIGTERM remove and stop all workers.
+ *
+ * The ready workers are health checked every health interval: a worker has to
+ * answer a get message. A worker that answers is registered again, so a
+ * balancer that dropped it learns about it. An emulator serves a single
+ * client, so a worker that doesn't answer only fails the check if the
+ * balancer doesn't report it as leased; a worker that fails too many checks
+ * is killed and restarted like an exited worker. All ready workers are
+ * registered again once the balancer connection is established again.
+ *
+ * Every worker runs in its own process group, so a wrapper script and the
+ * emulator it starts are stopped together.
+ */
+class Supervisor
+{
+ public:
+  /**
+   * Start the workers.
+   *
+   * @param ioService The io service used for all operations.
+   * @param balancer The balancer connection.
+   * @param count The number of workers.
+   * @param host The host name of the workers or unix:<path>.
+   * @param port The port of the first worker; the workers use consecutive
+   *        ports, unix domain socket paths get the index as suffix if there
+   *        are several workers.
+   * @param command The command and its arguments.
+   */
+  Supervisor(boost::asio::io_service& ioService,
+             Balancer& balancer,
+             const size_t count,
+             const std::string& host,
+             const std::string& port,
+             const std::vector<std::string>& command) :
+      ioService(ioService),
+      balancer(balancer),
+      command(command),
+      children(ioService, SIGCHLD),
+      signals(ioService, SIGINT, SIGTERM),
+      health(ioService),
+      stopTimer(ioService),
+      stopping(false)
+  {
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (endpoint::IsLocal(host))
+      {
+        workers.push_back(std::unique_ptr<Worker>(new Worker(ioService,
+            count > 1 ? host + "-" + std::to_string(i) : host, "")));
+      }
+      else
+      {
+        workers.push_back(std::unique_ptr<Worker>(new Worker(ioService, host,
+            std::to_string(std::atoi(port.c_str()) + i))));
+      }
+    }
+
+    WaitChildren();
+    WaitSignals();
+
+    balancer.Connected([this]()
+    {
+      for (size_t i = 0; i < workers.size(); ++i)
+      {
+        if (workers[i]->ready)
+        {
+          this->balancer.Send(messages::AddEndpoint(workers[i]->host,
+              workers[i]->port));
+        }
+      }
+    });
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+      Start(*workers[i]);
+    }
+
+    Health();
+  }
+
+ private:
+  //! Start the given worker.
+  void Start(Worker& worker)
+  {
+    const std::string address = worker.port.empty() ? worker.host :
+        worker.port;
+
+    // Prepare the arguments before forking.
+    std::vector<std::string> arguments(command);
+    std::vector<char*> argv;
+    for (size_t i = 0; i < arguments.size(); ++i)
+    {
+      boost::replace_all(arguments[i], "{port}", address);
+      argv.push_back(&arguments[i][0]);
+    }
+    argv.push_back(NULL);
+
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+      std::cerr << "Fork failed: " << std::strerror(errno) << "\n";
+      Restart(worker);
+      return;
+    }
+
+    if (pid == 0)
+    {
+      setpgid(0, 0);
+
+      if (endpoint::IsLocal(worker.host))
+      {
+        setenv("NES_SOCKET", endpoint::Path(worker.host).c_str(), 1);
+      }
+      else
+      {
+        setenv("NES_PORT", worker.port.c_str(), 1);
+      }
+
+      // Don't pass the connections of the supervisor to the worker.
+      const long maxDescriptor = std::min(sysconf(_SC_OPEN_MAX), 65536L);
+      for (long fd = 3; fd < maxDescriptor; ++fd)
+      {
+        close(fd);
+      }
+
+      execvp(argv[0], argv.data());
+      std::cerr << "Exec failed: " << argv[0] << ": " << std::strerror(errno)
+                << "\n";
+      _exit(127);
+    }
+
+    setpgid(pid, pid);
+    worker.pid = pid;
+    worker.ready = false;
+    worker.checking = false;
+    worker.failures = 0;
+    worker.started = std::chrono::steady_clock::now();
+
+    std::cout << "Start worker: " << endpoint::Name(worker.host, worker.port)
+              << " (pid " << pid << ")" << std::endl;
+
+    Probe(worker);
+  }
+
+  //! Connect to the given worker until it accepts connections, then register
+  // it at the balancer.
+  void Probe(Worker& worker)
+  {
+    const pid_t pid = worker.pid;
+    worker.timer.expires_from_now(boost::posix_time::milliseconds(
+        readyInterval));
+    worker.timer.async_wait([this, &worker, pid](
+        const boost::system::error_code& error)
+    {
+      if (error || worker.pid != pid) return;
+
+      endpoint::AsyncConnect(worker.socket, worker.host, worker.port,
+          [this, &worker, pid](const boost::system::error_code& error)
+      {
+        boost::system::error_code ignored;
+        worker.socket.close(ignored);
+
+        if (worker.pid != pid || stopping) return;
+
+        if (error)
+        {
+          Probe(worker);
+          return;
+        }
+
+        worker.ready = true;
+        std::cout << "Worker ready: " << endpoint::Name(worker.host,
+            worker.port) << std::endl;
+
+        balancer.Send(messages::AddEndpoint(worker.host, worker.port));
+      });
+    });
+  }
+
+  //! Start the given worker again after its restart delay.
+  void Restart(Worker& worker)
+  {
+    // A worker that ran for a while failed for a new reason.
+    if (worker.pid != 0 && std::chrono::steady_clock::now() - worker.started >=
+        std::chrono::seconds(stableTime))
+    {
+      worker.backoff = minBackoff;
+    }
+
+    std::cout << "Restart worker: " << endpoint::Name(worker.host, worker.port)
+              << " in " << worker.backoff << " s" << std::endl;
+
+    worker.pid = 0;
+    worker.timer.expires_from_now(boost::posix_time::seconds(worker.backoff));
+    worker.timer.async_wait([this, &worker](
+        const boost::system::error_code& error)
+    {
+      if (!error && !stopping) Start(worker);
+    });
+
+    worker.backoff = std::min(worker.backoff * 2, maxBackoff);
+  }
+
+  //! Handle the exit of the given process.
+  void Exited(const pid_t pid, const int status)
+  {
+    Worker* worker = NULL;
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+      if (workers[i]->pid == pid) worker = workers[i].get();
+    }
+
+    if (!worker) return;
+
+    std::cout << "Worker exited: " << endpoint::Name(worker->host,
+        worker->port) << " (" << (WIFSIGNALED(status) ? "signal " :
+        "status ") << (WIFSIGNALED(status) ? WTERMSIG(status) :
+        WEXITSTATUS(status)) << ")" << std::endl;
+
+    boost::system::error_code ignored;
+    worker->timer.cancel(ignored);
+    worker->socket.close(ignored);
+
+    if (worker->ready)
+    {
+      worker->ready = false;
+      balancer.Send(messages::RemoveEndpoint(worker->host, worker->port));
+    }
+
+    if (stopping)
+    {
+      worker->pid = 0;
+      if (Running() == 0) Finish();
+      return;
+    }
+
+    Restart(*worker);
+  }
+
+  //! Reap the exited workers.
+  void WaitChildren()
+  {
+    children.async_wait([this](const boost::system::error_code& error, int)
+    {
+      if (error) return;
+
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+      {
+        Exited(pid, status);
+      }
+
+      // All workers exited after a stop.
+      if (stopping && Running() == 0) return;
+
+      WaitChildren();
+    });
+  }
+
+  //! Stop all workers on SIGINT or SIGTERM.
+  void WaitSignals()
+  {
+    signals.async_wait([this](const boost::system::error_code& error, int)
+    {
+      if (error) return;
+
+      stopping = true;
+      boost::system::error_code ignored;
+      health.cancel(ignored);
+
+      for (size_t i = 0; i < workers.size(); ++i)
+      {
+        Worker& worker = *workers[i];
+        worker.timer.cancel(ignored);
+        worker.socket.close(ignored);
+
+        if (worker.ready)
+        {
+          worker.ready = false;
+          balancer.Send(messages::RemoveEndpoint(worker.host, worker.port));
+        }
+
+        if (worker.pid != 0) kill(-worker.pid, SIGTERM);
+      }
+
+      if (Running() == 0)
+      {
+        Finish();
+        return;
+      }
+
+      // Kill the workers that don't exit in time.
+      stopTimer.expires_from_now(boost::posix_time::seconds(stopTimeout));
+      stopTimer.async_wait([this](const boost::system::error_code& error)
+      {
+        if (error) return;
+
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+          if (workers[i]->pid != 0) kill(-workers[i]->pid, SIGKILL);
+        }
+      });
+    });
+  }
+
+  //! Check the ready workers every health interval.
+  void Health()
+  {
+    health.expires_from_now(boost::posix_time::seconds(healthInterval));
+    health.async_wait([this](const boost::system::error_code& error)
+    {
+      if (error) return;
+
+      for (size_t i = 0; i < workers.size(); ++i)
+      {
+        if (workers[i]->ready && !workers[i]->checking) Check(*workers[i]);
+      }
+
+      Health();
+    });
+  }
+
+  //! Check whether the given worker answers; a worker that answers is
+  // registered again.
+  void Check(Worker& worker)
+  {
+    const pid_t pid = worker.pid;
+    worker.checking = true;
+
+    std::shared_ptr<Request> request(new Request(ioService, worker.host,
+        worker.port, messages::GetEndpoint(), [this, &worker, pid](
+        const bool answered, const std::string&)
+    {
+      if (worker.pid != pid) return;
+      if (!worker.ready || stopping)
+      {
+        worker.checking = false;
+        return;
+      }
+
+      if (answered)
+      {
+        worker.checking = false;
+        worker.failures = 0;
+        balancer.Send(messages::AddEndpoint(worker.host, worker.port));
+        return;
+      }
+
+      Unanswered(worker);
+    }));
+
+    request->Start();
+  }
+
+  //! Ask the balancer whether the given worker that didn't answer is leased
+  // by a client; restart the worker if it isn't and failed too many checks.
+  void Unanswered(Worker& worker)
+  {
+    const pid_t pid = worker.pid;
+    std::shared_ptr<Request> request(new Request(ioService, balancer.Host(),
+        balancer.Port(), messages::GetEndpointLeased(worker.host,
+        worker.port), [this, &worker, pid](const bool answered,
+        const std::string& reply)
+    {
+      if (worker.pid != pid) return;
+      worker.checking = false;
+
+      // The state of the worker is unknown without the balancer.
+      if (!answered || !worker.ready || stopping) return;
+
+      if (reply.find("true") != std::string::npos)
+      {
+        worker.failures = 0;
+        return;
+      }
+
+      if (++worker.failures < maxHealthFailures) return;
+
+      std::cout << "Worker unresponsive: " << endpoint::Name(worker.host,
+          worker.port) << std::endl;
+
+      // The exit of the worker removes it from the balancer and restarts it.
+      kill(-worker.pid, SIGKILL);
+    }));
+
+    request->Start();
+  }
+
+  //! Get the number of running workers.
+  size_t Running() const
+  {
+    size_t running = 0;
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+      if (workers[i]->pid != 0) ++running;
+    }
+
+    return running;
+  }
+
+  //! Cancel the remaining operations once all workers exited, the io service
+  // returns once the balancer commands are written.
+  void Finish()
+  {
+    boost::system::error_code ignored;
+    children.cancel(ignored);
+    signals.cancel(ignored);
+    stopTimer.cancel(ignored);
+  }
+
+  //! Locally stored io service.
+  boost::asio::io_service& ioService;
+
+  //! Locally stored balancer connection.
+  Balancer& balancer;
+
+  //! Locally stored command and arguments of the workers.
+  std::vector<std::string> command;
+
+  //! Locally stored workers.
+  std::vector<std::unique_ptr<Worker> > workers;
+
+  //! Locally stored signal set that reports exited workers.
+  boost::asio::signal_set children;
+
+  //! Locally stored signal set that stops the supervisor.
+  boost::asio::signal_set signals;
+
+  //! Locally stored timer of the next health check.
+  boost::asio::deadline_timer health;
+
+  //! Locally stored timer that kills the workers that don't stop.
+  boost::asio::deadline_timer stopTimer;
+
+  //! Locally stored indication if the workers are stopped.
+  bool stopping;
+};
+
+int main(int argc, char* argv[])
+{
+  if (argc < 5)
+  {
+    std::cout << "Usage: <balancer host:port|unix:path> <workers> "
+              << "<host:first port|unix:path> <command> [<arguments>...]\n";
+    return 1;
+  }
+
+  std::string balancerHost, balancerPort;
+  if (!endpoint::Split(argv[1], balancerHost, balancerPort))
+  {
+    std::cout << "Invalid balancer endpoint " << argv[1] << "\n";
+    return 1;
+  }
+
+  const int count = std::atoi(argv[2]);
+  std::string host, port;
+  if (count < 1 || !endpoint::Split(argv[3], host, port))
+  {
+    std::cout << "Invalid workers " << argv[2] << " " << argv[3] << "\n";
+    return 1;
+  }
+
+  try
+  {
+    boost::asio::io_service ioService;
+    Balancer balancer(ioService, balancerHost, balancerPort);
+    Supervisor supervisor(ioService, balancer, count, host, port,
+        std::vector<std::string>(argv + 4, argv + argc));
+    ioService.run();
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * @file racing_test.cpp
+ * @author Marcus Edel
+ *
+ * Tests for the racing cut of hopeless episodes.
+ */
+#define BOOST_TEST_MODULE RacingTest
+
+#include "racing.hpp"
+
+#include <boost/test/included/unit_test.hpp>
+
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(RacingTest);
+
+/**
+ * The episodes of the first generation are never cut.
+ */
+BOOST_AUTO_TEST_CASE(FirstGenerationTest)
+{
+  racing::Racing race(3, 1, 1, 1);
+  const std::vector<int> curve(2, 10);
+
+  race.Record(1, 100, curve);
+  race.Record(2, 90, curve);
+  BOOST_REQUIRE(!race.Hopeless(0, 0));
+  BOOST_REQUIRE(!race.Hopeless(1, 0));
+}
+
+/**
+ * The threshold and the gains are taken from the finished generation, the
+ * episodes of the current generation don't change them.
+ */
+BOOST_AUTO_TEST_CASE(FrozenThresholdTest)
+{
+  racing::Racing race(2, 1, 1, 1);
+  std::vector<int> curve(1, 10);
+
+  // The best episode reached 100, the largest gain after the first
+  // checkpoint is 90.
+  race.Record(1, 100, curve);
+  race.Record(2, 50, curve);
+  BOOST_REQUIRE(race.Hopeless(0, 9));
+  BOOST_REQUIRE(!race.Hopeless(0, 10));
+
+  // A better episode of the current generation doesn't raise the threshold.
+  curve[0] = 20;
+  race.Record(3, 1000, curve);
+  BOOST_REQUIRE(race.Hopeless(0, 9));
+  BOOST_REQUIRE(!race.Hopeless(0, 10));
+
+  // The next generation uses the finished one.
+  race.Record(4, 20, curve);
+  BOOST_REQUIRE(race.Hopeless(0, 9));
+  BOOST_REQUIRE(race.Hopeless(0, 10));
+  BOOST_REQUIRE(!race.Hopeless(0, 20));
+}
+
+/**
+ * The cut doesn't depend on the order in which the episodes of a generation
+ * finish.
+ */
+BOOST_AUTO_TEST_CASE(OrderTest)
+{
+  racing::Racing forward(3, 1, 1, 1);
+  racing::Racing backward(3, 1, 1, 1);
+  const std::vector<int> curve(1, 10);
+  const int progress[] = { 30, 200, 60 };
+
+  for (size_t i = 0; i < 3; ++i)
+  {
+    forward.Record(i, progress[i], curve);
+    backward.Record(2 - i, progress[2 - i], curve);
+
+    for (int p = 0; p < 200; p += 5)
+    {
+      BOOST_REQUIRE_EQUAL(forward.Hopeless(0, p), backward.Hopeless(0, p));
+    }
+  }
+
+  for (int p = 0; p < 200; p += 5)
+  {
+    BOOST_REQUIRE_EQUAL(forward.Hopeless(0, p), backward.Hopeless(0, p));
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
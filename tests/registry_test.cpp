@@ -0,0 +1,154 @@
+/**
+ * @file registry_test.cpp
+ * @author Marcus Edel
+ *
+ * Tests for the lease and probe handling of the balancer endpoint registry.
+ */
+#define BOOST_TEST_MODULE RegistryTest
+
+#include "registry.hpp"
+
+#include <boost/test/included/unit_test.hpp>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(RegistryTest);
+
+/**
+ * Every free endpoint is leased once, a further get finds no free endpoint.
+ */
+BOOST_AUTO_TEST_CASE(LeaseFreeEndpointsTest)
+{
+  registry::Registry registry(1, 60, 3);
+  registry.Add("127.0.0.1", "4561");
+  registry.Add("127.0.0.1", "4562");
+
+  std::string host, port;
+  BOOST_REQUIRE(registry.Lease(registry.Owner(), host, port));
+  BOOST_REQUIRE(registry.Lease(registry.Owner(), host, port));
+  BOOST_REQUIRE(!registry.Lease(registry.Owner(), host, port));
+}
+
+/**
+ * A get that arrives while the free endpoints are probed leases a probed
+ * endpoint instead of finding no free endpoint.
+ */
+BOOST_AUTO_TEST_CASE(GetDuringProbeTest)
+{
+  registry::Registry registry(1, 60, 1);
+  registry.Add("127.0.0.1", "4561");
+  registry.Add("127.0.0.1", "4562");
+
+  std::vector<std::pair<std::string, std::string> > probes;
+  registry.StartProbes(probes);
+  BOOST_REQUIRE_EQUAL(probes.size(), 2);
+
+  std::string host, port;
+  BOOST_REQUIRE(registry.Lease(registry.Owner(), host, port));
+  BOOST_REQUIRE(registry.Lease(registry.Owner(), host, port));
+  BOOST_REQUIRE(!registry.Lease(registry.Owner(), host, port));
+}
+
+/**
+ * The failed probe of an endpoint that was leased during the probe neither
+ * frees nor drops the endpoint.
+ */
+BOOST_AUTO_TEST_CASE(ProbeOfLeasedEndpointTest)
+{
+  registry::Registry registry(1, 60, 1);
+  registry.Add("127.0.0.1", "4561");
+
+  std::vector<std::pair<std::string, std::string> > probes;
+  registry.StartProbes(probes);
+  BOOST_REQUIRE_EQUAL(probes.size(), 1);
+
+  const size_t owner = registry.Owner();
+  std::string host, port;
+  BOOST_REQUIRE(registry.Lease(owner, host, port));
+
+  registry.FinishProbe(host, port, false);
+  BOOST_REQUIRE_EQUAL(registry.Size(), 1);
+  BOOST_REQUIRE(!registry.Lease(registry.Owner(), host, port));
+
+  // The endpoint is free again once the lease is released.
+  registry.Release(owner, host, port);
+  BOOST_REQUIRE(registry.Lease(registry.Owner(), host, port));
+}
+
+/**
+ * The failed probe of an endpoint that was leased and released during the
+ * probe is ignored as well.
+ */
+BOOST_AUTO_TEST_CASE(ProbeOfReleasedEndpointTest)
+{
+  registry::Registry registry(1, 60, 1);
+  registry.Add("127.0.0.1", "4561");
+
+  std::vector<std::pair<std::string, std::string> > probes;
+  registry.StartProbes(probes);
+
+  const size_t owner = registry.Owner();
+  std::string host, port;
+  BOOST_REQUIRE(registry.Lease(owner, host, port));
+  registry.Release(owner, host, port);
+
+  registry.FinishProbe(host, port, false);
+  BOOST_REQUIRE_EQUAL(registry.Size(), 1);
+}
+
+/**
+ * An idle endpoint that fails too many probes is dropped, a successful probe
+ * resets the failures.
+ */
+BOOST_AUTO_TEST_CASE(ProbeFailuresTest)
+{
+  registry::Registry registry(1, 60, 2);
+  registry.Add("127.0.0.1", "4561");
+
+  std::vector<std::pair<std::string, std::string> > probes;
+  registry.StartProbes(probes);
+  registry.FinishProbe("127.0.0.1", "4561", false);
+  registry.StartProbes(probes);
+  registry.FinishProbe("127.0.0.1", "4561", true);
+  registry.StartProbes(probes);
+  registry.FinishProbe("127.0.0.1", "4561", false);
+  BOOST_REQUIRE_EQUAL(registry.Size(), 1);
+
+  // The endpoint is free between the probes.
+  std::string host, port;
+  const size_t owner = registry.Owner();
+  BOOST_REQUIRE(registry.Lease(owner, host, port));
+  registry.Release(owner, host, port);
+
+  registry.StartProbes(probes);
+  registry.FinishProbe("127.0.0.1", "4561", false);
+  BOOST_REQUIRE_EQUAL(registry.Size(), 0);
+}
+
+/**
+ * Only leased endpoints are reported as leased, probed endpoints aren't.
+ */
+BOOST_AUTO_TEST_CASE(LeasedTest)
+{
+  registry::Registry registry(1, 60, 3);
+  registry.Add("127.0.0.1", "4561");
+
+  bool leased = true;
+  BOOST_REQUIRE(registry.Leased("127.0.0.1", "4561", leased));
+  BOOST_REQUIRE(!leased);
+  BOOST_REQUIRE(!registry.Leased("127.0.0.1", "4562", leased));
+
+  std::vector<std::pair<std::string, std::string> > probes;
+  registry.StartProbes(probes);
+  BOOST_REQUIRE(registry.Leased("127.0.0.1", "4561", leased));
+  BOOST_REQUIRE(!leased);
+
+  std::string host, port;
+  BOOST_REQUIRE(registry.Lease(registry.Owner(), host, port));
+  BOOST_REQUIRE(registry.Leased("127.0.0.1", "4561", leased));
+  BOOST_REQUIRE(leased);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
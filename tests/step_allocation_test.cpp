@@ -0,0 +1,295 @@
+/**
+ * @file step_allocation_test.cpp
+ * @author Marcus Edel
+ *
+ * Tests that the steady-state steps of the Super Mario Bros. task don't
+ * allocate. The steps are played on the mock emulator, whose path is the
+ * first argument of the test.
+ */
+#define BOOST_TEST_MODULE StepAllocationTest
+
+#include "SuperMarioBros/super_mario_bros.hpp"
+
+#include <boost/config.hpp>
+#include <boost/test/included/unit_test.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//! The number of heap allocations of the current thread, counted by the
+// replaced operator new.
+static thread_local size_t allocations = 0;
+
+// Every replaced operator new allocates with malloc and every operator delete
+// frees with free, see benchmark.cpp.
+
+void* operator new(std::size_t size)
+{
+  ++allocations;
+  if (void* pointer = std::malloc(size ? size : 1)) return pointer;
+
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+  ++allocations;
+  if (void* pointer = std::malloc(size ? size : 1)) return pointer;
+
+  throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  ++allocations;
+  return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  ++allocations;
+  return std::malloc(size ? size : 1);
+}
+
+BOOST_NOINLINE void operator delete(void* pointer) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete[](void* pointer) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete(void* pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete[](void* pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete(void* pointer,
+                                    const std::nothrow_t&) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete[](void* pointer,
+                                      const std::nothrow_t&) noexcept
+{
+  std::free(pointer);
+}
+
+/**
+ * Start the mock emulator on a unix domain socket for the lifetime of a
+ * test; the tasks of the test connect to it directly.
+ */
+struct EmulatorFixture
+{
+  EmulatorFixture() :
+      host("unix:/tmp/nes-step-allocation-" + std::to_string(::getpid())),
+      pid(-1)
+  {
+    BOOST_REQUIRE_MESSAGE(
+        boost::unit_test::framework::master_test_suite().argc > 1,
+        "Usage: step_allocation_test <emulator>");
+    const std::string emulator(
+        boost::unit_test::framework::master_test_suite().argv[1]);
+
+    pid = ::fork();
+    BOOST_REQUIRE(pid >= 0);
+    if (pid == 0)
+    {
+      ::execl(emulator.c_str(), emulator.c_str(), host.c_str(), (char*) NULL);
+      std::perror("execl");
+      ::_exit(1);
+    }
+
+    // Wait until the emulator accepts connections.
+    for (size_t attempt = 0; attempt < 100; ++attempt)
+    {
+      try
+      {
+        client::Client client;
+        client.Connect(host, "");
+        return;
+      }
+      catch (...)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+    }
+
+    BOOST_FAIL("The emulator doesn't accept connections.");
+  }
+
+  ~EmulatorFixture()
+  {
+    if (pid > 0)
+    {
+      ::kill(pid, SIGTERM);
+      ::waitpid(pid, NULL, 0);
+    }
+    ::unlink(endpoint::Path(host).c_str());
+  }
+
+  //! The unix domain socket of the emulator.
+  std::string host;
+
+  //! The process of the emulator.
+  pid_t pid;
+};
+
+/**
+ * Create the seed genome of the task: the inputs and the bias are connected
+ * to a single hidden neuron, which is connected to every output.
+ */
+mlpack::ne::Genome SeedGenome()
+{
+  using namespace mlpack::ne;
+
+  std::vector<NeuronGene> neuronGenes;
+  for (size_t i = 0; i < 169; ++i)
+  {
+    neuronGenes.push_back(NeuronGene(i, INPUT, LINEAR, 0, 0, 0));
+  }
+  neuronGenes.push_back(NeuronGene(169, BIAS, LINEAR, 0, 0, 0));
+  for (size_t i = 170; i < 175; ++i)
+  {
+    neuronGenes.push_back(NeuronGene(i, OUTPUT, SIGMOID, 1, 0, 0));
+  }
+  neuronGenes.push_back(NeuronGene(175, HIDDEN, SIGMOID, 0.5, 0, 0));
+
+  std::vector<LinkGene> linkGenes;
+  for (size_t i = 0; i < 170; ++i)
+  {
+    linkGenes.push_back(LinkGene(i, 175, i, 0, true));
+  }
+  for (size_t i = 170; i < 175; ++i)
+  {
+    linkGenes.push_back(LinkGene(175, i, i, 0, true));
+  }
+
+  return Genome(0, neuronGenes, linkGenes, 170, 5, -1);
+}
+
+/**
+ * Play the given number of episodes of the seed genome with a single session
+ * and count the steady-state steps that allocate. The first episodes fill
+ * the buffers of the session, the prefix tree, the racing curves and the
+ * trajectory log; the first step of an episode (the compiled network is
+ * checked against the genome) and the step that leaves the recorded
+ * prefixes (the emulator is brought into the state of the node) aren't
+ * steady-state steps.
+ *
+ * @param task The task used to play the episodes.
+ * @param episodes The number of episodes.
+ * @param warmup The number of episodes that aren't checked.
+ * @param checked The number of checked steps.
+ * @param prefixSteps The number of checked steps taken from the prefix tree.
+ * @return The number of checked steps that allocated.
+ */
+size_t AllocatingSteps(TaskSuperMarioBros& task,
+                       const size_t episodes,
+                       const size_t warmup,
+                       size_t& checked,
+                       size_t& prefixSteps)
+{
+  mlpack::ne::Genome genome = SeedGenome();
+  std::unique_ptr<session::Session> session = task.Sessions().Acquire();
+
+  size_t allocating = 0;
+  checked = 0;
+  prefixSteps = 0;
+  for (size_t e = 0; e < episodes; ++e)
+  {
+    // The trajectory buffer of the last episode is reused once the writer
+    // wrote it.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    TaskSuperMarioBros::EpisodeState episode(genome);
+    BOOST_REQUIRE(task.Begin(*session, episode));
+
+    while (true)
+    {
+      const bool first = episode.step == 0;
+      const bool live = episode.live;
+      const size_t allocated = allocations;
+      if (!task.Advance(*session, episode)) break;
+
+      if (e < warmup || first || live != episode.live) continue;
+
+      ++checked;
+      if (!live) ++prefixSteps;
+      if (allocations != allocated) ++allocating;
+    }
+
+    BOOST_REQUIRE(episode.complete);
+    task.End(episode, 0);
+  }
+
+  task.Release(std::move(session));
+  return allocating;
+}
+
+BOOST_FIXTURE_TEST_SUITE(StepAllocationTest, EmulatorFixture);
+
+/**
+ * The steps played on the emulator don't allocate, using the binary and the
+ * JSON protocol.
+ */
+BOOST_AUTO_TEST_CASE(LiveStepTest)
+{
+  const messages::Protocol protocols[] = { messages::BINARY, messages::JSON };
+  for (size_t p = 0; p < 2; ++p)
+  {
+    const std::string log = endpoint::Path(host) + ".trajectory";
+    {
+      TaskSuperMarioBros task(host, "", protocols[p]);
+      task.PopulationSize(1);
+      task.Racing(1);
+      task.Record(log);
+
+      size_t checked, prefixSteps;
+      BOOST_REQUIRE_EQUAL(AllocatingSteps(task, 4, 2, checked, prefixSteps),
+          0);
+      BOOST_REQUIRE_GT(checked, 10);
+    }
+    ::unlink(log.c_str());
+  }
+}
+
+/**
+ * The steps taken from the prefix tree of the session don't allocate.
+ */
+BOOST_AUTO_TEST_CASE(PrefixStepTest)
+{
+  const std::string log = endpoint::Path(host) + ".trajectory";
+  {
+    TaskSuperMarioBros task(host, "");
+    task.Prefix(true);
+    task.PopulationSize(1);
+    task.Racing(1);
+    task.Record(log);
+
+    size_t checked, prefixSteps;
+    BOOST_REQUIRE_EQUAL(AllocatingSteps(task, 4, 2, checked, prefixSteps), 0);
+    BOOST_REQUIRE_GT(prefixSteps, 10);
+  }
+  ::unlink(log.c_str());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
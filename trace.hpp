@@ -0,0 +1,433 @@
+/**
+ * @file trace.hpp
+ * @author Marcus Edel
+ *
+ * Capture of the client messages for the replay load generator.
+ */
+#ifndef NES_TRACE_HPP
+#define NES_TRACE_HPP
+
+#include "messages.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace trace {
+
+/**
+ * Get the kind of the given request: the most significant command of the
+ * message (sequence, step, image, reset, info, state, config, key), protocol
+ * for the protocol switch and balancer for the balancer commands.
+ *
+ * @param protocol The protocol of the message.
+ * @param data The message without the framing.
+ * @param size The size of the message.
+ */
+inline const char* Kind(const messages::Protocol protocol,
+                        const char* data,
+                        const size_t size)
+{
+  // Ordered by significance.
+  static const char* kinds[] = { "key", "config", "state", "info", "reset",
+      "image", "step", "sequence", "protocol" };
+  size_t kind = 0;
+
+  if (protocol == messages::BINARY)
+  {
+    namespace binary = messages::binary;
+
+    // Walk the commands, see messages::binary for the argument sizes.
+    for (size_t i = 0; i + 1 < size;)
+    {
+      const uint8_t value = uint8_t(data[i + 1]);
+      switch (uint8_t(data[i]))
+      {
+        case binary::KEY:
+          i += 2;
+          break;
+        case binary::GAME:
+          kind = std::max(kind, size_t(value == binary::GAME_RESET ? 4 :
+              value == binary::GAME_IMAGE ? 5 : 3));
+          i += 2;
+          break;
+        case binary::CONFIG:
+          kind = std::max(kind, size_t(value == binary::CONFIG_PROTOCOL ?
+              8 : 1));
+          i += 6;
+          break;
+        case binary::STEP:
+          kind = std::max(kind, size_t(6));
+          i += 2;
+          break;
+        case binary::SEQUENCE:
+          kind = std::max(kind, size_t(7));
+          i += 2 + 3 * size_t(value);
+          break;
+        case binary::STATE:
+          kind = std::max(kind, size_t(2));
+          i += 4;
+          break;
+        default:
+          return "unknown";
+      }
+    }
+
+    return kinds[kind];
+  }
+
+  const std::string message(data, size);
+  if (message.empty() || message[0] != '{') return "balancer";
+
+  if (message.find("\"sequence\"") != std::string::npos) return "sequence";
+  if (message.find("\"step\"") != std::string::npos) return "step";
+  if (message.find("\"Image\"") != std::string::npos) return "image";
+  if (message.find("\"Reset\"") != std::string::npos) return "reset";
+  if (message.find("\"Info\"") != std::string::npos ||
+      message.find("\"Tiles\"") != std::string::npos) return "info";
+  if (message.find("\"savestate\"") != std::string::npos) return "state";
+  if (message.find("\"protocol\"") != std::string::npos) return "protocol";
+  if (message.find("\"config\"") != std::string::npos) return "config";
+
+  return "key";
+}
+
+/**
+ * Get the kind of the given reply: the reply opcode of a binary reply, the
+ * JSON replies are only told apart for the balancer and missing savestates.
+ *
+ * @param protocol The protocol of the reply.
+ * @param data The reply without the framing.
+ * @param size The size of the reply.
+ */
+inline const char* ReplyKind(const messages::Protocol protocol,
+                             const char* data,
+                             const size_t size)
+{
+  if (protocol == messages::BINARY)
+  {
+    switch (size ? uint8_t(data[0]) : 0)
+    {
+      case messages::binary::REPLY_INFO:
+        return "info";
+      case messages::binary::REPLY_TILES:
+        return "tiles";
+      case messages::binary::REPLY_IMAGE:
+        return "image";
+      case messages::binary::REPLY_PROTOCOL:
+        return "protocol";
+      case messages::binary::REPLY_DELTA:
+        return "delta";
+      case messages::binary::REPLY_TRAJECTORY:
+        return "trajectory";
+      case messages::binary::REPLY_FRAME:
+        return "frame";
+      case messages::binary::REPLY_MISSING:
+        return "missing";
+      default:
+        return "unknown";
+    }
+  }
+
+  const std::string reply(data, std::min(size, size_t(16)));
+  if (reply.compare(0, 10, "{\"missing\"") == 0) return "missing";
+  if (reply.compare(0, 11, "{\"endpoint\"") == 0) return "endpoint";
+  if (reply.compare(0, 8, "{\"count\"") == 0) return "count";
+
+  return "reply";
+}
+
+//! The type of a trace event.
+enum EventType
+{
+  CONNECT,
+  SEND,
+  RECEIVE,
+  CLOSE
+};
+
+/**
+ * A single trace event.
+ */
+struct Event
+{
+  //! The time of the event in microseconds since the start of the trace.
+  uint64_t time;
+
+  //! The id of the connection.
+  size_t connection;
+
+  //! The type of the event.
+  EventType type;
+
+  //! The protocol of the message.
+  messages::Protocol protocol;
+
+  //! The kind of the message (see Kind and ReplyKind).
+  std::string kind;
+
+  //! The size of the message.
+  size_t size;
+
+  //! The message of a send event.
+  std::string payload;
+
+  //! The host name of a connect event.
+  std::string host;
+
+  //! The port of a connect event, empty for unix domain sockets.
+  std::string port;
+};
+
+/**
+ * The Tracer appends the messages of all clients to a trace file, one event
+ * per line:
+ *
+ * <time (us)> <connection> connect <host> <port|->
+ * <time (us)> <connection> send <json|binary> <kind> <size> <message (hex)>
+ * <time (us)> <connection> receive <json|binary> <kind> <size>
+ * <time (us)> <connection> close
+ *
+ * The messages are stored without the framing; the replies are only stored as
+ * kind and size. A send event is written before the message is sent and a
+ * receive event once the reply is received, so the time between them is the
+ * latency of the request.
+ *
+ * The events of all threads are serialized by a mutex; the line is built in a
+ * buffer of the tracer, so tracing doesn't allocate once the buffer is large
+ * enough.
+ */
+class Tracer
+{
+ public:
+  /**
+   * Create the trace file.
+   *
+   * @param path The trace file, an existing file is replaced.
+   */
+  explicit Tracer(const std::string& path) :
+      start(std::chrono::steady_clock::now()),
+      connections(0)
+  {
+    file = std::fopen(path.c_str(), "w");
+    if (!file)
+    {
+      throw std::runtime_error("Could not open the trace " + path + ".");
+    }
+
+    std::fputs("# nes trace 1\n", file);
+  }
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  //! Close the trace file.
+  ~Tracer()
+  {
+    std::fclose(file);
+  }
+
+  /**
+   * Get the tracer of the process, NULL if tracing is disabled. Set the
+   * NES_TRACE environment variable to the trace file to enable tracing.
+   */
+  static Tracer* Global()
+  {
+    static std::unique_ptr<Tracer> tracer(std::getenv("NES_TRACE") &&
+        *std::getenv("NES_TRACE") ? new Tracer(std::getenv("NES_TRACE")) :
+        NULL);
+    return tracer.get();
+  }
+
+  //! Get a new connection id.
+  size_t Connection() { return ++connections; }
+
+  //! Trace the established connection to the given endpoint.
+  void Connect(const size_t connection,
+               const std::string& host,
+               const std::string& port)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Begin(connection, "connect");
+    line.append(host);
+    line.push_back(' ');
+    line.append(port.empty() ? "-" : port);
+    End(true);
+  }
+
+  //! Trace the given message before it is sent.
+  void Send(const size_t connection,
+            const messages::Protocol protocol,
+            const char* data,
+            const size_t size)
+  {
+    static const char digits[] = "0123456789abcdef";
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Begin(connection, "send");
+    Message(protocol, Kind(protocol, data, size), size);
+    line.push_back(' ');
+    for (size_t i = 0; i < size; ++i)
+    {
+      line.push_back(digits[uint8_t(data[i]) >> 4]);
+      line.push_back(digits[uint8_t(data[i]) & 0xF]);
+    }
+    End(false);
+  }
+
+  //! Trace the given received reply.
+  void Receive(const size_t connection,
+               const messages::Protocol protocol,
+               const char* data,
+               const size_t size)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Begin(connection, "receive");
+    Message(protocol, ReplyKind(protocol, data, size), size);
+    End(false);
+  }
+
+  //! Trace the closed connection.
+  void Close(const size_t connection)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Begin(connection, "close");
+    line.resize(line.size() - 1);
+    End(true);
+  }
+
+ private:
+  //! Start a line with the time, the connection and the event type.
+  void Begin(const size_t connection, const char* type)
+  {
+    const uint64_t time = std::chrono::duration_cast<
+        std::chrono::microseconds>(std::chrono::steady_clock::now() -
+        start).count();
+
+    char prefix[64];
+    const int length = std::snprintf(prefix, sizeof(prefix), "%llu %zu %s ",
+        (unsigned long long) time, connection, type);
+    line.assign(prefix, length);
+  }
+
+  //! Append the protocol, kind and size of a message.
+  void Message(const messages::Protocol protocol,
+               const char* kind,
+               const size_t size)
+  {
+    char fields[64];
+    const int length = std::snprintf(fields, sizeof(fields), "%s %s %zu",
+        protocol == messages::BINARY ? "binary" : "json", kind, size);
+    line.append(fields, length);
+  }
+
+  //! Write the line; connection events are flushed, so the trace of a killed
+  // process contains the finished connections.
+  void End(const bool flush)
+  {
+    line.push_back('\n');
+    std::fwrite(line.data(), 1, line.size(), file);
+    if (flush) std::fflush(file);
+  }
+
+  //! Locally stored start of the trace.
+  std::chrono::steady_clock::time_point start;
+
+  //! Locally stored last connection id.
+  std::atomic<size_t> connections;
+
+  //! Locally stored trace file.
+  FILE* file;
+
+  //! Locally stored buffer of the current line.
+  std::string line;
+
+  //! Locally stored mutex that serializes the events.
+  std::mutex mutex;
+}; // class Tracer
+
+/**
+ * Load the events of the given trace file.
+ *
+ * @param path The trace file.
+ * @param events The events in file order.
+ */
+inline void Load(const std::string& path, std::vector<Event>& events)
+{
+  std::ifstream file(path.c_str());
+  if (!file.is_open())
+  {
+    throw std::runtime_error("Could not open the trace " + path + ".");
+  }
+
+  events.clear();
+  std::string line;
+  while (std::getline(file, line))
+  {
+    if (line.empty() || line[0] == '#') continue;
+
+    std::istringstream stream(line);
+    Event event;
+    std::string type;
+    stream >> event.time >> event.connection >> type;
+    event.protocol = messages::JSON;
+    event.size = 0;
+
+    if (type == "connect")
+    {
+      event.type = CONNECT;
+      stream >> event.host >> event.port;
+      if (event.port == "-") event.port.clear();
+    }
+    else if (type == "send" || type == "receive")
+    {
+      event.type = type == "send" ? SEND : RECEIVE;
+
+      std::string protocol, hex;
+      stream >> protocol >> event.kind >> event.size;
+      event.protocol = protocol == "binary" ? messages::BINARY :
+          messages::JSON;
+
+      // Only the requests are stored with the message.
+      if (event.type == SEND && event.size > 0)
+      {
+        stream >> hex;
+        if (hex.size() != 2 * event.size) continue;
+      }
+
+      event.payload.resize(hex.size() / 2);
+      for (size_t i = 0; i < event.payload.size(); ++i)
+      {
+        event.payload[i] = char(std::strtoul(hex.substr(2 * i, 2).c_str(),
+            NULL, 16));
+      }
+    }
+    else if (type == "close")
+    {
+      event.type = CLOSE;
+    }
+    else
+    {
+      continue;
+    }
+
+    // A killed process may leave an incomplete last line.
+    if (stream.fail()) continue;
+
+    events.push_back(event);
+  }
+}
+
+} // namespace trace
+
+#endif
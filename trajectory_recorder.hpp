@@ -0,0 +1,725 @@
+/**
+ * @file trajectory_recorder.hpp
+ * @author Marcus Edel
+ *
+ * Streaming binary trajectory log of the evaluated episodes.
+ */
+#ifndef NES_TRAJECTORY_RECORDER_HPP
+#define NES_TRAJECTORY_RECORDER_HPP
+
+#include "observation.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace trajectory {
+
+/*
+ * The log is a single file of fixed-size structures in host byte order:
+ *
+ * FileHeader | Block | records of the block | Block | records ...
+ *
+ * Every block starts with an index of up to BLOCK_EPISODES episodes followed
+ * by the records of these episodes; an episode is a contiguous run of
+ * recordSize byte records, one per step. The blocks are chained by their
+ * next offset, so a reader maps the file, walks the block headers and
+ * addresses any record of any episode directly (see Log). An index entry is
+ * written after the records of its episode, a log of a killed run is valid up
+ * to the last written entry.
+ */
+
+//! The magic number of the file header.
+const char MAGIC[8] = { 'N', 'E', 'S', 'T', 'R', 'A', 'J', '\0' };
+
+//! The version of the format.
+const uint32_t VERSION = 1;
+
+//! The number of episodes indexed by a block.
+const uint32_t BLOCK_EPISODES = 1024;
+
+//! The record flag of the last step of an episode.
+const uint8_t TERMINAL = 1;
+
+//! The episode flag of an episode without failed request or cut.
+const uint32_t COMPLETE = 1;
+
+//! The header at the start of the file.
+struct FileHeader
+{
+  //! The magic number, MAGIC.
+  char magic[8];
+
+  //! The version of the format, VERSION.
+  uint32_t version;
+
+  //! The size of a record in bytes.
+  uint32_t recordSize;
+
+  //! The number of tiles of a record.
+  uint32_t tiles;
+
+  //! The number of episodes indexed by a block.
+  uint32_t blockEpisodes;
+
+  //! The offset of the first block, 0 if no episode was written.
+  uint64_t firstBlock;
+
+  //! Reserved.
+  uint64_t reserved[4];
+};
+
+//! The index entry of an episode.
+struct EpisodeEntry
+{
+  //! The offset of the first record.
+  uint64_t offset;
+
+  //! The number of records.
+  uint32_t steps;
+
+  //! The episode flags (COMPLETE).
+  uint32_t flags;
+
+  //! The id of the genome.
+  int64_t genome;
+
+  //! The hash of the genome (fitness::FitnessCache::Hash), 0 if unknown.
+  uint64_t hash;
+
+  //! The fitness of the episode.
+  double fitness;
+};
+
+//! The header of a block.
+struct BlockHeader
+{
+  //! The offset of the next block, 0 for the last block.
+  uint64_t next;
+
+  //! The number of written entries.
+  uint64_t count;
+
+  //! The index of the episodes of the block.
+  EpisodeEntry entries[BLOCK_EPISODES];
+};
+
+//! The fixed part of a record; followed by the tiles (see
+// observation::Observation) and padded to a multiple of 8 bytes.
+struct Record
+{
+  //! The step of the episode.
+  uint32_t step;
+
+  //! The action played after the observation.
+  uint8_t action;
+
+  //! The record flags (TERMINAL).
+  uint8_t flags;
+
+  //! Reserved.
+  uint16_t reserved;
+
+  //! The reward of the action, the gain of the max x position.
+  float reward;
+
+  //! The x coordinate of mario.
+  int32_t marioPostionX;
+
+  //! The y coordinate of mario.
+  int32_t marioPostionY;
+
+  //! The number of lives.
+  int32_t marioLives;
+
+  //! The player state.
+  int32_t playerState;
+};
+
+//! Get the record size of the given number of tiles.
+inline size_t RecordSize(const size_t tiles)
+{
+  return (sizeof(Record) + tiles + 7) & ~size_t(7);
+}
+
+/**
+ * The records of a single episode, filled by the evaluation and written by
+ * the Recorder at the end of the episode. The buffer is taken from the
+ * recorder, so an episode doesn't allocate once the buffers reached the size
+ * of an episode.
+ */
+class Episode
+{
+ public:
+  //! Create an episode that doesn't record.
+  Episode() : active(false), tiles(0), recordSize(0), steps(0), entry()
+  {
+    /* Nothing to do here */
+  }
+
+  //! Whether the episode records.
+  bool Active() const { return active; }
+
+  /**
+   * Append the given observation and the action played after it; the reward
+   * is 0 until it is set with Reward.
+   *
+   * @param state The observation of the step.
+   * @param action The action played after the observation.
+   */
+  void Step(const observation::Observation& state, const size_t action)
+  {
+    if (!active) return;
+
+    // The record size is defined by the first observation.
+    if (recordSize == 0)
+    {
+      tiles = state.tiles.size();
+      recordSize = RecordSize(tiles);
+    }
+
+    const size_t offset = buffer.size();
+    buffer.resize(offset + recordSize);
+
+    Record record;
+    record.step = uint32_t(steps++);
+    record.action = uint8_t(action);
+    record.flags = 0;
+    record.reserved = 0;
+    record.reward = 0;
+    record.marioPostionX = state.marioPostionX;
+    record.marioPostionY = state.marioPostionY;
+    record.marioLives = state.marioLives;
+    record.playerState = state.playerState;
+
+    uint8_t* data = buffer.data() + offset;
+    std::memcpy(data, &record, sizeof(Record));
+    const size_t n = std::min(tiles, state.tiles.size());
+    std::memcpy(data + sizeof(Record), state.tiles.data(), n);
+    std::memset(data + sizeof(Record) + n, 0, recordSize - sizeof(Record) - n);
+  }
+
+  //! Set the reward of the last step.
+  void Reward(const float reward)
+  {
+    if (!active || steps == 0) return;
+
+    std::memcpy(buffer.data() + buffer.size() - recordSize +
+        offsetof(Record, reward), &reward, sizeof(float));
+  }
+
+ private:
+  friend class Recorder;
+
+  //! Locally stored indication if the episode records.
+  bool active;
+
+  //! Locally stored number of tiles of a record.
+  size_t tiles;
+
+  //! Locally stored record size.
+  size_t recordSize;
+
+  //! Locally stored number of records.
+  size_t steps;
+
+  //! Locally stored records.
+  std::vector<uint8_t> buffer;
+
+  //! Locally stored index entry, filled by Recorder::End.
+  EpisodeEntry entry;
+};
+
+/**
+ * The Recorder appends the finished episodes to the log using a background
+ * thread. The evaluation only copies the observation of every step into the
+ * buffer of its episode; End hands the episode to the writer and never waits
+ * for the file. The buffered episodes are bounded: an episode that doesn't
+ * fit into the buffer limit is dropped and counted (see Dropped), recording
+ * never stalls the evaluation.
+ *
+ * Begin and End can be called from several threads.
+ */
+class Recorder
+{
+ public:
+  /**
+   * Create the log and start the writer.
+   *
+   * @param path The log file, an existing file is replaced.
+   * @param maxBuffered The maximum size of the episodes waiting for the
+   *        writer in bytes.
+   */
+  Recorder(const std::string& path, const size_t maxBuffered = 64 << 20) :
+      path(path),
+      maxBuffered(maxBuffered),
+      buffered(0),
+      stop(false),
+      dropped(0),
+      written(0),
+      failed(false),
+      end(0),
+      block(0),
+      blockCount(0),
+      recordSize(0)
+  {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+      throw std::runtime_error("Could not open the trajectory log " + path +
+          ": " + std::strerror(errno) + ".");
+    }
+
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.blockEpisodes = BLOCK_EPISODES;
+    if (!Write(&header, sizeof(header), 0))
+    {
+      ::close(fd);
+      throw std::runtime_error("Could not write the trajectory log " + path +
+          ".");
+    }
+    end = sizeof(header);
+
+    writer = std::thread(&Recorder::Writer, this);
+  }
+
+  Recorder(const Recorder&) = delete;
+  Recorder& operator=(const Recorder&) = delete;
+
+  //! Write the buffered episodes and close the log.
+  ~Recorder()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    ready.notify_one();
+    writer.join();
+
+    ::close(fd);
+  }
+
+  /**
+   * Start recording the given episode.
+   *
+   * @param episode The episode, the records of an earlier use are dropped.
+   */
+  void Begin(Episode& episode)
+  {
+    episode.active = true;
+    episode.tiles = 0;
+    episode.recordSize = 0;
+    episode.steps = 0;
+
+    // Reuse the buffer of a written episode.
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!buffers.empty())
+    {
+      episode.buffer.swap(buffers.back());
+      buffers.pop_back();
+    }
+    episode.buffer.clear();
+  }
+
+  /**
+   * Hand the given episode to the writer; the episode is dropped if the
+   * buffer limit is reached.
+   *
+   * @param episode The episode.
+   * @param genome The id of the genome.
+   * @param hash The hash of the genome, 0 if unknown.
+   * @param fitness The fitness of the episode.
+   * @param complete Whether no request of the episode failed and the episode
+   *        wasn't cut.
+   */
+  void End(Episode& episode,
+           const int64_t genome,
+           const uint64_t hash,
+           const double fitness,
+           const bool complete)
+  {
+    if (!episode.active) return;
+    episode.active = false;
+
+    if (episode.steps != 0)
+    {
+      episode.buffer[episode.buffer.size() - episode.recordSize +
+          offsetof(Record, flags)] |= TERMINAL;
+    }
+
+    episode.entry.offset = 0;
+    episode.entry.steps = uint32_t(episode.steps);
+    episode.entry.flags = complete ? COMPLETE : 0;
+    episode.entry.genome = genome;
+    episode.entry.hash = hash;
+    episode.entry.fitness = fitness;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (failed || buffered + episode.buffer.size() > maxBuffered)
+      {
+        ++dropped;
+        return;
+      }
+
+      buffered += episode.buffer.size();
+      queue.push_back(Episode());
+      queue.back().recordSize = episode.recordSize;
+      queue.back().tiles = episode.tiles;
+      queue.back().entry = episode.entry;
+      queue.back().buffer.swap(episode.buffer);
+    }
+    ready.notify_one();
+  }
+
+  //! Get the number of dropped episodes.
+  size_t Dropped()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped;
+  }
+
+  //! Get the number of written episodes.
+  size_t Written()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return written;
+  }
+
+ private:
+  //! Write the queued episodes until the recorder is destroyed.
+  void Writer()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+      ready.wait(lock, [this]() { return stop || !queue.empty(); });
+      if (queue.empty()) return;
+
+      Episode episode;
+      episode.recordSize = queue.front().recordSize;
+      episode.tiles = queue.front().tiles;
+      episode.entry = queue.front().entry;
+      episode.buffer.swap(queue.front().buffer);
+      queue.pop_front();
+
+      lock.unlock();
+      const bool success = Append(episode);
+      lock.lock();
+
+      buffered -= episode.buffer.size();
+      if (success)
+      {
+        ++written;
+      }
+      else
+      {
+        ++dropped;
+      }
+
+      // Keep a few buffers for the next episodes.
+      if (buffers.size() < 64)
+      {
+        buffers.push_back(std::vector<uint8_t>());
+        buffers.back().swap(episode.buffer);
+      }
+    }
+  }
+
+  //! Append the given episode and its index entry, called by the writer.
+  bool Append(Episode& episode)
+  {
+    if (failed) return false;
+
+    // The first episode defines the record size of the log.
+    bool changed = false;
+    if (header.recordSize == 0 && episode.recordSize != 0)
+    {
+      header.recordSize = uint32_t(episode.recordSize);
+      header.tiles = uint32_t(episode.tiles);
+      recordSize = episode.recordSize;
+      changed = true;
+    }
+
+    if (episode.recordSize != 0 && episode.recordSize != recordSize)
+    {
+      std::cerr << "Trajectory log: episode with " << episode.tiles
+                << " tiles dropped." << std::endl;
+      return false;
+    }
+
+    // Start a new block once the index of the last block is full.
+    if (block == 0 || blockCount == BLOCK_EPISODES)
+    {
+      const uint64_t offset = end;
+      BlockHeader empty;
+      std::memset(&empty, 0, sizeof(empty));
+      if (!Write(&empty, sizeof(empty), offset)) return Fail();
+      end += sizeof(empty);
+
+      // Link the new block once it exists.
+      if (block == 0)
+      {
+        header.firstBlock = offset;
+        changed = true;
+      }
+      else if (!Write(&offset, sizeof(offset), block +
+          offsetof(BlockHeader, next)))
+      {
+        return Fail();
+      }
+
+      block = offset;
+      blockCount = 0;
+    }
+
+    if (changed && !Write(&header, sizeof(header), 0)) return Fail();
+
+    // Records first, so an entry never refers to missing records.
+    episode.entry.offset = end;
+    if (!Write(episode.buffer.data(), episode.buffer.size(), end))
+    {
+      return Fail();
+    }
+    end += episode.buffer.size();
+
+    const uint64_t count = blockCount + 1;
+    if (!Write(&episode.entry, sizeof(EpisodeEntry), block +
+        offsetof(BlockHeader, entries) + blockCount * sizeof(EpisodeEntry)) ||
+        !Write(&count, sizeof(count), block + offsetof(BlockHeader, count)))
+    {
+      return Fail();
+    }
+
+    blockCount = count;
+    return true;
+  }
+
+  //! Write the given data at the given offset.
+  bool Write(const void* data, size_t size, uint64_t offset)
+  {
+    const char* pointer = static_cast<const char*>(data);
+    while (size > 0)
+    {
+      const ssize_t n = ::pwrite(fd, pointer, size, off_t(offset));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+
+      pointer += n;
+      size -= size_t(n);
+      offset += uint64_t(n);
+    }
+
+    return true;
+  }
+
+  //! Stop writing after an error.
+  bool Fail()
+  {
+    std::cerr << "Trajectory log " << path << ": " << std::strerror(errno)
+              << ", recording stopped." << std::endl;
+    std::lock_guard<std::mutex> lock(mutex);
+    failed = true;
+    return false;
+  }
+
+  //! Locally stored path of the log.
+  std::string path;
+
+  //! Locally stored file descriptor of the log.
+  int fd;
+
+  //! Locally stored maximum size of the queued episodes.
+  size_t maxBuffered;
+
+  //! Locally stored size of the queued episodes.
+  size_t buffered;
+
+  //! Locally stored episodes waiting for the writer.
+  std::deque<Episode> queue;
+
+  //! Locally stored buffers of written episodes.
+  std::vector<std::vector<uint8_t> > buffers;
+
+  //! Locally stored indication if the writer should stop.
+  bool stop;
+
+  //! Locally stored number of dropped episodes.
+  size_t dropped;
+
+  //! Locally stored number of written episodes.
+  size_t written;
+
+  //! Locally stored indication if a write failed.
+  bool failed;
+
+  //! Locally stored mutex that guards the queue and the counters.
+  std::mutex mutex;
+
+  //! Locally stored condition that signals queued episodes.
+  std::condition_variable ready;
+
+  //! Locally stored writer thread.
+  std::thread writer;
+
+  // The following members are only used by the writer.
+
+  //! Locally stored file header.
+  FileHeader header;
+
+  //! Locally stored end of the log.
+  uint64_t end;
+
+  //! Locally stored offset of the last block, 0 if there is no block.
+  uint64_t block;
+
+  //! Locally stored number of entries of the last block.
+  uint64_t blockCount;
+
+  //! Locally stored record size of the log.
+  size_t recordSize;
+}; // class Recorder
+
+/**
+ * Read-only view of a trajectory log. The file is mapped and the block
+ * headers are walked once; the records are used in place, so any step of
+ * any episode is addressed without reading the rest of the log.
+ */
+class Log
+{
+ public:
+  /**
+   * Map the given log.
+   *
+   * @param path The log file.
+   */
+  explicit Log(const std::string& path) : data(nullptr), size(0)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      throw std::runtime_error("Could not open the trajectory log " + path +
+          ".");
+    }
+
+    struct stat status;
+    if (::fstat(fd, &status) != 0 ||
+        size_t(status.st_size) < sizeof(FileHeader))
+    {
+      ::close(fd);
+      throw std::runtime_error("Invalid trajectory log " + path + ".");
+    }
+
+    size = size_t(status.st_size);
+    void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+      throw std::runtime_error("Could not map the trajectory log " + path +
+          ".");
+    }
+    data = static_cast<const uint8_t*>(mapping);
+
+    if (std::memcmp(Header().magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        Header().version != VERSION ||
+        Header().blockEpisodes != BLOCK_EPISODES)
+    {
+      ::munmap(const_cast<uint8_t*>(data), size);
+      throw std::runtime_error("Invalid trajectory log " + path + ".");
+    }
+
+    // Only the entries whose records are within the file are used.
+    for (uint64_t offset = Header().firstBlock;
+        offset != 0 && offset + sizeof(BlockHeader) <= size;
+        offset = Block(offset).next)
+    {
+      const BlockHeader& block = Block(offset);
+      for (uint64_t i = 0; i < block.count && i < BLOCK_EPISODES; ++i)
+      {
+        const EpisodeEntry& entry = block.entries[i];
+        if (entry.offset + uint64_t(entry.steps) * Header().recordSize > size)
+        {
+          break;
+        }
+
+        entries.push_back(&entry);
+      }
+    }
+  }
+
+  Log(const Log&) = delete;
+  Log& operator=(const Log&) = delete;
+
+  //! Unmap the log.
+  ~Log()
+  {
+    ::munmap(const_cast<uint8_t*>(data), size);
+  }
+
+  //! Get the file header.
+  const FileHeader& Header() const
+  {
+    return *reinterpret_cast<const FileHeader*>(data);
+  }
+
+  //! Get the number of episodes.
+  size_t Episodes() const { return entries.size(); }
+
+  //! Get the index entry of the given episode.
+  const EpisodeEntry& Entry(const size_t episode) const
+  {
+    return *entries[episode];
+  }
+
+  //! Get the record of the given step of the given episode.
+  const Record& Step(const size_t episode, const size_t step) const
+  {
+    return *reinterpret_cast<const Record*>(data + entries[episode]->offset +
+        step * Header().recordSize);
+  }
+
+  //! Get the tiles of the given step of the given episode, Header().tiles
+  // values in column-major order.
+  const uint8_t* Tiles(const size_t episode, const size_t step) const
+  {
+    return reinterpret_cast<const uint8_t*>(&Step(episode, step)) +
+        sizeof(Record);
+  }
+
+ private:
+  //! Get the block at the given offset.
+  const BlockHeader& Block(const uint64_t offset) const
+  {
+    return *reinterpret_cast<const BlockHeader*>(data + offset);
+  }
+
+  //! Locally stored mapping of the log.
+  const uint8_t* data;
+
+  //! Locally stored size of the log.
+  size_t size;
+
+  //! Locally stored index entries of all episodes.
+  std::vector<const EpisodeEntry*> entries;
+}; // class Log
+
+} // namespace trajectory
+
+#endif